@@ -23,15 +23,137 @@
  *   E-mail 1 Value (созданная почта), E-mail 2 Value (почта ЛК), Phone 1 Value.
  * - Поля Organization Name, Organization Title, E-mail Labels, Phone Label НЕ ЗАПОЛНЯЮТСЯ.
  *
- * Компиляция (пример с g++):
- *   g++ bz4.googlecontacts -o bz4.googlecontacts -std=c++11 (или новее)
+ * Компиляция (Windows, Linux и другие системы):
+ *   cmake -S . -B build && cmake --build build
+ *   (Release с LTO; параметры BZ4_NATIVE, BZ4_PGO и поддержка .gz/.zst - см. CMakeLists.txt)
+ * или вручную (пример с g++):
+ *   g++ bz4.googlecontacts.cpp -o bz4.googlecontacts -std=c++17 -O2 -pthread
+ *   Поддержка сжатых файлов: -DBZ4_WITH_ZLIB -lz (gzip) и -DBZ4_WITH_ZSTD -lzstd (zstd).
  *
  * Использование:
  * 1. Поместите исходный CSV файл в ту же директорию, что и скомпилированная программа.
  * 2. Запустите программу: ./bz4.googlecontacts
  * 3. Или укажите имена файлов: ./bz4.googlecontacts "input.csv" "output.csv"
- * 4. Программа запросит название для группы контактов (Labels).
+ * 4. Программа запросит название для группы контактов (Labels),
+ *    если оно не задано параметром --label.
  * 5. Будет создан выходной CSV файл.
+ * 6. Для работы в конвейере вместо имен файлов укажите "-":
+ *    ... | ./bz4.googlecontacts --label "ПМ-35" - - | ...
+ *    Записи преобразуются по мере поступления, сообщения выводятся в stderr.
+ *
+ * Поля в кавычках могут содержать переводы строк: такая запись занимает
+ * несколько физических строк, но обрабатывается как одна строка данных.
+ *
+ * Сжатые выгрузки ("выгрузка.csv.gz", "выгрузка.csv.zst", в том числе на
+ * стандартном вводе) читаются без распаковки на диск: формат определяется по
+ * первым байтам, данные распаковываются отдельным потоком по мере разбора.
+ * Выходной файл с расширением .gz или .zst записывается сжатым (сжимает поток
+ * записи; zstd заметно быстрее gzip при близком размере). Сжатый вход
+ * несовместим с --incremental, сжатый вывод - с разбиением на части.
+ *
+ * Параметры:
+ *   --label МЕТКА     Значение поля Labels без запроса с консоли.
+ *   --mapping ФАЙЛ    Сопоставление столбцов вместо встроенного: строки вида
+ *                     "Last Name = group_lastname(3)", "E-mail 1 - Value = \"Почта 2\"",
+ *                     "Labels = label". Источник - номер или имя столбца ввода.
+ *   --auto-columns    Определять столбцы встроенной схемы по заголовку ввода.
+ *   --normalize-phone Приводить Phone 1 - Value к виду +7XXXXXXXXXX ("8 (912)
+ *                     345-67-89", "+7 912 345 6789", "9123456789"); номера,
+ *                     которые не удалось разобрать, записываются как есть
+ *                     с предупреждением. В --mapping - преобразование phone(N).
+ *   --name-case       Приводить First Name и фамилию к виду "Пономарев",
+ *                     "Петров-Водкин" (ПОНОМАРЕВ, пономарев -> Пономарев);
+ *                     группа не меняется. В --mapping - преобразование name(N).
+ *   --no-normalize-email  Копировать почту как есть. По умолчанию адреса в
+ *                     E-mail 1 и E-mail 2 записываются без пробелов по краям,
+ *                     домен - строчными ("Ivanov@Gmail.COM" -> "Ivanov@gmail.com"),
+ *                     об адресах неверного вида выводится предупреждение.
+ *                     В --mapping - преобразование email(N).
+ *   --created-domain ДОМЕН  Домен созданной (учебной) почты. Если в форме
+ *                     перепутали поля и адрес на этом домене оказался в почте
+ *                     ЛК (E-mail 2), а в созданной почте (E-mail 1) - другой
+ *                     адрес, они меняются местами.
+ *   --dedup КЛЮЧ      Удалять повторные строки (повторные отправки формы) по
+ *                     нормализованному полю: email (созданная почта), login
+ *                     (почта ЛК) или phone. Входной файл читается дважды,
+ *                     поэтому стандартный ввод не поддерживается.
+ *   --dedup-keep ПРАВИЛО  first - оставлять первую строку (по умолчанию),
+ *                     latest - самую позднюю по отметке времени.
+ *   --merge ФАЙЛ      Слить результат с существующим CSV Google Contacts (ФАЙЛ
+ *                     может совпадать с выходным): контакты с той же почтой
+ *                     E-mail 1 (или, без почты, тем же телефоном) получают новую
+ *                     метку, остальные добавляются в конец.
+ *   --incremental     Для регулярно пополняемой выгрузки: в файле
+ *                     "<выходной файл>.state" запоминается, докуда обработан
+ *                     вход, и следующий запуск читает только новые строки,
+ *                     дописывая их в конец выходного файла. Если изменился
+ *                     заголовок или уже обработанная часть выгрузки, файл
+ *                     преобразуется заново целиком.
+ *   --encoding КОДИРОВКА  Кодировка входного файла: auto (по умолчанию) - UTF-8,
+ *                     а файл без единой последовательности UTF-8 (например,
+ *                     пересохраненный в Excel) читается как Windows-1251;
+ *                     utf-8 - неверный UTF-8 считается ошибкой; cp1251 -
+ *                     перекодировать из Windows-1251. Файлы UTF-16 не поддерживаются.
+ *   --max-rows-per-file N, --max-bytes-per-file N  Разбивать вывод на части,
+ *                     пригодные для импорта: "вывод_001.csv", "вывод_002.csv"...
+ *                     (каждая с BOM и заголовком) не больше N строк данных или
+ *                     N байтов (суффиксы K, M, G). Части пишутся отдельными потоками.
+ *   --split-by-group КАТАЛОГ  Вместо выходного файла (его имя можно не указывать) -
+ *                     отдельный файл для каждой группы из Last Name в КАТАЛОГЕ:
+ *                     "ПМ-35.csv" (с BOM и заголовком), строки без группы - в
+ *                     "без_группы.csv". Файлы дописываются и закрываются
+ *                     несколькими потоками, открытых файлов - не больше двух.
+ *   --stream          Читать входной файл блоками фиксированного размера
+ *                     вместо отображения в память (ограниченный расход памяти).
+ *   --pipeline        Конвейер: следующие блоки входа читает отдельный поток,
+ *                     а вывод пишет другой, пока текущий блок преобразуется;
+ *                     ожидание медленного диска (сетевой папки) перекрывается
+ *                     работой. Включает --stream.
+ *   --chunk-size N    Размер блока потокового чтения (например, 4M; не больше 256M).
+ *   --simd ВАРИАНТ    Ядро сканирования CSV: auto (лучшее для процессора,
+ *                     выбирается при запуске), avx2, sse2 или scalar.
+ *   --threads N       Преобразовывать участки файла в N потоках (0 - по числу
+ *                     ядер). Результат побайтно совпадает с однопоточным.
+ *   --max-warnings N  Предупреждения о строках (пустые, короткие, повторы,
+ *                     почта, телефоны, ошибки) выводятся выборочно: первые N каждого
+ *                     вида (по умолчанию 10, 0 - все), затем итог по виду.
+ *   --sort-by ПОЛЯ    Упорядочить вывод по группе и (или) фамилии из Last Name
+ *                     ("Группа Фамилия"): group, lastname или group,lastname.
+ *                     Без учета регистра, Ё - после Е; равные - в порядке файла.
+ *   --label-per-group Labels - группа строки (например, "ПМ-35") вместо общей
+ *                     метки; общая метка - только для строк без группы.
+ *   --rejects ФАЙЛ    Записывать отклоненные записи (недостаточно столбцов,
+ *                     ошибка обработки) в CSV "Line,Reason,Detail,Record" вместо
+ *                     предупреждений на консоль: исходная запись в столбце Record
+ *                     без изменений, ее можно исправить и обработать повторно.
+ *                     ("-" - стандартный вывод, если результат пишется в файл).
+ *   --check           Только проверить вход, ничего не записывая: кодировку,
+ *                     число столбцов, вид почты и телефонов (и с --dedup -
+ *                     повторы). Сообщения - как при преобразовании; код
+ *                     возврата 2, если найдены замечания.
+ *   --sample N        С --check проверять только каждую N-ю запись (по номеру
+ *                     строки) - быстрая проверка многогигабайтных выгрузок;
+ *                     остальные записи только сканируются.
+ *   --stats-json ФАЙЛ Записать в JSON статистику прохода: строки, предупреждения
+ *                     по видам, байты на входе и выходе, время чтения, разбора,
+ *                     преобразования и записи ("-" - стандартный вывод).
+ *   --generate ФАЙЛ   Записать синтетическую выгрузку Google Forms: --rows N
+ *                     строк (по умолчанию 100000), при одном --seed - побайтно
+ *                     одинаковую; кириллица, поля с запятыми, кавычками и
+ *                     переводами строк, повторные отправки.
+ *   --benchmark       Замеры на синтетической выгрузке: read_next_record,
+ *                     utf8_valid_prefix, parse_csv_line, format_csv_field,
+ *                     splitGroupLastName и полное преобразование файла (строк/с,
+ *                     МБ/с) с текущими --threads, --simd, --stream.
+ *   --batch ФАЙЛ      Пакетный режим: обработать все задания из файла-списка
+ *                     (строки CSV "вход,выход,метка") в одном процессе.
+ *   --batch-glob ШАБЛОН  Пакетный режим по шаблону имени файла в каталоге
+ *                     (например, "*.csv" в каталоге выгрузок):
+ *                     выход - "<имя>_contacts.csv" (в --output-dir или рядом),
+ *                     метка - имя файла без расширения. Метка не запрашивается,
+ *                     в конце выводятся итоги по каждому файлу. Файлы
+ *                     "*_contacts.csv" (результаты прошлого запуска) не
+ *                     считаются входами, если шаблон не называет их явно.
  *
  * Примечание для Windows: Для корректного отображения/ввода кириллицы в консоли
  * может потребоваться выполнить команду 'chcp 1251' перед запуском программы
@@ -39,380 +161,9316 @@
  */
 
 #include <iostream>
-#include <fstream>
 #include <string>
+#include <string_view> // Для полей-представлений поверх отображенного файла
 #include <vector>
-#include <sstream>
 #include <stdexcept> // Для std::runtime_error
 #include <algorithm> // Для std::max
 #include <vector>    // Убедимся, что vector включен
-#include <windows.h> // Для SetConsoleCP/SetConsoleOutputCP
+#include <array>     // Для полей выходной строки
+#include <deque>
+#include <functional>
+#include <future>    // Для std::future/std::packaged_task
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <filesystem> // Для --batch-glob
+#include <sstream>   // Для буферов предупреждений участков
+#include <thread>
+#include <cstdio>    // Для std::fopen/std::fread
+#include <cstring>   // Для std::memchr
 #include <locale>    // Для setlocale
 
+#include <cstdint>   // Для uint32_t/uint64_t
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BZ4_X86 1
+#include <immintrin.h> // SSE2/AVX2
+#ifdef _MSC_VER
+#include <intrin.h>    // Для __cpuid/_BitScanForward
+#endif
+#else
+#define BZ4_X86 0
+#endif
+
+// Функции с SIMD-инструкциями компилируются для своего набора инструкций,
+// а вызываются только после проверки процессора во время выполнения
+#if defined(__GNUC__) || defined(__clang__)
+#define BZ4_TARGET_SSE2 __attribute__((target("sse2")))
+#define BZ4_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define BZ4_TARGET_SSE2
+#define BZ4_TARGET_AVX2
+#endif
+
+#include <cerrno>    // Для errno/EINTR
+#include <climits>   // Для INT_MAX
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX      // Без макросов min/max, мешающих std::min/std::max
+#endif
+#include <windows.h>  // Для SetConsoleCP/SetConsoleOutputCP и отображения файла
+#include <fcntl.h>    // Для _O_BINARY
+#include <io.h>       // Для _setmode/_read
+#else
+#include <fcntl.h>    // Для open
+#include <poll.h>     // Для poll (прерываемое чтение стандартного ввода)
+#include <sys/mman.h> // Для mmap/munmap
+#include <sys/stat.h> // Для fstat
+#include <unistd.h>   // Для close/read
+#endif
+
+#ifdef BZ4_WITH_ZLIB
+#include <zlib.h>     // Для входа и вывода .gz
+#endif
+#ifdef BZ4_WITH_ZSTD
+#include <zstd.h>     // Для входа и вывода .zst
+#endif
+
  // --- Вспомогательные функции ---
 
  /**
-  * @brief Разбирает строку CSV на отдельные поля с учетом кавычек.
-  *
-  * Поддерживает поля, заключенные в двойные кавычки, и экранированные
-  * двойные кавычки ("") внутри таких полей.
+  * @brief Входной файл, целиком отображенный в память только для чтения.
   *
-  * @param line Строка CSV для разбора.
-  * @return std::vector<std::string> Вектор строк, содержащий поля из строки CSV.
+  * Используется вместо построчного чтения через std::getline: парсер проходит
+  * по байтам отображения напрямую, а поля возвращаются как представления
+  * (std::string_view) внутрь отображения, без копирования в новые строки.
+  * На Windows используется CreateFileMapping/MapViewOfFile, в остальных
+  * системах - mmap.
   */
-std::vector<std::string> parse_csv_line(const std::string &line)
+class MappedFile
 {
-   std::vector<std::string> fields;
-   std::string field_buffer;
-   bool in_quotes = false;
-   std::stringstream ss(line);
-   char c;
+public:
+   MappedFile() = default;
+   ~MappedFile() { close(); }
+
+   MappedFile(const MappedFile &) = delete;
+   MappedFile &operator=(const MappedFile &) = delete;
 
-   while (ss.get(c))
+   /**
+    * @brief Открывает файл и отображает его в память.
+    *
+    * @param path Путь к файлу.
+    * @return true, если файл открыт (пустой файл тоже считается успехом).
+    */
+   bool open(const std::string &path)
    {
-      if (c == '"')
+      close();
+#ifdef _WIN32
+      file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+      if (file_ == INVALID_HANDLE_VALUE)
       {
-         if (ss.peek() == '"')
-         {
-            // Двойная кавычка "" внутри поля
-            field_buffer += '"';
-            ss.get(); // Пропускаем вторую кавычку
-         }
-         else
-         {
-            // Одиночная кавычка - начало или конец поля в кавычках
-            in_quotes = !in_quotes;
-         }
+         return false;
       }
-      else if (c == ',' && !in_quotes)
+      LARGE_INTEGER file_size;
+      if (!GetFileSizeEx(file_, &file_size))
       {
-         // Запятая-разделитель вне кавычек
-         fields.push_back(field_buffer);
-         field_buffer.clear();
+         close();
+         return false;
       }
-      else
+      size_ = static_cast<size_t>(file_size.QuadPart);
+      if (size_ == 0)
+      {
+         return true; // Пустой файл отобразить нельзя, но читать в нем нечего
+      }
+      mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (mapping_ == nullptr)
+      {
+         close();
+         return false;
+      }
+      data_ = static_cast<const char *>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+      if (data_ == nullptr)
+      {
+         close();
+         return false;
+      }
+#else
+      fd_ = ::open(path.c_str(), O_RDONLY);
+      if (fd_ < 0)
+      {
+         return false;
+      }
+      struct stat st;
+      if (fstat(fd_, &st) != 0)
+      {
+         close();
+         return false;
+      }
+      size_ = static_cast<size_t>(st.st_size);
+      if (size_ == 0)
+      {
+         return true; // Пустой файл отобразить нельзя, но читать в нем нечего
+      }
+      void *mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (mapped == MAP_FAILED)
       {
-         // Обычный символ
-         field_buffer += c;
+         close();
+         return false;
       }
+      madvise(mapped, size_, MADV_SEQUENTIAL); // Подсказка ядру: чтение будет последовательным
+      data_ = static_cast<const char *>(mapped);
+#endif
+      return true;
    }
-   // Добавляем последнее поле (после последней запятой или если запятых не было)
-   fields.push_back(field_buffer);
-   return fields;
-}
 
-/**
- * @brief Форматирует поле для безопасной записи в CSV.
- *
- * Если поле содержит запятую, кавычку или символ новой строки,
- * оно заключается в двойные кавычки, а внутренние двойные кавычки
- * удваиваются ("").
- *
- * @param field Строка (поле) для форматирования.
- * @return std::string Отформатированная строка, готовая к записи в CSV.
- */
-std::string format_csv_field(const std::string &field)
-{
-   // Проверяем, нужно ли экранирование
-   if (field.find(',') != std::string::npos || field.find('"') != std::string::npos || field.find('\n') != std::string::npos)
+   /**
+    * @brief Снимает отображение и закрывает файл.
+    */
+   void close()
    {
-      std::string escaped_field = "\"";
-      for (char c : field)
+#ifdef _WIN32
+      if (data_ != nullptr)
       {
-         if (c == '"')
-         {
-            // Экранируем кавычки двойными кавычками
-            escaped_field += "\"\"";
-         }
-         else
-         {
-            escaped_field += c;
-         }
+         UnmapViewOfFile(data_);
       }
-      escaped_field += "\"";
-      return escaped_field;
+      if (mapping_ != nullptr)
+      {
+         CloseHandle(mapping_);
+         mapping_ = nullptr;
+      }
+      if (file_ != INVALID_HANDLE_VALUE)
+      {
+         CloseHandle(file_);
+         file_ = INVALID_HANDLE_VALUE;
+      }
+#else
+      if (data_ != nullptr)
+      {
+         munmap(const_cast<char *>(data_), size_);
+      }
+      if (fd_ >= 0)
+      {
+         ::close(fd_);
+         fd_ = -1;
+      }
+#endif
+      data_ = nullptr;
+      size_ = 0;
    }
-   // Если экранирование не требуется, возвращаем поле как есть
-   return field;
-}
+
+   const char *data() const { return data_; }
+   size_t size() const { return size_; }
+
+private:
+#ifdef _WIN32
+   HANDLE file_ = INVALID_HANDLE_VALUE;
+   HANDLE mapping_ = nullptr;
+#else
+   int fd_ = -1;
+#endif
+   const char *data_ = nullptr;
+   size_t size_ = 0;
+};
+
+// --- Векторное сканирование структуры CSV ---
 
 /**
- * @brief Разделяет комбинированную строку "Группа Фамилия" на две части.
- *
- * Ищет первый пробел как разделитель. Всё до первого пробела считается группой,
- * всё после - фамилией. Учитывает возможные лишние пробелы.
+ * @brief Битовые маски структурных символов для блока из 64 байтов.
  *
- * @param combined Входная строка (например, "ПМ-35 ПОНОМАРЕВ").
- * @param group Выходной параметр для сохранения группы (например, "ПМ-35").
- * @param lastName Выходной параметр для сохранения фамилии (например, "ПОНОМАРЕВ").
+ * Бит i каждой маски соответствует байту i блока.
  */
-void splitGroupLastName(const std::string &combined, std::string &group, std::string &lastName)
+struct BlockMasks
 {
-   group = "";
-   lastName = "";
-   if (combined.empty())
-   {
-      return;
-   }
+   uint64_t quotes = 0;   // '"'
+   uint64_t commas = 0;   // ','
+   uint64_t newlines = 0; // '\n'
+};
 
-   size_t first_space = combined.find(' ');
-   if (first_space != std::string::npos)
-   {
-      // Нашли пробел - разделяем
-      group = combined.substr(0, first_space);
-      // Убираем возможные пробелы в конце извлеченной группы
-      size_t last_char_group = group.find_last_not_of(' ');
-      if (last_char_group != std::string::npos)
-      {
-         group.erase(last_char_group + 1);
-      }
-      else
-      {
-         // Если вся "группа" состояла из пробелов
-         group.clear();
-      }
+/**
+ * @brief Функция классификации блока из 64 байтов (скалярная или SIMD).
+ */
+using BlockClassifier = void (*)(const char *block, BlockMasks &masks);
 
-      // Ищем начало фамилии (первый непробельный символ после первого пробела)
-      size_t last_name_start = combined.find_first_not_of(' ', first_space);
-      if (last_name_start != std::string::npos)
-      {
-         lastName = combined.substr(last_name_start);
-      }
-      // Если после первого пробела были только пробелы, lastName останется ""
-   }
-   else
+/**
+ * @brief Скалярная классификация блока - запасной вариант для любых процессоров.
+ */
+void classify_block_scalar(const char *block, BlockMasks &masks)
+{
+   uint64_t quotes = 0, commas = 0, newlines = 0;
+   for (unsigned i = 0; i < 64; ++i)
    {
-      // Пробел не найден, считаем всю строку фамилией
-      lastName = combined;
+      const char c = block[i];
+      quotes |= static_cast<uint64_t>(c == '"') << i;
+      commas |= static_cast<uint64_t>(c == ',') << i;
+      newlines |= static_cast<uint64_t>(c == '\n') << i;
    }
+   masks.quotes = quotes;
+   masks.commas = commas;
+   masks.newlines = newlines;
 }
 
+#if BZ4_X86
+/**
+ * @brief SSE2: блок обрабатывается четырьмя 16-байтовыми сравнениями на символ.
+ */
+BZ4_TARGET_SSE2 void classify_block_sse2(const char *block, BlockMasks &masks)
+{
+   const __m128i quote = _mm_set1_epi8('"');
+   const __m128i comma = _mm_set1_epi8(',');
+   const __m128i newline = _mm_set1_epi8('\n');
+   uint64_t quotes = 0, commas = 0, newlines = 0;
+   for (unsigned i = 0; i < 4; ++i)
+   {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16 * i));
+      quotes |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)))) << (16 * i);
+      commas |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, comma)))) << (16 * i);
+      newlines |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)))) << (16 * i);
+   }
+   masks.quotes = quotes;
+   masks.commas = commas;
+   masks.newlines = newlines;
+}
 
-// --- Основная логика ---
+/**
+ * @brief AVX2: блок обрабатывается двумя 32-байтовыми сравнениями на символ.
+ */
+BZ4_TARGET_AVX2 void classify_block_avx2(const char *block, BlockMasks &masks)
+{
+   const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+   const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + 32));
+   const __m256i quote = _mm256_set1_epi8('"');
+   const __m256i comma = _mm256_set1_epi8(',');
+   const __m256i newline = _mm256_set1_epi8('\n');
+   masks.quotes = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, quote))) |
+      static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, quote)))) << 32;
+   masks.commas = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, comma))) |
+      static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, comma)))) << 32;
+   masks.newlines = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, newline))) |
+      static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, newline)))) << 32;
+}
 
-int main(int argc, char *argv[])
+/**
+ * @brief Проверяет, поддерживают ли процессор и ОС инструкции AVX2.
+ */
+bool cpu_has_avx2()
 {
-   // --- Настройка локали и кодировки консоли (для Windows) ---
-   try
+#if defined(_MSC_VER)
+   int regs[4];
+   __cpuid(regs, 1);
+   const bool osxsave = (regs[2] & (1 << 27)) != 0;
+   const bool avx = (regs[2] & (1 << 28)) != 0;
+   if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
    {
-      setlocale(LC_ALL, ""); // Устанавливаем системную локаль по умолчанию
+      return false; // ОС не сохраняет регистры YMM
    }
-   catch (const std::exception &e)
+   __cpuidex(regs, 7, 0);
+   return (regs[1] & (1 << 5)) != 0;
+#else
+   return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+/**
+ * @brief Выбирает классификатор блока: "auto", "avx2", "sse2" или "scalar".
+ *
+ * @param name Имя варианта; "auto" выбирает лучший из поддерживаемых процессором.
+ * @param classifier Выходной параметр для выбранной функции.
+ * @return false, если вариант неизвестен или не поддерживается процессором.
+ */
+bool select_block_classifier(const std::string &name, BlockClassifier &classifier)
+{
+#if BZ4_X86
+   if (name == "auto")
    {
-      // Не критичная ошибка, выводим предупреждение
-      std::cerr << "Предупреждение: Не удалось установить локаль. " << e.what() << std::endl;
+      classifier = cpu_has_avx2() ? classify_block_avx2 : classify_block_sse2;
+      return true;
    }
-   // Установка кодовых страниц для консоли Windows (1251 для кириллицы)
-   if (!SetConsoleOutputCP(1251))
+   if (name == "avx2")
    {
-      std::cerr << "Предупреждение: Не удалось установить код. стр. вывода 1251. Ошибка: " << GetLastError() << std::endl;
+      classifier = classify_block_avx2;
+      return cpu_has_avx2();
    }
-   if (!SetConsoleCP(1251))
+   if (name == "sse2")
    {
-      std::cerr << "Предупреждение: Не удалось установить код. стр. ввода 1251. Ошибка: " << GetLastError() << std::endl;
+      classifier = classify_block_sse2;
+      return true;
    }
-   // --- Конец настройки ---
-
-   // --- Определение имен входного и выходного файлов ---
-   std::string input_filename = "input.csv"; // Имя входного файла по умолчанию
-   std::string output_filename = "output.csv"; // Имя выходного файла по умолчанию
-
-   // Обработка аргументов командной строки для переопределения имен файлов
-   if (argc == 3)
+#else
+   if (name == "auto")
    {
-      // Если передано два аргумента (помимо имени программы)
-      input_filename = argv[1];
-      output_filename = argv[2];
+      classifier = classify_block_scalar;
+      return true;
    }
-   else if (argc != 1)
+#endif
+   if (name == "scalar")
    {
-      // Если количество аргументов не 0 и не 2
-      std::cerr << "Ошибка: Неверное количество аргументов." << std::endl;
-      std::cerr << "Использование: " << argv[0] << " [\"путь/к/входному файлу.csv\"] [\"путь/к/выходному файлу.csv\"]" << std::endl;
-      std::cerr << "Примечание: Используйте кавычки, если пути содержат пробелы." << std::endl;
-      return 1; // Выход с кодом ошибки
+      classifier = classify_block_scalar;
+      return true;
    }
+   return false;
+}
 
-   std::cout << "Чтение из файла: " << input_filename << std::endl;
-   std::cout << "Запись в файл:   " << output_filename << " (кодировка UTF-8 с BOM)" << std::endl;
-
-   // --- Запрос названия группы контактов (для поля Labels) ---
-   std::string contact_group_label;
-   std::cout << "Введите название для группы контактов (оставьте пустым, если не нужно): ";
-   // Используем getline для чтения всей строки, включая пробелы
-   std::getline(std::cin, contact_group_label);
-   std::cout << "Используется метка группы: '" << (contact_group_label.empty() ? "[ПУСТО]" : contact_group_label) << "'" << std::endl;
-   // --- Конец запроса ---
-
-
-   // --- Открытие файлов ---
-   // Открываем входной файл для чтения
-   std::ifstream input_file(input_filename);
-   if (!input_file.is_open())
-   {
-      std::cerr << "Ошибка: Не удалось открыть входной файл: " << input_filename << std::endl;
-      return 1;
-   }
+/**
+ * @brief Текущий классификатор блока (определяется при запуске, см. --simd).
+ */
+BlockClassifier g_classify_block = []
+{
+   BlockClassifier classifier = classify_block_scalar;
+   select_block_classifier("auto", classifier);
+   return classifier;
+}();
 
-   // Открываем выходной файл для записи в БИНАРНОМ режиме (важно для BOM и корректной записи UTF-8)
-   std::ofstream output_file(output_filename, std::ios::binary);
-   if (!output_file.is_open())
+inline unsigned count_trailing_zeros(uint64_t value)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+   unsigned long index;
+   _BitScanForward64(&index, value);
+   return static_cast<unsigned>(index);
+#elif defined(_MSC_VER)
+   unsigned long index;
+   if (_BitScanForward(&index, static_cast<uint32_t>(value)))
    {
-      std::cerr << "Ошибка: Не удалось открыть выходной файл: " << output_filename << std::endl;
-      input_file.close(); // Закрываем уже открытый входной файл перед выходом
-      return 1;
+      return static_cast<unsigned>(index);
    }
+   _BitScanForward(&index, static_cast<uint32_t>(value >> 32));
+   return static_cast<unsigned>(index) + 32;
+#else
+   return static_cast<unsigned>(__builtin_ctzll(value));
+#endif
+}
 
-   // --- Подготовка выходного файла ---
-   // Записываем UTF-8 BOM (Byte Order Mark) - обязательно для корректного импорта UTF-8 в некоторых программах (включая Google Contacts)
-   output_file << (char)0xEF << (char)0xBB << (char)0xBF;
-
-   // Заголовок для выходного файла (формат Google Contacts)
-   const std::string output_header = "First Name,Middle Name,Last Name,Phonetic First Name,Phonetic Middle Name,Phonetic Last Name,Name Prefix,Name Suffix,Nickname,File As,Organization Name,Organization Title,Organization Department,Birthday,Notes,Photo,Labels,E-mail 1 - Label,E-mail 1 - Value,E-mail 2 - Label,E-mail 2 - Value,Phone 1 - Label,Phone 1 - Value";
-   const int NUM_OUTPUT_COLUMNS = 23; // Количество столбцов в заголовке Google Contacts
+inline unsigned count_set_bits(uint64_t value)
+{
+   value = value - ((value >> 1) & 0x5555555555555555ULL);
+   value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+   value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+   return static_cast<unsigned>((value * 0x0101010101010101ULL) >> 56);
+}
 
-   // Индексы нужных столбцов во ВХОДНОМ файле (0-based)
-   const int INPUT_IDX_ROLE = 1;             // Должность (не используется для вывода)
-   const int INPUT_IDX_FIRSTNAME = 2;        // Имя
-   const int INPUT_IDX_GROUPLASTNAME = 3;    // Группа + Фамилия
-   const int INPUT_IDX_EMAILLOGIN = 4;       // Email 1 (ЛК)
-   const int INPUT_IDX_EMAILCREATED = 5;     // Email 2 (Созданный)
-   const int INPUT_IDX_PHONE = 6;            // Телефон
-   const int INPUT_NUM_COLUMNS_EXPECTED = 7; // Минимальное ожидаемое кол-во столбцов во входном файле
+/**
+ * @brief Префиксный XOR: бит i результата равен XOR битов 0..i.
+ *
+ * Для маски кавычек дает маску "внутри кавычек": открывающая кавычка и все
+ * байты до закрывающей получают 1. Пара "" переключает состояние дважды,
+ * поэтому экранированные кавычки не нарушают маску.
+ */
+inline uint64_t prefix_xor(uint64_t bits)
+{
+   bits ^= bits << 1;
+   bits ^= bits << 2;
+   bits ^= bits << 4;
+   bits ^= bits << 8;
+   bits ^= bits << 16;
+   bits ^= bits << 32;
+   return bits;
+}
 
-   // Записываем заголовок в выходной файл
-   output_file << output_header << "\n"; // Используем '\n' для новой строки в бинарном режиме
+/**
+ * @brief Флаг в смещении границы поля: в поле встречались кавычки.
+ */
+constexpr uint32_t FIELD_QUOTED = 0x80000000u;
+constexpr uint32_t FIELD_OFFSET_MASK = 0x7FFFFFFFu; // Записи длиннее 2 ГиБ не поддерживаются
 
-   // --- Обработка строк входного файла ---
-   std::string line;          // Буфер для прочитанной строки
-   bool is_first_line = true; // Флаг для пропуска заголовка входного файла
-   int line_number = 0;       // Счетчик строк для сообщений об ошибках
-   int processed_count = 0;   // Счетчик успешно обработанных строк данных
+/**
+ * @brief Состояние сканирования записи, переносимое между вызовами.
+ */
+struct CsvScanState
+{
+   bool in_quotes = false;        // Последний просмотренный байт находится внутри кавычек
+   bool field_has_quote = false;  // В текущем (незавершенном) поле встречались кавычки
+   size_t embedded_newlines = 0;  // Переводы строк внутри кавычек
+};
 
-   // Читаем входной файл построчно
-   while (std::getline(input_file, line))
+/**
+ * @brief Сканирует байты записи и находит границы полей и конец записи.
+ *
+ * Участок обрабатывается блоками по 64 байта: классификатор (SSE2/AVX2 или
+ * скалярный) строит маски кавычек, запятых и переводов строк, префиксный
+ * XOR маски кавычек дает маску "внутри кавычек", и разделители внутри
+ * кавычек отбрасываются одной операцией AND. Для каждой запятой вне кавычек
+ * в boundaries добавляется ее смещение от начала записи (с флагом
+ * FIELD_QUOTED, если в поле были кавычки). Сканирование останавливается
+ * на первом переводе строки вне кавычек; он становится концом последнего поля.
+ *
+ * @param p Начало просматриваемого участка.
+ * @param end Конец просматриваемого участка.
+ * @param base Смещение p от начала записи.
+ * @param state Состояние сканирования на входе и на выходе.
+ * @param boundaries Вектор, в который дописываются границы полей.
+ * @return Указатель на завершающий '\n' или nullptr, если запись не завершена.
+ */
+const char *scan_record(const char *p, const char *end, size_t base, CsvScanState &state, std::vector<uint32_t> &boundaries)
+{
+   const char *const start = p;
+   BlockMasks masks;
+   while (p < end)
    {
-      line_number++;
-      if (line.empty())
+      const size_t remaining = static_cast<size_t>(end - p);
+      size_t block_size = 64;
+      if (remaining >= 64)
       {
-         // Пропускаем пустые строки
-         std::cerr << "Предупреждение: Пропущена пустая строка #" << line_number << std::endl;
-         continue;
+         g_classify_block(p, masks);
       }
-
-      if (is_first_line)
+      else
       {
-         // Пропускаем первую строку (заголовок) входного файла
-         is_first_line = false;
-         continue;
+         // Хвост короче блока: копируем во временный буфер, чтобы не читать за границей данных
+         char tail[64] = {};
+         std::memcpy(tail, p, remaining);
+         g_classify_block(tail, masks);
+         block_size = remaining;
       }
 
-      // --- Обработка строки данных ---
-      // Разбираем строку на поля
-      std::vector<std::string> input_fields = parse_csv_line(line);
+      const uint64_t inside = prefix_xor(masks.quotes) ^ (state.in_quotes ? ~0ULL : 0ULL);
+      uint64_t commas = masks.commas & ~inside;
+      const uint64_t record_ends = masks.newlines & ~inside;
 
-      // Проверяем, достаточно ли столбцов в прочитанной строке
-      if (input_fields.size() < INPUT_NUM_COLUMNS_EXPECTED)
+      uint64_t limit = ~0ULL; // Байты блока, относящиеся к текущей записи
+      unsigned stop = 64;
+      if (record_ends != 0)
       {
-         std::cerr << "Предупреждение: Строка #" << line_number << " пропущена из-за недостаточного количества столбцов ("
-            << input_fields.size() << " найдено, ожидалось минимум " << INPUT_NUM_COLUMNS_EXPECTED << "). Строка: " << line << std::endl;
-         continue; // Переходим к следующей строке
+         stop = count_trailing_zeros(record_ends);
+         limit = stop == 0 ? 0 : (~0ULL >> (64 - stop));
       }
+      commas &= limit;
+      const uint64_t quotes = masks.quotes & limit;
+      state.embedded_newlines += count_set_bits(masks.newlines & inside & limit);
 
-      try
+      const size_t block_offset = base + static_cast<size_t>(p - start);
+      unsigned field_begin = 0; // Начало текущего поля внутри блока
+      while (commas != 0)
+      {
+         const unsigned i = count_trailing_zeros(commas);
+         const uint64_t field_bits = (i == 0 ? 0 : (~0ULL >> (64 - i))) & (~0ULL << field_begin);
+         const bool quoted = state.field_has_quote || (quotes & field_bits) != 0;
+         boundaries.push_back(static_cast<uint32_t>(block_offset + i) | (quoted ? FIELD_QUOTED : 0));
+         state.field_has_quote = false;
+         field_begin = i + 1;
+         commas &= commas - 1;
+      }
+      if (field_begin < 64 && (quotes & (~0ULL << field_begin)) != 0)
       {
-         // Создаем вектор для полей ВЫХОДНОЙ строки, инициализируем пустыми строками
-         std::vector<std::string> output_fields(NUM_OUTPUT_COLUMNS, "");
+         state.field_has_quote = true;
+      }
 
-         // --- Заполнение полей выходной строки ---
+      if (record_ends != 0)
+      {
+         boundaries.push_back(static_cast<uint32_t>(block_offset + stop) | (state.field_has_quote ? FIELD_QUOTED : 0));
+         state.field_has_quote = false;
+         state.in_quotes = false;
+         return p + stop;
+      }
+      state.in_quotes = (inside >> 63) != 0;
+      p += block_size;
+   }
+   return nullptr;
+}
 
-         // 0: First Name (Имя)
-         output_fields[0] = input_fields[INPUT_IDX_FIRSTNAME];
+/**
+ * @brief Завершает границы записи, которая закончилась вместе с данными (без '\n').
+ */
+void finish_record_boundaries(CsvScanState &state, size_t record_size, std::vector<uint32_t> &boundaries)
+{
+   boundaries.push_back(static_cast<uint32_t>(record_size) | (state.field_has_quote ? FIELD_QUOTED : 0));
+   state.field_has_quote = false;
+   state.in_quotes = false;
+}
 
-         // 1: Middle Name - остается пустым
+/**
+ * @brief Запись CSV вместе с найденными при сканировании границами полей.
+ */
+struct CsvRecord
+{
+   std::string_view text;            // Текст записи без завершающих '\n' и '\r'
+   std::vector<uint32_t> boundaries; // Концы полей (смещения разделителей) с флагом FIELD_QUOTED
+   size_t embedded_newlines = 0;     // Переводы строк внутри полей в кавычках
+   size_t raw_size = 0;              // Длина записи во входных данных вместе с '\r' и '\n'
+};
 
-         // Извлекаем Группу и Фамилию из соответствующего поля входного файла
-         std::string group, lastName;
-         splitGroupLastName(input_fields[INPUT_IDX_GROUPLASTNAME], group, lastName);
+/**
+ * @brief Убирает '\r' от окончаний строк Windows (CRLF) в конце записи.
+ */
+inline void strip_carriage_return(std::string_view &record)
+{
+   if (!record.empty() && record.back() == '\r')
+   {
+      record.remove_suffix(1);
+   }
+}
 
-         // 2: Last Name (Фамилия) - формируем как "Группа Фамилия"
-         if (!group.empty())
-         {
-            output_fields[2] = group + " " + lastName;
-         }
-         else
-         {
-            // Если группа не найдена, записываем только фамилию
-            output_fields[2] = lastName;
-         }
+/**
+ * @brief Извлекает очередную запись CSV из буфера, целиком находящегося в памяти.
+ *
+ * Запись заканчивается переводом строки вне кавычек, поэтому поля в кавычках
+ * с переводами строк внутри (например, многострочная "Должность") остаются
+ * одной записью. Запись возвращается как представление внутрь буфера;
+ * границы полей находятся тем же проходом (см. scan_record).
+ *
+ * @param cursor Текущая позиция в буфере; сдвигается за прочитанную запись.
+ * @param end Конец буфера.
+ * @param record Выходной параметр для прочитанной записи.
+ * @return true, если запись прочитана; false, если буфер исчерпан.
+ */
+bool read_next_record(const char *&cursor, const char *end, CsvRecord &record)
+{
+   if (cursor >= end)
+   {
+      return false;
+   }
+   CsvScanState state;
+   record.boundaries.clear();
+   const char *newline = scan_record(cursor, end, 0, state, record.boundaries);
+   const char *record_end = newline != nullptr ? newline : end;
+   if (newline == nullptr)
+   {
+      finish_record_boundaries(state, static_cast<size_t>(end - cursor), record.boundaries);
+   }
+   record.text = std::string_view(cursor, record_end - cursor);
+   record.embedded_newlines = state.embedded_newlines;
+   const char *next = newline != nullptr ? newline + 1 : end;
+   record.raw_size = static_cast<size_t>(next - cursor);
+   cursor = next;
+   strip_carriage_return(record.text);
+   return true;
+}
 
-         // 3-9: Пусто (Phonetics, Prefix, Suffix, Nickname, File As)
+/**
+ * @brief Источник байтов для потокового чтения.
+ */
+class ByteSource
+{
+public:
+   virtual ~ByteSource() = default;
 
-         // 10: Organization Name <- НЕ ЗАПОЛНЯЕТСЯ
-         // output_fields[10] = group;
+   /**
+    * @brief Читает до capacity байтов в buffer.
+    * @return Количество прочитанных байтов; 0 означает конец данных.
+    */
+   virtual size_t read(char *buffer, size_t capacity) = 0;
 
-         // 11: Organization Title <- НЕ ЗАПОЛНЯЕТСЯ
-         // output_fields[11] = input_fields[INPUT_IDX_ROLE];
+   /**
+    * @brief Произошла ли ошибка чтения.
+    */
+   virtual bool failed() const { return false; }
 
-         // 12-15: Пусто (Department, Birthday, Notes, Photo)
+   /**
+    * @brief Прерывает чтение, ожидающее данных в другом потоке.
+    *
+    * После этого read() возвращает 0. Нужно, чтобы остановить поток чтения
+    * наперед, заблокированный на стандартном вводе.
+    */
+   virtual void cancel() {}
+};
 
-         // 16: Labels (Метки) - значение, введенное пользователем
-         output_fields[16] = contact_group_label;
+/**
+ * @brief Источник байтов из обычного файла (блочное чтение через fread).
+ */
+class FileByteSource : public ByteSource
+{
+public:
+   FileByteSource() = default;
+   ~FileByteSource() override { close(); }
 
-         // 17: E-mail 1 - Label <- НЕ ЗАПОЛНЯЕТСЯ
-         // output_fields[17] = "Work";
+   FileByteSource(const FileByteSource &) = delete;
+   FileByteSource &operator=(const FileByteSource &) = delete;
 
-         // 18: E-mail 1 - Value (Созданный Email)
-         output_fields[18] = input_fields[INPUT_IDX_EMAILCREATED];
+   bool open(const std::string &path)
+   {
+      close();
+      file_ = std::fopen(path.c_str(), "rb");
+      return file_ != nullptr;
+   }
 
-         // 19: E-mail 2 - Label <- НЕ ЗАПОЛНЯЕТСЯ
-         // output_fields[19] = "Other";
+   void close()
+   {
+      if (file_ != nullptr)
+      {
+         std::fclose(file_);
+         file_ = nullptr;
+      }
+   }
 
-         // 20: E-mail 2 - Value (Email ЛК)
-         output_fields[20] = input_fields[INPUT_IDX_EMAILLOGIN];
+   size_t read(char *buffer, size_t capacity) override
+   {
+      return std::fread(buffer, 1, capacity, file_);
+   }
 
-         // 21: Phone 1 - Label <- НЕ ЗАПОЛНЯЕТСЯ
-         // output_fields[21] = "Mobile";
+   bool failed() const override { return std::ferror(file_) != 0; }
 
-         // 22: Phone 1 - Value (Телефон)
-         output_fields[22] = input_fields[INPUT_IDX_PHONE];
+   /**
+    * @brief Переходит к байту offset от начала файла.
+    */
+   bool seek(uint64_t offset)
+   {
+#ifdef _WIN32
+      return _fseeki64(file_, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+      return fseeko(file_, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+   }
 
-         // --- Форматирование и запись выходной строки ---
-         for (size_t i = 0; i < output_fields.size(); ++i)
-         {
-            // Форматируем каждое поле перед записью (добавляем кавычки, если нужно)
-            output_file << format_csv_field(output_fields[i]);
-            // Добавляем запятую после каждого поля, кроме последнего
-            if (i < output_fields.size() - 1)
-            {
-               output_file << ",";
-            }
-         }
-         // Завершаем строку символом новой строки
-         output_file << "\n"; // Используем '\n' в бинарном режиме
+private:
+   std::FILE *file_ = nullptr;
+};
 
-         // Увеличиваем счетчик успешно обработанных строк
-         processed_count++;
+/**
+ * @brief Источник байтов из стандартного ввода (для работы в конвейере).
+ *
+ * В отличие от fread, низкоуровневое чтение возвращает уже поступившие
+ * данные, не дожидаясь заполнения всего блока, поэтому записи обрабатываются
+ * по мере поступления. Перед каждым чтением, которое может заблокироваться,
+ * вызывается before_read - через него сбрасывается накопленный вывод.
+ */
+class StdinByteSource : public ByteSource
+{
+public:
+   StdinByteSource()
+   {
+#ifdef _WIN32
+      _setmode(_fileno(stdin), _O_BINARY); // Без преобразования CRLF и обработки Ctrl+Z
+#else
+      // Канал пробуждения: cancel() пишет в него байт, и poll в read() возвращается
+      if (::pipe(wake_) != 0)
+      {
+         wake_[0] = wake_[1] = -1;
+      }
+#endif
+   }
 
+   ~StdinByteSource() override
+   {
+#ifndef _WIN32
+      if (wake_[0] >= 0)
+      {
+         ::close(wake_[0]);
+         ::close(wake_[1]);
       }
-      catch (const std::out_of_range &oor)
+#endif
+   }
+
+   StdinByteSource(const StdinByteSource &) = delete;
+   StdinByteSource &operator=(const StdinByteSource &) = delete;
+
+   size_t read(char *buffer, size_t capacity) override
+   {
+      if (before_read)
       {
-         // Обработка ошибки: попытка доступа к несуществующему индексу (маловероятно из-за проверки выше)
-         std::cerr << "Ошибка: Произошел выход за пределы диапазона при обработке строки #" << line_number << ". " << oor.what() << ". Строка: " << line << std::endl;
+         before_read();
       }
-      catch (const std::exception &e)
+      for (;;)
       {
-         // Обработка других возможных исключений при обработке строки
-         std::cerr << "Ошибка: Произошло исключение при обработке строки #" << line_number << ". " << e.what() << ". Строка: " << line << std::endl;
+         if (cancelled_.load())
+         {
+            return 0;
+         }
+#ifdef _WIN32
+         const int bytes_read = _read(_fileno(stdin), buffer, static_cast<unsigned>(std::min<size_t>(capacity, INT_MAX)));
+         if (bytes_read < 0 && cancelled_.load())
+         {
+            return 0; // Ожидание прервано cancel()
+         }
+#else
+         if (wake_[0] >= 0)
+         {
+            pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {wake_[0], POLLIN, 0}};
+            if (::poll(fds, 2, -1) < 0)
+            {
+               if (errno == EINTR)
+               {
+                  continue;
+               }
+               failed_ = true;
+               return 0;
+            }
+            if (fds[1].revents != 0)
+            {
+               return 0; // Ожидание прервано cancel()
+            }
+         }
+         const ssize_t bytes_read = ::read(STDIN_FILENO, buffer, capacity);
+#endif
+         if (bytes_read >= 0)
+         {
+            return static_cast<size_t>(bytes_read);
+         }
+         if (errno != EINTR)
+         {
+            failed_ = true;
+            return 0;
+         }
       }
-   } // Конец цикла while (std::getline)
+   }
 
-   // --- Завершение работы ---
-   std::cout << "Обработка завершена. Успешно обработано строк данных: " << processed_count << "." << std::endl;
+   bool failed() const override { return failed_; }
+
+   void cancel() override
+   {
+      cancelled_ = true;
+#ifdef _WIN32
+      // Ожидающее ReadFile завершается с ERROR_OPERATION_ABORTED
+      CancelIoEx(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(stdin))), nullptr);
+#else
+      if (wake_[1] >= 0)
+      {
+         const char byte = 0;
+         [[maybe_unused]] const ssize_t written = ::write(wake_[1], &byte, 1);
+      }
+#endif
+   }
+
+   std::function<void()> before_read; // Вызывается перед каждым чтением
+
+private:
+   bool failed_ = false;
+   std::atomic<bool> cancelled_{false};
+#ifndef _WIN32
+   int wake_[2] = {-1, -1};
+#endif
+};
+
+/**
+ * @brief Потоковый читатель записей CSV с учетом кавычек.
+ *
+ * Читает источник блоками фиксированного размера и выдает полные записи,
+ * в том числе записи с переводами строк внутри полей в кавычках. Состояние
+ * сканирования (CsvScanState и позиция) сохраняется между дочитываниями,
+ * поэтому каждый байт просматривается один раз, а границы полей находятся
+ * тем же проходом. Незавершенный хвост записи переносится в начало буфера;
+ * буфер растет только если одна запись длиннее блока, так что память
+ * ограничена размером блока и самой длинной записи, а не размером файла.
+ */
+class CsvRecordReader
+{
+public:
+   static constexpr size_t DEFAULT_CHUNK_SIZE = 1 << 20; // 1 МиБ
+   static constexpr size_t MAX_CHUNK_SIZE = 256 << 20;   // С чтением наперед в памяти до 4 блоков
+
+   explicit CsvRecordReader(ByteSource &source, size_t chunk_size = DEFAULT_CHUNK_SIZE)
+      : source_(source), buffer_(std::max<size_t>(chunk_size, 1))
+   {
+   }
+
+   /**
+    * @brief Забывает прочитанные данные (после перехода источника к другой позиции).
+    */
+   void reset()
+   {
+      begin_ = scan_ = end_ = 0;
+      eof_ = false;
+   }
+
+   /**
+    * @brief Выдает очередную запись (без завершающих '\n' и '\r').
+    *
+    * Текст записи действителен до следующего вызова.
+    *
+    * @param record Выходной параметр для записи и границ ее полей.
+    * @return true, если запись прочитана; false, если данные закончились.
+    */
+   bool next_record(CsvRecord &record)
+   {
+      CsvScanState state;
+      record.boundaries.clear();
+      for (;;)
+      {
+         const char *data = buffer_.data();
+         const char *newline = scan_record(data + scan_, data + end_, scan_ - begin_, state, record.boundaries);
+         if (newline != nullptr)
+         {
+            const size_t record_end = static_cast<size_t>(newline - data);
+            emit(record, state, record_end, record_end + 1);
+            begin_ = scan_ = record_end + 1;
+            return true;
+         }
+         scan_ = end_;
+
+         if (eof_)
+         {
+            if (begin_ == end_)
+            {
+               return false;
+            }
+            // Последняя запись без завершающего перевода строки
+            finish_record_boundaries(state, end_ - begin_, record.boundaries);
+            emit(record, state, end_, end_);
+            begin_ = scan_ = end_;
+            return true;
+         }
+
+         // Переносим незавершенную запись в начало буфера
+         if (begin_ > 0)
+         {
+            std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+            scan_ -= begin_;
+            end_ -= begin_;
+            begin_ = 0;
+         }
+         if (end_ == buffer_.size())
+         {
+            // Запись не помещается в блок - увеличиваем буфер
+            buffer_.resize(buffer_.size() * 2);
+         }
+         const size_t bytes_read = source_.read(buffer_.data() + end_, buffer_.size() - end_);
+         if (bytes_read == 0)
+         {
+            eof_ = true;
+         }
+         end_ += bytes_read;
+      }
+   }
+
+private:
+   void emit(CsvRecord &record, const CsvScanState &state, size_t record_end, size_t next_begin)
+   {
+      record.text = std::string_view(buffer_.data() + begin_, record_end - begin_);
+      record.raw_size = next_begin - begin_;
+      record.embedded_newlines = state.embedded_newlines;
+      strip_carriage_return(record.text);
+   }
+
+   ByteSource &source_;
+   std::vector<char> buffer_;
+   size_t begin_ = 0; // Начало текущей записи в буфере
+   size_t scan_ = 0;  // Докуда запись уже просмотрена
+   size_t end_ = 0;   // Конец прочитанных данных в буфере
+   bool eof_ = false;
+};
+
+// --- Конвейер: чтение и запись в отдельных потоках (--pipeline) ---
+
+/**
+ * @brief Очередь фиксированной емкости для одного производителя и одного потребителя.
+ *
+ * Пока очередь не пуста (при извлечении) и не полна (при добавлении),
+ * операции обходятся без блокировок: каждая сторона двигает только свой
+ * индекс. Мьютекс и условная переменная нужны только для ожидания, и
+ * другую сторону будят, лишь если она действительно ждет. close() будит
+ * обе стороны: push после закрытия не добавляет, pop выдает оставшееся.
+ */
+template <typename T, size_t CAPACITY>
+class SpscQueue
+{
+   static_assert((CAPACITY & (CAPACITY - 1)) == 0, "Емкость очереди - степень двойки");
+
+public:
+   /**
+    * @brief Добавляет элемент, дожидаясь места. Вызывается только производителем.
+    * @return false, если очередь закрыта.
+    */
+   bool push(T value)
+   {
+      const size_t tail = tail_.load(std::memory_order_relaxed);
+      if (tail - head_.load() == CAPACITY)
+      {
+         std::unique_lock<std::mutex> lock(mutex_);
+         producer_waiting_ = true;
+         changed_.wait(lock, [&] { return tail - head_.load() < CAPACITY || closed_.load(); });
+         producer_waiting_ = false;
+      }
+      if (closed_.load())
+      {
+         return false;
+      }
+      slots_[tail & (CAPACITY - 1)] = std::move(value);
+      tail_.store(tail + 1);
+      if (consumer_waiting_.load())
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         changed_.notify_all();
+      }
+      return true;
+   }
+
+   /**
+    * @brief Извлекает элемент, дожидаясь его. Вызывается только потребителем.
+    * @return false, если очередь закрыта и пуста.
+    */
+   bool pop(T &value)
+   {
+      const size_t head = head_.load(std::memory_order_relaxed);
+      if (tail_.load() == head)
+      {
+         std::unique_lock<std::mutex> lock(mutex_);
+         consumer_waiting_ = true;
+         changed_.wait(lock, [&] { return tail_.load() != head || closed_.load(); });
+         consumer_waiting_ = false;
+         if (tail_.load() == head)
+         {
+            return false;
+         }
+      }
+      value = std::move(slots_[head & (CAPACITY - 1)]);
+      head_.store(head + 1);
+      if (producer_waiting_.load())
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         changed_.notify_all();
+      }
+      return true;
+   }
+
+   /**
+    * @brief Пуста ли очередь (для потребителя: придется ли ждать в pop).
+    */
+   bool empty() const { return tail_.load() == head_.load(); }
+
+   void close()
+   {
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         closed_ = true;
+      }
+      changed_.notify_all();
+   }
+
+private:
+   std::array<T, CAPACITY> slots_{};
+   std::atomic<size_t> head_{0}; // Следующий элемент для потребителя
+   std::atomic<size_t> tail_{0}; // Следующее место для производителя
+   std::atomic<bool> producer_waiting_{false};
+   std::atomic<bool> consumer_waiting_{false};
+   std::atomic<bool> closed_{false};
+   std::mutex mutex_;
+   std::condition_variable changed_;
+};
+
+/**
+ * @brief Блок данных конвейера: буфер и заполненная его часть.
+ */
+struct PipelineBlock
+{
+   std::vector<char> data;
+   size_t size = 0;
+};
+
+/**
+ * @brief Источник, который читает следующие блоки в отдельном потоке, пока
+ * разбирается текущий (двойная буферизация чтения).
+ *
+ * Блоки ходят по кругу между двумя очередями: поток чтения берет пустой
+ * блок, заполняет его из источника и отдает потребителю, а тот возвращает
+ * прочитанный блок обратно. Блоков BUFFER_COUNT, поэтому память ограничена,
+ * а при медленном чтении (сетевой диск) ожидание ввода перекрывается
+ * разбором и преобразованием. Поток запускается при первом чтении.
+ */
+class ReadAheadByteSource : public ByteSource
+{
+public:
+   static constexpr size_t BUFFER_COUNT = 3;
+
+   ReadAheadByteSource(ByteSource &source, size_t block_size)
+      : source_(source), block_size_(std::max<size_t>(block_size, 1))
+   {
+   }
+
+   ~ReadAheadByteSource() override
+   {
+      // При досрочном выходе поток чтения может ждать данных, которые уже не нужны
+      if (thread_.joinable())
+      {
+         source_.cancel();
+      }
+      stop();
+   }
+
+   ReadAheadByteSource(const ReadAheadByteSource &) = delete;
+   ReadAheadByteSource &operator=(const ReadAheadByteSource &) = delete;
+
+   size_t read(char *buffer, size_t capacity) override
+   {
+      if (!thread_.joinable() && !eof_)
+      {
+         start();
+      }
+      while (offset_ == current_.size)
+      {
+         if (eof_)
+         {
+            return 0;
+         }
+         if (!current_.data.empty())
+         {
+            free_->push(std::move(current_));
+         }
+         if (before_read && full_->empty())
+         {
+            before_read();
+         }
+         offset_ = 0;
+         if (!full_->pop(current_) || current_.size == 0)
+         {
+            current_ = PipelineBlock();
+            eof_ = true;
+            return 0;
+         }
+      }
+      const size_t bytes = std::min(capacity, current_.size - offset_);
+      std::memcpy(buffer, current_.data.data() + offset_, bytes);
+      offset_ += bytes;
+      return bytes;
+   }
+
+   bool failed() const override { return failed_.load(); }
+
+   /**
+    * @brief Останавливает поток чтения и забывает прочитанные наперед блоки.
+    *
+    * После этого источник можно перевести к другой позиции; следующее
+    * read() продолжит чтение с нее.
+    */
+   void stop()
+   {
+      if (thread_.joinable())
+      {
+         full_->close();
+         free_->close();
+         thread_.join();
+      }
+      current_ = PipelineBlock();
+      offset_ = 0;
+      eof_ = false;
+   }
+
+   std::function<void()> before_read; // Вызывается, если следующий блок еще не прочитан
+
+private:
+   using Queue = SpscQueue<PipelineBlock, 4>;
+
+   void start()
+   {
+      full_ = std::make_unique<Queue>();
+      free_ = std::make_unique<Queue>();
+      for (size_t i = 0; i < BUFFER_COUNT; ++i)
+      {
+         free_->push(PipelineBlock{std::vector<char>(block_size_), 0});
+      }
+      thread_ = std::thread([this] { run_reader(); });
+   }
+
+   void run_reader()
+   {
+      PipelineBlock block;
+      while (free_->pop(block))
+      {
+         block.size = source_.read(block.data.data(), block.data.size());
+         const bool end = block.size == 0;
+         if (end)
+         {
+            failed_ = source_.failed();
+         }
+         if (!full_->push(std::move(block)) || end)
+         {
+            break;
+         }
+      }
+   }
+
+   ByteSource &source_;
+   const size_t block_size_;
+   std::unique_ptr<Queue> full_; // Прочитанные блоки (поток чтения -> потребитель)
+   std::unique_ptr<Queue> free_; // Пустые блоки (потребитель -> поток чтения)
+   std::thread thread_;
+   PipelineBlock current_;       // Блок, из которого сейчас читает потребитель
+   size_t offset_ = 0;
+   bool eof_ = false;
+   std::atomic<bool> failed_{false};
+};
+
+/**
+ * @brief Поток записи для CsvWriter: заполненные буферы пишутся в файл,
+ * пока следующий буфер заполняется (двойная буферизация записи).
+ *
+ * Устроен так же, как ReadAheadByteSource: буферы ходят по кругу между
+ * очередью заполненных и очередью свободных, в пути - не больше
+ * BUFFER_COUNT - 1 буферов. Буферы записывает функция write (в потоке
+ * записи), поэтому там же выполняется и сжатие вывода.
+ */
+class BackgroundFileWriter
+{
+public:
+   static constexpr size_t BUFFER_COUNT = 3;
+
+   using WriteFunction = std::function<bool(const char *data, size_t size)>;
+
+   BackgroundFileWriter(WriteFunction write, size_t buffer_size)
+      : write_(std::move(write))
+   {
+      for (size_t i = 0; i + 1 < BUFFER_COUNT; ++i)
+      {
+         free_.push(PipelineBlock{std::vector<char>(buffer_size), 0});
+      }
+      thread_ = std::thread([this] { run_writer(); });
+   }
+
+   ~BackgroundFileWriter() { finish(); }
+
+   BackgroundFileWriter(const BackgroundFileWriter &) = delete;
+   BackgroundFileWriter &operator=(const BackgroundFileWriter &) = delete;
+
+   /**
+    * @brief Отдает заполненный буфер на запись и возвращает свободный.
+    *
+    * Ждет, если все остальные буферы еще записываются.
+    */
+   std::vector<char> submit(std::vector<char> data, size_t size)
+   {
+      full_.push(PipelineBlock{std::move(data), size});
+      PipelineBlock block;
+      free_.pop(block);
+      return std::move(block.data);
+   }
+
+   /**
+    * @brief Дожидается записи всех отданных буферов и завершает поток.
+    * @return false, если при записи произошла ошибка.
+    */
+   bool finish()
+   {
+      if (thread_.joinable())
+      {
+         full_.close();
+         thread_.join();
+      }
+      return !failed_.load();
+   }
+
+private:
+   void run_writer()
+   {
+      PipelineBlock block;
+      while (full_.pop(block))
+      {
+         if (!write_(block.data.data(), block.size))
+         {
+            failed_ = true;
+         }
+         free_.push(std::move(block));
+      }
+   }
+
+   using Queue = SpscQueue<PipelineBlock, 4>;
+
+   const WriteFunction write_;
+   Queue full_; // Заполненные буферы (писатель -> поток записи)
+   Queue free_; // Записанные буферы (поток записи -> писатель)
+   std::thread thread_;
+   std::atomic<bool> failed_{false};
+};
+
+// --- Сжатые файлы (gzip, zstd) ---
+
+/**
+ * @brief Формат сжатия входного или выходного файла.
+ *
+ * Поддержка форматов включается при сборке: BZ4_WITH_ZLIB (gzip, -lz)
+ * и BZ4_WITH_ZSTD (zstd, -lzstd).
+ */
+enum class Compression : uint8_t
+{
+   None,
+   Gzip,
+   Zstd,
+};
+
+const char *compression_name(Compression compression)
+{
+   return compression == Compression::Gzip ? "gzip" : compression == Compression::Zstd ? "zstd" : "нет";
+}
+
+/**
+ * @brief Поддерживает ли эта сборка формат сжатия.
+ */
+bool compression_supported(Compression compression)
+{
+   switch (compression)
+   {
+   case Compression::None:
+      return true;
+   case Compression::Gzip:
+#ifdef BZ4_WITH_ZLIB
+      return true;
+#else
+      return false;
+#endif
+   case Compression::Zstd:
+#ifdef BZ4_WITH_ZSTD
+      return true;
+#else
+      return false;
+#endif
+   }
+   return false;
+}
+
+// Сигнатуры в начале сжатых данных: gzip - 1F 8B, zstd - 28 B5 2F FD
+const size_t COMPRESSION_MAGIC_SIZE = 4;
+
+/**
+ * @brief Определяет формат сжатия по первым байтам данных.
+ */
+Compression detect_compression(const char *head, size_t size)
+{
+   const auto *bytes = reinterpret_cast<const unsigned char *>(head);
+   if (size >= 2 && bytes[0] == 0x1F && bytes[1] == 0x8B)
+   {
+      return Compression::Gzip;
+   }
+   if (size >= 4 && bytes[0] == 0x28 && bytes[1] == 0xB5 && bytes[2] == 0x2F && bytes[3] == 0xFD)
+   {
+      return Compression::Zstd;
+   }
+   return Compression::None;
+}
+
+/**
+ * @brief Формат сжатия файла по его первым байтам (None, если файл не открылся).
+ */
+Compression file_compression(const std::string &path)
+{
+   std::FILE *file = std::fopen(path.c_str(), "rb");
+   if (file == nullptr)
+   {
+      return Compression::None;
+   }
+   char head[COMPRESSION_MAGIC_SIZE];
+   const size_t size = std::fread(head, 1, sizeof(head), file);
+   std::fclose(file);
+   return detect_compression(head, size);
+}
+
+/**
+ * @brief Формат сжатия выходного файла по расширению: ".gz" или ".zst".
+ */
+Compression compression_for_path(const std::string &path)
+{
+   auto ends_with = [&path](std::string_view suffix)
+   {
+      return path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+   };
+   if (ends_with(".gz"))
+   {
+      return Compression::Gzip;
+   }
+   if (ends_with(".zst"))
+   {
+      return Compression::Zstd;
+   }
+   return Compression::None;
+}
+
+/**
+ * @brief Распаковщик потока: очередная порция сжатых данных -> порция распакованных.
+ */
+class StreamDecompressor
+{
+public:
+   virtual ~StreamDecompressor() = default;
+
+   /**
+    * @brief Распаковывает, сколько получится, из in в out.
+    *
+    * @param in_used Выходной параметр: сколько байтов in использовано.
+    * @param out_used Выходной параметр: сколько байтов записано в out.
+    * @return false, если данные повреждены (см. error()).
+    */
+   virtual bool decompress(const char *in, size_t in_size, size_t &in_used, char *out, size_t capacity, size_t &out_used) = 0;
+
+   /**
+    * @brief Закончился ли последний начатый участок сжатых данных (для проверки обрыва файла).
+    */
+   virtual bool at_end() const = 0;
+
+   virtual std::string error() const = 0;
+};
+
+/**
+ * @brief Упаковщик потока: данные сжимаются порциями и дописываются в файл.
+ */
+class StreamCompressor
+{
+public:
+   virtual ~StreamCompressor() = default;
+
+   /**
+    * @brief Сжимает size байтов и пишет в file готовую часть результата.
+    */
+   virtual bool write(const char *data, size_t size, std::FILE *file) = 0;
+
+   /**
+    * @brief Дописывает в file остаток сжатых данных и завершение формата.
+    */
+   virtual bool finish(std::FILE *file) = 0;
+};
+
+#ifdef BZ4_WITH_ZLIB
+/**
+ * @brief Распаковщик gzip (и zlib) на zlib; склеенные участки gzip ("cat a.gz b.gz")
+ * распаковываются подряд, как это делает gzip -d.
+ */
+class GzipDecompressor : public StreamDecompressor
+{
+public:
+   GzipDecompressor()
+   {
+      ok_ = inflateInit2(&stream_, 15 + 32) == Z_OK; // 32: формат gzip или zlib определяется по заголовку
+   }
+
+   ~GzipDecompressor() override
+   {
+      if (ok_)
+      {
+         inflateEnd(&stream_);
+      }
+   }
+
+   GzipDecompressor(const GzipDecompressor &) = delete;
+   GzipDecompressor &operator=(const GzipDecompressor &) = delete;
+
+   bool decompress(const char *in, size_t in_size, size_t &in_used, char *out, size_t capacity, size_t &out_used) override
+   {
+      in_used = 0;
+      out_used = 0;
+      if (!ok_)
+      {
+         return false;
+      }
+      if (at_end_)
+      {
+         if (in_size == 0)
+         {
+            return true;
+         }
+         inflateReset(&stream_); // Следующий участок gzip
+         at_end_ = false;
+      }
+      stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+      stream_.avail_in = static_cast<uInt>(std::min<size_t>(in_size, UINT_MAX));
+      stream_.next_out = reinterpret_cast<Bytef *>(out);
+      stream_.avail_out = static_cast<uInt>(std::min<size_t>(capacity, UINT_MAX));
+      const uInt avail_in = stream_.avail_in;
+      const uInt avail_out = stream_.avail_out;
+      const int status = inflate(&stream_, Z_NO_FLUSH);
+      in_used = avail_in - stream_.avail_in;
+      out_used = avail_out - stream_.avail_out;
+      if (status == Z_STREAM_END)
+      {
+         at_end_ = true;
+         return true;
+      }
+      if (status == Z_OK || status == Z_BUF_ERROR) // Z_BUF_ERROR - нужно больше входных данных
+      {
+         return true;
+      }
+      error_ = stream_.msg != nullptr ? stream_.msg : "код " + std::to_string(status);
+      return false;
+   }
+
+   bool at_end() const override { return at_end_; }
+
+   std::string error() const override { return error_; }
+
+private:
+   z_stream stream_{};
+   bool ok_ = false;
+   bool at_end_ = false;
+   std::string error_;
+};
+
+/**
+ * @brief Сжатие gzip на zlib.
+ */
+class GzipCompressor : public StreamCompressor
+{
+public:
+   GzipCompressor()
+   {
+      // 15 + 16: окно 32 КиБ, заголовок и контрольная сумма gzip
+      ok_ = deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+   }
+
+   ~GzipCompressor() override
+   {
+      if (ok_)
+      {
+         deflateEnd(&stream_);
+      }
+   }
+
+   GzipCompressor(const GzipCompressor &) = delete;
+   GzipCompressor &operator=(const GzipCompressor &) = delete;
+
+   bool write(const char *data, size_t size, std::FILE *file) override
+   {
+      while (size > 0)
+      {
+         const size_t part = std::min<size_t>(size, UINT_MAX);
+         if (!deflate_into(data, part, Z_NO_FLUSH, file))
+         {
+            return false;
+         }
+         data += part;
+         size -= part;
+      }
+      return true;
+   }
+
+   bool finish(std::FILE *file) override { return deflate_into(nullptr, 0, Z_FINISH, file); }
+
+private:
+   bool deflate_into(const char *data, size_t size, int flush, std::FILE *file)
+   {
+      if (!ok_)
+      {
+         return false;
+      }
+      stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+      stream_.avail_in = static_cast<uInt>(size);
+      for (;;)
+      {
+         stream_.next_out = reinterpret_cast<Bytef *>(out_.data());
+         stream_.avail_out = static_cast<uInt>(out_.size());
+         const int status = deflate(&stream_, flush);
+         const size_t produced = out_.size() - stream_.avail_out;
+         if (status == Z_STREAM_ERROR || std::fwrite(out_.data(), 1, produced, file) != produced)
+         {
+            return false;
+         }
+         if (flush == Z_FINISH ? status == Z_STREAM_END : stream_.avail_in == 0 && stream_.avail_out != 0)
+         {
+            return true;
+         }
+      }
+   }
+
+   z_stream stream_{};
+   bool ok_ = false;
+   std::vector<char> out_ = std::vector<char>(256 << 10);
+};
+#endif
+
+#ifdef BZ4_WITH_ZSTD
+/**
+ * @brief Распаковщик zstd; несколько кадров подряд распаковываются один за другим.
+ */
+class ZstdDecompressor : public StreamDecompressor
+{
+public:
+   ZstdDecompressor() : stream_(ZSTD_createDStream())
+   {
+      if (stream_ != nullptr)
+      {
+         ZSTD_initDStream(stream_);
+      }
+   }
+
+   ~ZstdDecompressor() override { ZSTD_freeDStream(stream_); }
+
+   ZstdDecompressor(const ZstdDecompressor &) = delete;
+   ZstdDecompressor &operator=(const ZstdDecompressor &) = delete;
+
+   bool decompress(const char *in, size_t in_size, size_t &in_used, char *out, size_t capacity, size_t &out_used) override
+   {
+      in_used = 0;
+      out_used = 0;
+      if (stream_ == nullptr)
+      {
+         return false;
+      }
+      ZSTD_inBuffer input{in, in_size, 0};
+      ZSTD_outBuffer output{out, capacity, 0};
+      const size_t status = ZSTD_decompressStream(stream_, &output, &input);
+      in_used = input.pos;
+      out_used = output.pos;
+      if (ZSTD_isError(status))
+      {
+         error_ = ZSTD_getErrorName(status);
+         return false;
+      }
+      if (in_used > 0 || out_used > 0)
+      {
+         at_end_ = status == 0; // 0 - кадр распакован и выдан целиком
+      }
+      return true;
+   }
+
+   bool at_end() const override { return at_end_; }
+
+   std::string error() const override { return error_; }
+
+private:
+   ZSTD_DStream *const stream_;
+   bool at_end_ = false;
+   std::string error_;
+};
+
+/**
+ * @brief Сжатие zstd.
+ */
+class ZstdCompressor : public StreamCompressor
+{
+public:
+   ZstdCompressor() : stream_(ZSTD_createCCtx()) {}
+
+   ~ZstdCompressor() override { ZSTD_freeCCtx(stream_); }
+
+   ZstdCompressor(const ZstdCompressor &) = delete;
+   ZstdCompressor &operator=(const ZstdCompressor &) = delete;
+
+   bool write(const char *data, size_t size, std::FILE *file) override { return compress_into(data, size, ZSTD_e_continue, file); }
+
+   bool finish(std::FILE *file) override { return compress_into(nullptr, 0, ZSTD_e_end, file); }
+
+private:
+   bool compress_into(const char *data, size_t size, ZSTD_EndDirective mode, std::FILE *file)
+   {
+      if (stream_ == nullptr)
+      {
+         return false;
+      }
+      ZSTD_inBuffer input{data, size, 0};
+      for (;;)
+      {
+         ZSTD_outBuffer output{out_.data(), out_.size(), 0};
+         const size_t remaining = ZSTD_compressStream2(stream_, &output, &input, mode);
+         if (ZSTD_isError(remaining) || std::fwrite(out_.data(), 1, output.pos, file) != output.pos)
+         {
+            return false;
+         }
+         if (mode == ZSTD_e_end ? remaining == 0 : input.pos == input.size)
+         {
+            return true;
+         }
+      }
+   }
+
+   ZSTD_CCtx *const stream_;
+   std::vector<char> out_ = std::vector<char>(ZSTD_CStreamOutSize());
+};
+#endif
+
+/**
+ * @brief Источник, распаковывающий данные другого источника, если они сжаты.
+ *
+ * Формат определяется по первым байтам (start()), а не по расширению, поэтому
+ * сжатым может быть и стандартный ввод. Несжатые данные передаются как есть,
+ * прямо в буфер получателя. read() может работать в потоке чтения наперед,
+ * поэтому ошибки распаковки не выводятся в diag, а запоминаются (error()).
+ */
+class DecompressingByteSource : public ByteSource
+{
+public:
+   DecompressingByteSource(ByteSource &source, std::ostream &diag)
+      : source_(source), diag_(diag)
+   {
+   }
+
+   /**
+    * @brief Читает начало данных и определяет формат сжатия.
+    * @return false, если данные сжаты форматом, который эта сборка не поддерживает.
+    */
+   bool start()
+   {
+      while (head_size_ < sizeof(head_))
+      {
+         const size_t bytes_read = source_.read(head_ + head_size_, sizeof(head_) - head_size_);
+         if (bytes_read == 0)
+         {
+            break;
+         }
+         head_size_ += bytes_read;
+      }
+      compression_ = detect_compression(head_, head_size_);
+      if (!compression_supported(compression_))
+      {
+         diag_ << "Ошибка: Входной файл сжат (" << compression_name(compression_)
+            << "), но программа собрана без поддержки этого формата." << std::endl;
+         return false;
+      }
+#ifdef BZ4_WITH_ZLIB
+      if (compression_ == Compression::Gzip)
+      {
+         decompressor_ = std::make_unique<GzipDecompressor>();
+      }
+#endif
+#ifdef BZ4_WITH_ZSTD
+      if (compression_ == Compression::Zstd)
+      {
+         decompressor_ = std::make_unique<ZstdDecompressor>();
+      }
+#endif
+      if (decompressor_ != nullptr)
+      {
+         input_.resize(INPUT_BLOCK_SIZE);
+         std::memcpy(input_.data(), head_, head_size_);
+         input_size_ = head_size_;
+         head_size_ = 0;
+      }
+      return true;
+   }
+
+   Compression compression() const { return compression_; }
+
+   size_t read(char *buffer, size_t capacity) override
+   {
+      if (decompressor_ == nullptr)
+      {
+         if (head_offset_ < head_size_)
+         {
+            const size_t n = std::min(capacity, head_size_ - head_offset_);
+            std::memcpy(buffer, head_ + head_offset_, n);
+            head_offset_ += n;
+            return n;
+         }
+         return source_.read(buffer, capacity);
+      }
+      while (!failed_)
+      {
+         if (input_offset_ == input_size_ && !input_end_)
+         {
+            input_size_ = source_.read(input_.data(), input_.size());
+            input_offset_ = 0;
+            input_end_ = input_size_ == 0;
+         }
+         size_t in_used = 0;
+         size_t out_used = 0;
+         if (!decompressor_->decompress(input_.data() + input_offset_, input_size_ - input_offset_, in_used, buffer, capacity, out_used))
+         {
+            error_ = std::string("Ошибка: Поврежденные сжатые данные (") + compression_name(compression_) + "): " + decompressor_->error();
+            failed_ = true;
+            break;
+         }
+         input_offset_ += in_used;
+         if (out_used > 0)
+         {
+            return out_used;
+         }
+         if (input_end_ && input_offset_ == input_size_)
+         {
+            // Вход закончился и распаковщик больше ничего не выдает
+            if (!decompressor_->at_end())
+            {
+               error_ = std::string("Ошибка: Сжатый входной файл оборван (") + compression_name(compression_) + ").";
+               failed_ = true;
+            }
+            break;
+         }
+      }
+      return 0;
+   }
+
+   bool failed() const override { return failed_ || source_.failed(); }
+
+   void cancel() override { source_.cancel(); }
+
+   /**
+    * @brief Сообщение об ошибке распаковки (пусто, если ее не было).
+    *
+    * Выводит потребитель, заметивший failed(), в своем потоке.
+    */
+   const std::string &error() const { return error_; }
+
+private:
+   static constexpr size_t INPUT_BLOCK_SIZE = 256 << 10;
+
+   ByteSource &source_;
+   std::ostream &diag_;
+   Compression compression_ = Compression::None;
+   char head_[COMPRESSION_MAGIC_SIZE];
+   size_t head_size_ = 0;
+   size_t head_offset_ = 0;
+   std::unique_ptr<StreamDecompressor> decompressor_;
+   std::vector<char> input_; // Сжатые данные
+   size_t input_size_ = 0;
+   size_t input_offset_ = 0;
+   bool input_end_ = false;
+   bool failed_ = false;
+   std::string error_;
+};
+
+/**
+ * @brief Создает упаковщик для формата (nullptr для None и для форматов,
+ * которые эта сборка не поддерживает).
+ */
+std::unique_ptr<StreamCompressor> make_compressor(Compression compression)
+{
+#ifdef BZ4_WITH_ZLIB
+   if (compression == Compression::Gzip)
+   {
+      return std::make_unique<GzipCompressor>();
+   }
+#endif
+#ifdef BZ4_WITH_ZSTD
+   if (compression == Compression::Zstd)
+   {
+      return std::make_unique<ZstdCompressor>();
+   }
+#endif
+   (void)compression;
+   return nullptr;
+}
+
+// --- Кодировка входного файла ---
+
+/**
+ * @brief Кодировка входного файла (--encoding).
+ */
+enum class InputEncoding : uint8_t
+{
+   Auto,   // UTF-8, а если файл не UTF-8 и многобайтовых последовательностей до ошибки не было - Windows-1251
+   Utf8,   // Только UTF-8, неверные последовательности - ошибка
+   Cp1251, // Windows-1251 (перекодируется в UTF-8)
+};
+
+/**
+ * @brief Скалярная проверка UTF-8 с позиции start (начала последовательности).
+ *
+ * Проверка строгая: отклоняются избыточно длинные формы, суррогаты и
+ * значения больше U+10FFFF. Участки ASCII пропускаются по 32 байта за
+ * одну проверку старших битов (SWAR).
+ *
+ * @return Конец корректного префикса (см. utf8_valid_prefix).
+ */
+size_t utf8_valid_prefix_scalar(const unsigned char *p, size_t start, size_t size, bool &has_multibyte, bool &truncated)
+{
+   truncated = false;
+   size_t i = start;
+   while (i < size)
+   {
+      if (size - i >= 32)
+      {
+         uint64_t words[4];
+         std::memcpy(words, p + i, sizeof(words));
+         if (((words[0] | words[1] | words[2] | words[3]) & 0x8080808080808080ull) == 0)
+         {
+            i += 32;
+            continue;
+         }
+      }
+      const unsigned char lead = p[i];
+      if (lead < 0x80)
+      {
+         ++i;
+         continue;
+      }
+
+      // Длина последовательности и допустимый диапазон второго байта
+      size_t length = 0;
+      unsigned char second_min = 0x80, second_max = 0xBF;
+      if (lead >= 0xC2 && lead <= 0xDF)
+      {
+         length = 2;
+      }
+      else if (lead >= 0xE0 && lead <= 0xEF)
+      {
+         length = 3;
+         second_min = lead == 0xE0 ? 0xA0 : 0x80; // Избыточно длинные формы
+         second_max = lead == 0xED ? 0x9F : 0xBF; // Суррогаты
+      }
+      else if (lead >= 0xF0 && lead <= 0xF4)
+      {
+         length = 4;
+         second_min = lead == 0xF0 ? 0x90 : 0x80;
+         second_max = lead == 0xF4 ? 0x8F : 0xBF; // Больше U+10FFFF
+      }
+      else
+      {
+         return i;
+      }
+
+      const size_t available = std::min(length, size - i);
+      if (available > 1 && (p[i + 1] < second_min || p[i + 1] > second_max))
+      {
+         return i;
+      }
+      for (size_t k = 2; k < available; ++k)
+      {
+         if ((p[i + k] & 0xC0) != 0x80)
+         {
+            return i;
+         }
+      }
+      if (available < length)
+      {
+         truncated = true;
+         return i;
+      }
+      i += length;
+      has_multibyte = true;
+   }
+   return i;
+}
+
+#if BZ4_X86
+/**
+ * @brief AVX2: проверка UTF-8 блоками по 32 байта табличным методом (Keiser, Lemire).
+ *
+ * Для каждой пары соседних байтов три выборки по 16-элементным таблицам
+ * (старшая и младшая тетрады первого байта, старшая тетрада второго) дают
+ * битовые маски возможных ошибок, их пересечение - фактические ошибки;
+ * отдельно проверяется, что после 3- и 4-байтовых начал идет нужное
+ * количество продолжений. Блоки из одного ASCII проверяются одним сравнением.
+ *
+ * @return Начало последовательности, с которой нужно продолжить скалярную
+ *         проверку: перед первым блоком с ошибкой или перед хвостом данных.
+ */
+BZ4_TARGET_AVX2 size_t utf8_valid_blocks_avx2(const unsigned char *p, size_t size, bool &has_multibyte)
+{
+   // Биты ошибок для пары байтов
+   const char TOO_SHORT = 1 << 0;  // 11______ 0_______ или 11______ 11______
+   const char TOO_LONG = 1 << 1;   // 0_______ 10______
+   const char OVERLONG_3 = 1 << 2; // 11100000 100_____
+   const char TOO_LARGE = 1 << 3;  // 11110100 1001____, 11110100 101_____, 11110101+ ...
+   const char SURROGATE = 1 << 4;  // 11101101 101_____
+   const char OVERLONG_2 = 1 << 5; // 1100000_ 10______
+   const char TOO_LARGE_1000 = 1 << 6; // 11110101+ 1000____
+   const char OVERLONG_4 = 1 << 6; // 11110000 1000____
+   const char TWO_CONTS = static_cast<char>(1 << 7); // 10______ 10______
+   const char CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+   const __m256i byte_1_high_table = _mm256_setr_epi8(
+      TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+      TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+      TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE,
+      TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+      TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+      TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+      TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE,
+      TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+   const char LARGE = CARRY | TOO_LARGE | TOO_LARGE_1000;
+   const __m256i byte_1_low_table = _mm256_setr_epi8(
+      CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+      CARRY | TOO_LARGE, LARGE, LARGE, LARGE, LARGE, LARGE, LARGE, LARGE, LARGE, LARGE | SURROGATE, LARGE, LARGE,
+      CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+      CARRY | TOO_LARGE, LARGE, LARGE, LARGE, LARGE, LARGE, LARGE, LARGE, LARGE, LARGE | SURROGATE, LARGE, LARGE);
+   const char CONT_1000 = TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4;
+   const char CONT_1001 = TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE;
+   const char CONT_101 = TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE;
+   const __m256i byte_2_high_table = _mm256_setr_epi8(
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+      CONT_1000, CONT_1001, CONT_101, CONT_101, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+      CONT_1000, CONT_1001, CONT_101, CONT_101, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+   // Последние байты блока, после которых последовательность не может быть завершена
+   const __m256i incomplete_max = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, static_cast<char>(0xEF), static_cast<char>(0xDF), static_cast<char>(0xBF));
+   const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+
+   __m256i prev_input = _mm256_setzero_si256();
+   __m256i prev_incomplete = _mm256_setzero_si256();
+   size_t i = 0;
+   for (; i + 32 <= size; i += 32)
+   {
+      const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+      const bool ascii = _mm256_movemask_epi8(input) == 0;
+      __m256i error;
+      if (ascii)
+      {
+         error = prev_incomplete; // Блок ASCII: ошибка, только если прошлый блок оборван
+      }
+      else
+      {
+         // Байты, сдвинутые на 1-3 позиции назад (с захватом конца предыдущего блока)
+         const __m256i carried = _mm256_permute2x128_si256(prev_input, input, 0x21);
+         const __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+         const __m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+         const __m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+
+         const __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+         const __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, low_nibble));
+         const __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+         const __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+         // Третий и четвертый байты 3- и 4-байтовых последовательностей должны быть продолжениями
+         const __m256i is_third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+         const __m256i is_fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+         const __m256i must_be_continuation = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+         error = _mm256_xor_si256(must_be_continuation, special_cases);
+      }
+      if (!_mm256_testz_si256(error, error))
+      {
+         break;
+      }
+      has_multibyte = has_multibyte || !ascii;
+      prev_incomplete = _mm256_subs_epu8(input, incomplete_max);
+      prev_input = input;
+   }
+
+   // Возвращаемся к началу последовательности, которая могла начаться в предыдущем блоке
+   for (size_t k = 1; k <= 3 && k <= i; ++k)
+   {
+      const unsigned char c = p[i - k];
+      if ((c & 0xC0) != 0x80)
+      {
+         return c >= 0xC0 ? i - k : i;
+      }
+   }
+   return i;
+}
+#endif
+
+/**
+ * @brief Длина корректного префикса UTF-8.
+ *
+ * С ядром сканирования AVX2 (см. --simd) данные проверяются векторно, а
+ * скалярная проверка дорабатывает хвост и точно находит место ошибки.
+ *
+ * @param has_multibyte Устанавливается в true, если в префиксе есть многобайтовые последовательности.
+ * @param truncated Выходной параметр: префикс оборван на начале верной, но
+ *                  неполной последовательности (продолжение - в следующем блоке).
+ * @return Количество байтов с начала data, образующих целые корректные последовательности.
+ */
+size_t utf8_valid_prefix(const char *data, size_t size, bool &has_multibyte, bool &truncated)
+{
+   const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+   size_t start = 0;
+#if BZ4_X86
+   if (g_classify_block == classify_block_avx2)
+   {
+      start = utf8_valid_blocks_avx2(p, size, has_multibyte);
+   }
+#endif
+   return utf8_valid_prefix_scalar(p, start, size, has_multibyte, truncated);
+}
+
+// Коды Unicode для байтов 0x80-0xFF Windows-1251 (0x98 не определен)
+const uint16_t CP1251_CODE_POINTS[128] = {
+   0x0402, 0x0403, 0x201A, 0x0453, 0x201E, 0x2026, 0x2020, 0x2021,   // 0x80
+   0x20AC, 0x2030, 0x0409, 0x2039, 0x040A, 0x040C, 0x040B, 0x040F,   // 0x88
+   0x0452, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,   // 0x90
+   0xFFFD, 0x2122, 0x0459, 0x203A, 0x045A, 0x045C, 0x045B, 0x045F,   // 0x98
+   0x00A0, 0x040E, 0x045E, 0x0408, 0x00A4, 0x0490, 0x00A6, 0x00A7,   // 0xA0
+   0x0401, 0x00A9, 0x0404, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x0407,   // 0xA8
+   0x00B0, 0x00B1, 0x0406, 0x0456, 0x0491, 0x00B5, 0x00B6, 0x00B7,   // 0xB0
+   0x0451, 0x2116, 0x0454, 0x00BB, 0x0458, 0x0405, 0x0455, 0x0457,   // 0xB8
+   0x0410, 0x0411, 0x0412, 0x0413, 0x0414, 0x0415, 0x0416, 0x0417,   // 0xC0
+   0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E, 0x041F,   // 0xC8
+   0x0420, 0x0421, 0x0422, 0x0423, 0x0424, 0x0425, 0x0426, 0x0427,   // 0xD0
+   0x0428, 0x0429, 0x042A, 0x042B, 0x042C, 0x042D, 0x042E, 0x042F,   // 0xD8
+   0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,   // 0xE0
+   0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E, 0x043F,   // 0xE8
+   0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,   // 0xF0
+   0x0448, 0x0449, 0x044A, 0x044B, 0x044C, 0x044D, 0x044E, 0x044F,   // 0xF8
+};
+
+/**
+ * @brief Готовые последовательности UTF-8 для байтов 0x80-0xFF: длина и до 3 байтов.
+ */
+struct Cp1251Utf8Table
+{
+   std::array<std::array<char, 4>, 128> entries{};
+
+   constexpr Cp1251Utf8Table()
+   {
+      for (size_t i = 0; i < 128; ++i)
+      {
+         const uint16_t cp = CP1251_CODE_POINTS[i];
+         std::array<char, 4> &entry = entries[i];
+         if (cp < 0x800)
+         {
+            entry[0] = 2;
+            entry[1] = static_cast<char>(0xC0 | (cp >> 6));
+            entry[2] = static_cast<char>(0x80 | (cp & 0x3F));
+         }
+         else
+         {
+            entry[0] = 3;
+            entry[1] = static_cast<char>(0xE0 | (cp >> 12));
+            entry[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            entry[3] = static_cast<char>(0x80 | (cp & 0x3F));
+         }
+      }
+   }
+};
+
+constexpr Cp1251Utf8Table CP1251_UTF8{};
+
+/**
+ * @brief Перекодирует текст Windows-1251 в UTF-8.
+ *
+ * ASCII копируется по 8 байтов, остальные байты заменяются готовыми
+ * последовательностями из таблицы.
+ *
+ * @param out Буфер не меньше 3 * size байтов.
+ * @return Количество записанных байтов.
+ */
+size_t cp1251_to_utf8(const char *in, size_t size, char *out)
+{
+   char *const out_begin = out;
+   size_t i = 0;
+   while (i < size)
+   {
+      if (size - i >= 8)
+      {
+         uint64_t word;
+         std::memcpy(&word, in + i, sizeof(word));
+         if ((word & 0x8080808080808080ull) == 0)
+         {
+            std::memcpy(out, &word, sizeof(word));
+            out += 8;
+            i += 8;
+            continue;
+         }
+      }
+      const unsigned char c = static_cast<unsigned char>(in[i++]);
+      if (c < 0x80)
+      {
+         *out++ = static_cast<char>(c);
+         continue;
+      }
+      const std::array<char, 4> &entry = CP1251_UTF8.entries[c - 0x80];
+      std::memcpy(out, entry.data() + 1, 3); // Лишний байт перезапишется следующим символом
+      out += entry[0];
+   }
+   return static_cast<size_t>(out - out_begin);
+}
+
+/**
+ * @brief Проверяет метку порядка байтов в начале данных.
+ * @return false (с ошибкой в diag), если файл в UTF-16/UTF-32.
+ */
+bool check_byte_order_mark(const char *data, size_t size, InputEncoding &encoding, std::ostream &diag)
+{
+   const std::string_view head(data, std::min<size_t>(size, 3));
+   if (head.substr(0, 2) == "\xFF\xFE" || head.substr(0, 2) == "\xFE\xFF")
+   {
+      diag << "Ошибка: Входной файл в кодировке UTF-16/UTF-32 не поддерживается; сохраните его в UTF-8." << std::endl;
+      return false;
+   }
+   if (head == "\xEF\xBB\xBF" && encoding == InputEncoding::Auto)
+   {
+      encoding = InputEncoding::Utf8; // Метка UTF-8 - файл проверяется строго
+   }
+   return true;
+}
+
+/**
+ * @brief Сообщение о неверной последовательности UTF-8.
+ */
+void report_invalid_utf8(uint64_t offset, std::ostream &diag)
+{
+   diag << "Ошибка: Входной файл не в кодировке UTF-8 (неверная последовательность байтов со смещения " << offset
+      << "). Если файл в Windows-1251, укажите --encoding cp1251." << std::endl;
+}
+
+/**
+ * @brief Определяет кодировку входных данных, целиком находящихся в памяти,
+ *        и при необходимости перекодирует их в UTF-8.
+ *
+ * @param encoding Заданная кодировка (Auto - определить).
+ * @param decoded Выходной буфер для перекодированных данных.
+ * @param transcoded Выходной параметр: данные перекодированы (читать из decoded).
+ * @return false, если файл не UTF-8 (при Utf8) или кодировка не поддерживается.
+ */
+bool decode_input(const char *data, size_t size, InputEncoding encoding, std::string &decoded, bool &transcoded, std::ostream &diag)
+{
+   transcoded = false;
+   if (!check_byte_order_mark(data, size, encoding, diag))
+   {
+      return false;
+   }
+   if (encoding != InputEncoding::Cp1251)
+   {
+      bool multibyte = false;
+      bool truncated = false;
+      const size_t valid = utf8_valid_prefix(data, size, multibyte, truncated);
+      if (valid == size)
+      {
+         return true;
+      }
+      if (encoding == InputEncoding::Utf8 || multibyte)
+      {
+         // Часть файла уже в UTF-8 - это испорченный UTF-8, а не Windows-1251
+         report_invalid_utf8(valid, diag);
+         return false;
+      }
+      diag << "Предупреждение: Входной файл не в кодировке UTF-8, читается как Windows-1251." << std::endl;
+   }
+   decoded.resize(size * 3);
+   decoded.resize(cp1251_to_utf8(data, size, &decoded[0]));
+   transcoded = true;
+   return true;
+}
+
+/**
+ * @brief Источник байтов, выдающий данные другого источника в UTF-8.
+ *
+ * Данные UTF-8 читаются прямо в буфер получателя и проверяются на месте;
+ * последовательность, разрезанная границей блока, переносится в следующий
+ * вызов. Для Windows-1251 блок читается во внутренний буфер и
+ * перекодируется в буфер получателя. В режиме Auto до первого байта вне
+ * ASCII данные одинаковы в обеих кодировках, а по первой неверной
+ * последовательности (если до нее не было многобайтовых) остаток
+ * перекодируется из Windows-1251. При неверном UTF-8 чтение прекращается
+ * с ошибкой (failed()).
+ */
+class DecodingByteSource : public ByteSource
+{
+public:
+   DecodingByteSource(ByteSource &source, InputEncoding encoding, std::ostream &diag)
+      : source_(source), encoding_(encoding), diag_(diag)
+   {
+   }
+
+   size_t read(char *buffer, size_t capacity) override
+   {
+      for (;;)
+      {
+         if (pending_offset_ < pending_.size())
+         {
+            const size_t n = std::min(capacity, pending_.size() - pending_offset_);
+            std::memcpy(buffer, pending_.data() + pending_offset_, n);
+            pending_offset_ += n;
+            return n;
+         }
+         pending_.clear();
+         pending_offset_ = 0;
+         if (failed_)
+         {
+            return 0;
+         }
+
+         if (encoding_ == InputEncoding::Cp1251)
+         {
+            const bool direct = capacity >= 3 * SMALL_BLOCK;
+            raw_.resize(direct ? capacity / 3 : SMALL_BLOCK);
+            const size_t bytes_read = source_.read(raw_.data(), raw_.size());
+            if (bytes_read == 0)
+            {
+               return 0;
+            }
+            if (direct)
+            {
+               return cp1251_to_utf8(raw_.data(), bytes_read, buffer);
+            }
+            pending_.resize(bytes_read * 3);
+            pending_.resize(cp1251_to_utf8(raw_.data(), bytes_read, &pending_[0]));
+            continue;
+         }
+
+         // UTF-8 (или кодировка еще не определена): читаем на место, после перенесенного хвоста
+         const bool direct = capacity >= carry_.size() + SMALL_BLOCK;
+         char *target = direct ? buffer : small_;
+         const size_t room = direct ? capacity : sizeof(small_);
+         const size_t carried = carry_.size();
+         std::memcpy(target, carry_.data(), carried);
+         carry_.clear();
+         const size_t bytes_read = source_.read(target + carried, room - carried);
+         if (bytes_read == 0)
+         {
+            // Если оборван сам источник (например, сжатый файл), об ошибке сообщает он
+            if (carried > 0 && !source_.failed())
+            {
+               if (encoding_ == InputEncoding::Auto && !has_multibyte_)
+               {
+                  // Последний байт файла - не начало UTF-8, а символ Windows-1251 (как и при отображении в память)
+                  switch_to_cp1251(target, carried, pending_);
+                  continue;
+               }
+               report_invalid_utf8(position_, diag_); // Файл оборван посреди последовательности
+               failed_ = true;
+            }
+            return 0;
+         }
+         size_t total = carried + bytes_read;
+         // Метка порядка байтов - по первым трем байтам, даже если канал выдает их по одному
+         while (position_ == 0 && total < 3)
+         {
+            const size_t more = source_.read(target + total, room - total);
+            if (more == 0)
+            {
+               break;
+            }
+            total += more;
+         }
+         if (position_ == 0 && !check_byte_order_mark(target, total, encoding_, diag_))
+         {
+            failed_ = true;
+            return 0;
+         }
+
+         size_t ready = total;
+         bool truncated = false;
+         const size_t valid = utf8_valid_prefix(target, total, has_multibyte_, truncated);
+         if (valid < total)
+         {
+            if (truncated)
+            {
+               carry_.assign(target + valid, total - valid);
+               ready = valid;
+            }
+            else if (encoding_ == InputEncoding::Auto && !has_multibyte_)
+            {
+               // До этого места был только ASCII - дальше файл в Windows-1251
+               switch_to_cp1251(target + valid, total - valid, tail_);
+               ready = valid;
+            }
+            else
+            {
+               report_invalid_utf8(position_ + valid, diag_);
+               failed_ = true;
+               ready = valid;
+            }
+         }
+         position_ += ready;
+
+         if (!direct)
+         {
+            pending_.assign(target, ready);
+         }
+         pending_ += tail_;
+         tail_.clear();
+         if (direct && ready > 0)
+         {
+            return ready;
+         }
+      }
+   }
+
+   bool failed() const override { return failed_ || source_.failed(); }
+
+   /**
+    * @brief Чтение прекращено из-за неверной кодировки (сообщение уже выведено).
+    */
+   bool decoding_failed() const { return failed_; }
+
+   /**
+    * @brief Данные перекодируются из Windows-1251.
+    */
+   bool transcoded() const { return encoding_ == InputEncoding::Cp1251; }
+
+   /**
+    * @brief Забывает недочитанные данные после перехода источника к байту offset.
+    */
+   void reset(uint64_t offset)
+   {
+      carry_.clear();
+      pending_.clear();
+      pending_offset_ = 0;
+      tail_.clear();
+      position_ = offset;
+   }
+
+private:
+   static constexpr size_t SMALL_BLOCK = 64;
+
+   /**
+    * @brief Переключает чтение на Windows-1251 и перекодирует в out уже прочитанный остаток.
+    */
+   void switch_to_cp1251(const char *data, size_t size, std::string &out)
+   {
+      diag_ << "Предупреждение: Входной файл не в кодировке UTF-8, читается как Windows-1251." << std::endl;
+      encoding_ = InputEncoding::Cp1251;
+      out.resize(size * 3);
+      out.resize(cp1251_to_utf8(data, size, &out[0]));
+   }
+
+   ByteSource &source_;
+   InputEncoding encoding_;
+   std::ostream &diag_;
+   std::vector<char> raw_;  // Блок Windows-1251 до перекодирования
+   std::string carry_;      // Начало последовательности, разрезанной границей блока
+   std::string pending_;    // Готовые данные, не поместившиеся в буфер получателя
+   size_t pending_offset_ = 0;
+   std::string tail_;       // Перекодированный остаток блока при переключении на Windows-1251
+   char small_[SMALL_BLOCK * 2];
+   uint64_t position_ = 0;  // Смещение проверенных данных от начала потока
+   bool has_multibyte_ = false; // Уже встречались многобайтовые последовательности
+   bool failed_ = false;
+};
+
+
+/**
+ * @brief Снимает кавычки с сырого поля CSV, записывая результат в буфер.
+ *
+ * Правила те же, что и при разборе строки: пара "" дает одну кавычку,
+ * одиночная кавычка переключает режим "внутри кавычек" и в поле не попадает.
+ *
+ * @param raw Сырое поле (между разделителями) с кавычками.
+ * @param scratch Буфер, в конец которого дописывается результат.
+ */
+void unescape_csv_field(std::string_view raw, std::string &scratch)
+{
+   for (size_t i = 0; i < raw.size(); ++i)
+   {
+      if (raw[i] == '"')
+      {
+         if (i + 1 < raw.size() && raw[i + 1] == '"')
+         {
+            // Двойная кавычка "" внутри поля
+            scratch += '"';
+            ++i; // Пропускаем вторую кавычку
+         }
+         // Одиночная кавычка - начало или конец поля в кавычках, в поле не попадает
+      }
+      else
+      {
+         scratch += raw[i];
+      }
+   }
+}
+
+/**
+ * @brief Собирает поля записи по найденным при сканировании границам.
+ *
+ * Поля возвращаются как представления: поле без кавычек (и поле вида "...",
+ * не содержащее внутренних кавычек) указывает прямо внутрь текста записи.
+ * Только поля с экранированными кавычками распаковываются в scratch. Буфер
+ * scratch резервируется заранее на длину записи, поэтому не перераспределяется
+ * во время разбора и представления на него остаются корректными.
+ *
+ * @param record Запись с границами полей.
+ * @param fields Выходной вектор представлений полей (очищается перед разбором).
+ * @param scratch Буфер для распакованных полей (очищается перед разбором).
+ */
+void split_csv_record(const CsvRecord &record, std::vector<std::string_view> &fields, std::string &scratch)
+{
+   const std::string_view text = record.text;
+   fields.clear();
+   scratch.clear();
+   scratch.reserve(text.size());
+
+   size_t field_start = 0;
+   for (uint32_t boundary : record.boundaries)
+   {
+      // Последняя граница может указывать за убранный '\r'
+      const size_t field_end = std::min<size_t>(boundary & FIELD_OFFSET_MASK, text.size());
+      const std::string_view raw = text.substr(field_start, field_end - field_start);
+      if ((boundary & FIELD_QUOTED) == 0)
+      {
+         fields.push_back(raw);
+      }
+      else if (raw.size() >= 3 && raw.front() == '"' && raw.back() == '"' &&
+         raw.substr(1, raw.size() - 2).find('"') == std::string_view::npos)
+      {
+         // Обычное поле в кавычках без экранирования - достаточно снять кавычки
+         // (поле "" сюда не попадает: это экранированная кавычка)
+         fields.push_back(raw.substr(1, raw.size() - 2));
+      }
+      else
+      {
+         const size_t offset = scratch.size();
+         unescape_csv_field(raw, scratch);
+         fields.push_back(std::string_view(scratch).substr(offset));
+      }
+      field_start = field_end + 1;
+   }
+}
+
+/**
+ * @brief Возвращает одно поле записи по найденным при сканировании границам.
+ *
+ * Для случаев, когда из записи нужно одно поле (например, Last Name уже
+ * готовой строки вывода) и собирать все поля split_csv_record незачем.
+ *
+ * @param record Запись с границами полей.
+ * @param index Номер поля.
+ * @param scratch Буфер для распакованного поля в кавычках (очищается, если нужен).
+ * @return Поле без кавычек; пустое, если в записи меньше полей.
+ */
+std::string_view csv_record_field(const CsvRecord &record, size_t index, std::string &scratch)
+{
+   if (index >= record.boundaries.size())
+   {
+      return std::string_view();
+   }
+   const size_t begin = index == 0 ? 0 : (record.boundaries[index - 1] & FIELD_OFFSET_MASK) + 1;
+   const uint32_t boundary = record.boundaries[index];
+   const size_t end = std::min<size_t>(boundary & FIELD_OFFSET_MASK, record.text.size());
+   const std::string_view raw = record.text.substr(begin, end - begin);
+   if ((boundary & FIELD_QUOTED) == 0)
+   {
+      return raw;
+   }
+   scratch.clear();
+   unescape_csv_field(raw, scratch);
+   return scratch;
+}
+
+/**
+ * @brief Разбирает строку CSV на отдельные поля с учетом кавычек.
+ *
+ * Поддерживает поля, заключенные в двойные кавычки, и экранированные
+ * двойные кавычки ("") внутри таких полей. Строка сканируется векторным
+ * ядром (scan_record), поля собираются split_csv_record, поэтому
+ * представления указывают внутрь line или scratch.
+ *
+ * @param line Строка CSV для разбора (одна запись).
+ * @param fields Выходной вектор представлений полей (очищается перед разбором).
+ * @param scratch Буфер для распакованных полей (очищается перед разбором).
+ */
+void parse_csv_line(std::string_view line, std::vector<std::string_view> &fields, std::string &scratch)
+{
+   thread_local CsvRecord record; // Переиспользуем вектор границ между вызовами
+   CsvScanState state;
+   record.boundaries.clear();
+   const char *newline = scan_record(line.data(), line.data() + line.size(), 0, state, record.boundaries);
+   if (newline == nullptr)
+   {
+      finish_record_boundaries(state, line.size(), record.boundaries);
+   }
+   record.text = line;
+   split_csv_record(record, fields, scratch);
+}
+
+/**
+ * @brief Есть ли среди восьми байтов слова байт, равный байту каждого байта pattern.
+ *
+ * Классическая проверка SWAR "есть ли нулевой байт" для word ^ pattern:
+ * ненулевой результат точно означает совпадение, ложных срабатываний нет.
+ */
+constexpr uint64_t swar_has_byte(uint64_t word, uint64_t pattern)
+{
+   const uint64_t x = word ^ pattern;
+   return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
+
+/**
+ * @brief Есть ли в слове запятая, кавычка, '\n' или '\r' (символы, требующие кавычек в CSV).
+ */
+constexpr bool swar_has_csv_special(uint64_t word)
+{
+   return (swar_has_byte(word, 0x2C2C2C2C2C2C2C2CULL) | swar_has_byte(word, 0x2222222222222222ULL)
+      | swar_has_byte(word, 0x0A0A0A0A0A0A0A0AULL) | swar_has_byte(word, 0x0D0D0D0D0D0D0D0DULL)) != 0;
+}
+
+/**
+ * @brief Проверяет, нужно ли заключать поле в кавычки при записи в CSV.
+ *
+ * Один проход по 8 байтов (SWAR) ищет сразу все четыре символа вместо
+ * отдельного поиска каждого. Хвост короче 8 байтов собирается из
+ * перекрывающихся чтений (первые и последние 4 байта; для 1-3 байтов -
+ * первый, средний и последний), чтобы не выходить за поле; недостающие
+ * байты слова нулевые и ни с одним из символов не совпадают.
+ *
+ * @param field Проверяемое поле.
+ * @return true, если поле содержит запятую, кавычку, '\n' или '\r'.
+ */
+inline bool needs_csv_quoting(std::string_view field)
+{
+   const char *data = field.data();
+   size_t size = field.size();
+   for (; size >= 8; data += 8, size -= 8)
+   {
+      uint64_t word;
+      std::memcpy(&word, data, 8);
+      if (swar_has_csv_special(word))
+      {
+         return true;
+      }
+   }
+   uint64_t word = 0;
+   if (size >= 4)
+   {
+      uint32_t head, tail;
+      std::memcpy(&head, data, 4);
+      std::memcpy(&tail, data + size - 4, 4);
+      word = head | static_cast<uint64_t>(tail) << 32;
+   }
+   else if (size > 0)
+   {
+      word = static_cast<unsigned char>(data[0]) | static_cast<uint64_t>(static_cast<unsigned char>(data[size / 2])) << 8
+         | static_cast<uint64_t>(static_cast<unsigned char>(data[size - 1])) << 16;
+   }
+   return swar_has_csv_special(word);
+}
+
+/**
+ * @brief Форматирует поле для безопасной записи в CSV.
+ *
+ * Если поле содержит запятую, кавычку или перевод строки ('\n' или '\r'),
+ * оно заключается в двойные кавычки, а внутренние двойные кавычки
+ * удваиваются (""). Результат дописывается в конец out, поэтому при
+ * переиспользовании буфера временные строки не создаются.
+ *
+ * @param field Поле для форматирования.
+ * @param out Буфер, в конец которого дописывается отформатированное поле.
+ */
+void format_csv_field(std::string_view field, std::string &out)
+{
+   // Проверяем, нужно ли экранирование
+   if (needs_csv_quoting(field))
+   {
+      out += '"';
+      for (char c : field)
+      {
+         if (c == '"')
+         {
+            // Экранируем кавычки двойными кавычками
+            out += "\"\"";
+         }
+         else
+         {
+            out += c;
+         }
+      }
+      out += '"';
+      return;
+   }
+   // Если экранирование не требуется, дописываем поле как есть
+   out += field;
+}
+
+/**
+ * @brief Буферизованный писатель CSV.
+ *
+ * Накапливает вывод в большом непрерывном буфере и записывает его в файл
+ * крупными блоками одним вызовом fwrite (поток открыт без собственной
+ * буферизации CRT). Поля экранируются прямо в буфере, без временных строк
+ * и без накладных расходов operator<< (sentry, локаль) на каждое поле.
+ * Без открытого файла писатель работает только в памяти: буфер растет,
+ * а его содержимое можно забрать через data()/size().
+ */
+class CsvWriter
+{
+public:
+   static constexpr size_t DEFAULT_BUFFER_SIZE = 4 << 20; // 4 МиБ
+
+   explicit CsvWriter(size_t buffer_size = DEFAULT_BUFFER_SIZE)
+      : buffer_(std::max<size_t>(buffer_size, 64))
+   {
+   }
+
+   ~CsvWriter() { close(); }
+
+   CsvWriter(const CsvWriter &) = delete;
+   CsvWriter &operator=(const CsvWriter &) = delete;
+
+   /**
+    * @brief Открывает (создает или перезаписывает) выходной файл.
+    *
+    * @param append Дописывать в конец существующего файла вместо перезаписи.
+    */
+   bool open(const std::string &path, bool append = false)
+   {
+      close();
+      file_ = std::fopen(path.c_str(), append ? "ab" : "wb");
+      if (file_ == nullptr)
+      {
+         return false;
+      }
+      std::setvbuf(file_, nullptr, _IONBF, 0); // Буферизуем сами, блоками buffer_size
+      failed_ = false;
+      return true;
+   }
+
+   /**
+    * @brief Сжимает вывод в формате compression (вызывается после open).
+    *
+    * Сжимаются уже сброшенные из буфера блоки, поэтому форматирование полей
+    * не меняется; bytes_written() считает несжатые байты. Завершение формата
+    * дописывает close(). Для Compression::None (и форматов, не поддерживаемых
+    * сборкой) вывод остается несжатым.
+    */
+   void compress(Compression compression)
+   {
+      if (file_ != nullptr && background_ == nullptr)
+      {
+         compressor_ = make_compressor(compression);
+      }
+   }
+
+   /**
+    * @brief Направляет вывод в стандартный вывод (для работы в конвейере).
+    *
+    * Стандартный вывод не закрывается в close(), только сбрасывается.
+    */
+   bool open_stdout()
+   {
+      close();
+#ifdef _WIN32
+      _setmode(_fileno(stdout), _O_BINARY); // Без преобразования '\n' в CRLF
+#endif
+      std::setvbuf(stdout, nullptr, _IONBF, 0);
+      file_ = stdout;
+      owns_file_ = false;
+      failed_ = false;
+      return true;
+   }
+
+   /**
+    * @brief Передает запись в файл отдельному потоку (--pipeline).
+    *
+    * flush() после этого только отдает заполненный буфер потоку записи и
+    * продолжает со свободным; ошибки записи сообщает close().
+    */
+   void write_in_background()
+   {
+      if (file_ != nullptr && background_ == nullptr)
+      {
+         background_ = std::make_unique<BackgroundFileWriter>([this](const char *data, size_t size)
+            { return write_file(data, size); }, buffer_.size());
+      }
+   }
+
+   /**
+    * @brief Дописывает байты без экранирования.
+    */
+   void write_raw(std::string_view text)
+   {
+      if (file_ != nullptr && background_ == nullptr && text.size() >= buffer_.size() / 2)
+      {
+         // Большой блок (например, готовый участок) пишем напрямую, минуя буфер
+         flush();
+         if (!write_file(text.data(), text.size()))
+         {
+            failed_ = true;
+         }
+         written_ += text.size();
+         return;
+      }
+      char *out = reserve(text.size());
+      if (!text.empty())
+      {
+         std::memcpy(out, text.data(), text.size());
+      }
+      used_ += text.size();
+   }
+
+   /**
+    * @brief Дописывает один символ без экранирования.
+    */
+   void put(char c)
+   {
+      *reserve(1) = c;
+      ++used_;
+   }
+
+   /**
+    * @brief Дописывает поле CSV, при необходимости заключая его в кавычки.
+    *
+    * Правила те же, что в format_csv_field, но экранирование выполняется
+    * прямо в буфере писателя.
+    */
+   void write_field(std::string_view field)
+   {
+      if (!needs_csv_quoting(field))
+      {
+         write_raw(field);
+         return;
+      }
+      // В худшем случае каждая кавычка удваивается, плюс две обрамляющие
+      char *const begin = reserve(field.size() * 2 + 2);
+      char *out = begin;
+      *out++ = '"';
+      for (char c : field)
+      {
+         *out++ = c;
+         if (c == '"')
+         {
+            // Экранируем кавычки двойными кавычками
+            *out++ = '"';
+         }
+      }
+      *out++ = '"';
+      used_ += static_cast<size_t>(out - begin);
+   }
+
+   /**
+    * @brief Завершает строку; при заполнении буфера сбрасывает его в файл.
+    */
+   void end_row()
+   {
+      put('\n');
+      if (file_ != nullptr && used_ >= buffer_.size() / 2)
+      {
+         flush();
+      }
+   }
+
+   /**
+    * @brief Записывает накопленный буфер в файл одним блоком.
+    */
+   bool flush()
+   {
+      if (background_ != nullptr && used_ > 0)
+      {
+         buffer_ = background_->submit(std::move(buffer_), used_);
+         written_ += used_;
+         used_ = 0;
+      }
+      else if (file_ != nullptr && used_ > 0)
+      {
+         if (!write_file(buffer_.data(), used_))
+         {
+            failed_ = true;
+         }
+         written_ += used_;
+         used_ = 0;
+      }
+      return !failed_;
+   }
+
+   /**
+    * @brief Сбрасывает буфер и закрывает файл.
+    * @return false, если при записи произошла ошибка.
+    */
+   bool close()
+   {
+      if (file_ == nullptr)
+      {
+         return !failed_;
+      }
+      flush();
+      if (background_ != nullptr)
+      {
+         failed_ = !background_->finish() || failed_;
+         background_.reset();
+      }
+      if (compressor_ != nullptr)
+      {
+         failed_ = !compressor_->finish(file_) || failed_;
+         compressor_.reset();
+      }
+      if (owns_file_ ? std::fclose(file_) != 0 : std::fflush(file_) != 0)
+      {
+         failed_ = true;
+      }
+      file_ = nullptr;
+      owns_file_ = true;
+      return !failed_;
+   }
+
+   bool failed() const { return failed_; }
+
+   const char *data() const { return buffer_.data(); }
+   size_t size() const { return used_; }
+   void clear() { used_ = 0; }
+
+   /**
+    * @brief Сколько байтов передано писателю (записано в файл и еще в буфере).
+    */
+   uint64_t bytes_written() const { return written_ + used_; }
+
+private:
+   /**
+    * @brief Пишет блок в файл (через упаковщик, если вывод сжимается).
+    */
+   bool write_file(const char *data, size_t size)
+   {
+      if (compressor_ != nullptr)
+      {
+         return compressor_->write(data, size, file_);
+      }
+      return std::fwrite(data, 1, size, file_) == size;
+   }
+
+   /**
+    * @brief Гарантирует место под n байтов и возвращает указатель на него.
+    */
+   char *reserve(size_t n)
+   {
+      if (used_ + n > buffer_.size())
+      {
+         flush();
+         if (used_ + n > buffer_.size())
+         {
+            // Без файла (или для очень длинного поля) буфер растет
+            buffer_.resize(std::max(buffer_.size() * 2, used_ + n));
+         }
+      }
+      return buffer_.data() + used_;
+   }
+
+   std::vector<char> buffer_;
+   size_t used_ = 0;
+   std::FILE *file_ = nullptr;
+   bool owns_file_ = true; // false для стандартного вывода
+   bool failed_ = false;
+   uint64_t written_ = 0;  // Байтов, сброшенных в файл
+   std::unique_ptr<BackgroundFileWriter> background_; // Поток записи (--pipeline)
+   std::unique_ptr<StreamCompressor> compressor_;     // Сжатие вывода (.gz, .zst)
+};
+
+/**
+ * @brief Разделяет комбинированную строку "Группа Фамилия" на две части.
+ *
+ * Ищет первый пробел как разделитель. Всё до первого пробела считается группой,
+ * всё после - фамилией. Учитывает возможные лишние пробелы. Части возвращаются
+ * как представления внутрь combined, без копирования.
+ *
+ * @param combined Входная строка (например, "ПМ-35 ПОНОМАРЕВ").
+ * @param group Выходной параметр для группы (например, "ПМ-35").
+ * @param lastName Выходной параметр для фамилии (например, "ПОНОМАРЕВ").
+ */
+void splitGroupLastName(std::string_view combined, std::string_view &group, std::string_view &lastName)
+{
+   group = std::string_view();
+   lastName = std::string_view();
+   if (combined.empty())
+   {
+      return;
+   }
+
+   size_t first_space = combined.find(' ');
+   if (first_space != std::string_view::npos)
+   {
+      // Нашли пробел - разделяем. Группа заканчивается на первом пробеле,
+      // поэтому пробелов в конце у нее нет (если строка начинается с пробела, группа пустая)
+      group = combined.substr(0, first_space);
+
+      // Ищем начало фамилии (первый непробельный символ после первого пробела)
+      size_t last_name_start = combined.find_first_not_of(' ', first_space);
+      if (last_name_start != std::string_view::npos)
+      {
+         lastName = combined.substr(last_name_start);
+      }
+      // Если после первого пробела были только пробелы, lastName останется пустой
+   }
+   else
+   {
+      // Пробел не найден, считаем всю строку фамилией
+      lastName = combined;
+   }
+}
+
+// Классы символов номера телефона: 0-9 - цифра, остальные ниже
+const uint8_t PHONE_SEPARATOR = 10; // Пробел, табуляция, '-', '(', ')', '.'
+const uint8_t PHONE_PLUS = 11;
+const uint8_t PHONE_INVALID = 12;   // Буквы и прочие символы - номер не нормализуется
+
+constexpr std::array<uint8_t, 256> make_phone_char_classes()
+{
+   std::array<uint8_t, 256> classes{};
+   for (size_t c = 0; c < classes.size(); ++c)
+   {
+      classes[c] = PHONE_INVALID;
+   }
+   for (char c = '0'; c <= '9'; ++c)
+   {
+      classes[static_cast<unsigned char>(c)] = static_cast<uint8_t>(c - '0');
+   }
+   for (char c : {' ', '\t', '-', '(', ')', '.'})
+   {
+      classes[static_cast<unsigned char>(c)] = PHONE_SEPARATOR;
+   }
+   classes['+'] = PHONE_PLUS;
+   return classes;
+}
+
+const std::array<uint8_t, 256> PHONE_CHAR_CLASS = make_phone_char_classes();
+
+const size_t PHONE_E164_LENGTH = 12; // "+7" и 10 цифр
+
+/**
+ * @brief Приводит российский номер телефона к виду E.164: +7XXXXXXXXXX.
+ *
+ * Один проход по полю с классификацией символов по таблице, без
+ * регулярных выражений и выделения памяти. Понимает "8 (912) 345-67-89",
+ * "+7 912 345 6789", "79123456789" и "9123456789" (10 цифр без кода страны).
+ *
+ * @param phone Номер в том виде, как его ввели.
+ * @param out Буфер на PHONE_E164_LENGTH символов для результата.
+ * @return false, если номер не удалось нормализовать (буквы, другая страна,
+ *         неверное количество цифр); out при этом не определен.
+ */
+bool normalize_phone(std::string_view phone, char *out)
+{
+   char digits[11];
+   size_t count = 0;
+   bool plus = false;
+   for (char c : phone)
+   {
+      const uint8_t cls = PHONE_CHAR_CLASS[static_cast<unsigned char>(c)];
+      if (cls < 10)
+      {
+         if (count == sizeof(digits))
+         {
+            return false;
+         }
+         digits[count++] = c;
+      }
+      else if (cls == PHONE_PLUS)
+      {
+         if (count != 0 || plus)
+         {
+            return false; // '+' допускается только в начале
+         }
+         plus = true;
+      }
+      else if (cls == PHONE_INVALID)
+      {
+         return false;
+      }
+   }
+
+   const char *national = nullptr; // 10 цифр после кода страны
+   if (count == 11 && (digits[0] == '7' || (digits[0] == '8' && !plus)))
+   {
+      national = digits + 1;
+   }
+   else if (count == 10 && !plus)
+   {
+      national = digits;
+   }
+   else
+   {
+      return false;
+   }
+   out[0] = '+';
+   out[1] = '7';
+   std::memcpy(out + 2, national, 10);
+   return true;
+}
+
+// Классы символов адреса почты - битовые флаги, чтобы проверка соседних
+// символов обходилась без ветвлений; EMAIL_UPPER совпадает с битом регистра ASCII
+const uint8_t EMAIL_INVALID = 0x01; // Управляющие, пробел, DEL и разделители "(),:;<>[\]
+const uint8_t EMAIL_DOT = 0x02;
+const uint8_t EMAIL_HYPHEN = 0x04;
+const uint8_t EMAIL_AT = 0x08;
+const uint8_t EMAIL_UPPER = 0x20;   // A-Z (в домене приводятся к строчным)
+
+constexpr std::array<uint8_t, 256> make_email_char_classes()
+{
+   std::array<uint8_t, 256> classes{};
+   for (size_t c = 0; c <= ' '; ++c)
+   {
+      classes[c] = EMAIL_INVALID;
+   }
+   classes[0x7F] = EMAIL_INVALID;
+   for (char c : std::string_view("\"(),:;<>[\\]"))
+   {
+      classes[static_cast<unsigned char>(c)] = EMAIL_INVALID;
+   }
+   for (char c = 'A'; c <= 'Z'; ++c)
+   {
+      classes[static_cast<unsigned char>(c)] = EMAIL_UPPER;
+   }
+   classes['.'] = EMAIL_DOT;
+   classes['-'] = EMAIL_HYPHEN;
+   classes['@'] = EMAIL_AT;
+   return classes;
+}
+
+const std::array<uint8_t, 256> EMAIL_CHAR_CLASS = make_email_char_classes();
+
+/**
+ * @brief Результат приведения адреса почты (см. canonicalize_email).
+ */
+enum class EmailShape : uint8_t
+{
+   Empty,   // Поле пустое или из одних пробелов
+   Valid,   // Адрес правдоподобного вида, домен в нижнем регистре
+   Invalid, // Адрес неверного вида: без пробелов по краям, в остальном как есть
+};
+
+/**
+ * @brief Приводит адрес почты к единому виду и проверяет его форму.
+ *
+ * Один проход по полю с классификацией байтов по таблице, без выделения
+ * памяти: обрезаются пробелы и табуляции по краям, домен (после '@')
+ * приводится к нижнему регистру ASCII, имя до '@' не меняется
+ * ("  Ivanov@Gmail.COM" -> "Ivanov@gmail.com").
+ *
+ * Проверка формы - не полный RFC 5322, а отсев типичных ошибок выгрузки:
+ * ровно один '@', непустое имя до 64 байтов без '.' по краям и "..", домен
+ * из непустых частей через точку (хотя бы две части, без '-' по краям
+ * части), без пробелов, запятых, кавычек и скобок. Байты не ASCII
+ * допускаются (кириллические домены). Поэтому адрес вида Valid не требует
+ * кавычек в CSV.
+ *
+ * @param email Поле в том виде, как его ввели.
+ * @param out Буфер на email.size() символов для результата.
+ * @param size Выходной параметр: длина результата в out.
+ * @return Вид адреса; для Invalid в out - поле без пробелов по краям.
+ */
+EmailShape canonicalize_email(std::string_view email, char *out, size_t &size)
+{
+   size_t begin = 0;
+   size_t end = email.size();
+   while (begin < end && (email[begin] == ' ' || email[begin] == '\t'))
+   {
+      ++begin;
+   }
+   while (end > begin && (email[end - 1] == ' ' || email[end - 1] == '\t'))
+   {
+      --end;
+   }
+   size = end - begin;
+   if (size == 0)
+   {
+      return EmailShape::Empty;
+   }
+   const char *const text = email.data() + begin;
+   const char *const at_sign = static_cast<const char *>(std::memchr(text, '@', size));
+   if (at_sign == nullptr || at_sign - text > 64 || size > 254)
+   {
+      std::memcpy(out, text, size);
+      return EmailShape::Invalid;
+   }
+   const size_t at = static_cast<size_t>(at_sign - text);
+
+   // Имя копируется как есть; начало имени и домена считается следующим за
+   // точкой, поэтому пустое имя, пустая часть домена и ".." дают один и тот же флаг
+   unsigned invalid = 0;
+   unsigned prev = EMAIL_DOT;
+   for (size_t i = 0; i < at; ++i)
+   {
+      const unsigned cls = EMAIL_CHAR_CLASS[static_cast<unsigned char>(text[i])];
+      invalid |= (cls & EMAIL_INVALID) | (cls & prev & EMAIL_DOT);
+      out[i] = text[i];
+      prev = cls;
+   }
+   invalid |= prev & EMAIL_DOT; // '.' в конце имени или пустое имя
+   out[at] = '@';
+
+   unsigned dots = 0;
+   prev = EMAIL_DOT;
+   for (size_t i = at + 1; i < size; ++i)
+   {
+      const unsigned cls = EMAIL_CHAR_CLASS[static_cast<unsigned char>(text[i])];
+      invalid |= cls & (EMAIL_INVALID | EMAIL_AT);              // Второй '@'
+      invalid |= (cls | cls >> 1) & prev & EMAIL_DOT;          // ".", "-" после точки (или '@')
+      invalid |= cls & prev >> 1 & EMAIL_DOT;                  // "-."
+      dots |= cls & EMAIL_DOT;
+      out[i] = static_cast<char>(text[i] | (cls & EMAIL_UPPER));
+      prev = cls;
+   }
+   invalid |= (prev & (EMAIL_DOT | EMAIL_HYPHEN)) | (dots ^ EMAIL_DOT); // Конец домена и хотя бы одна точка
+   if (invalid != 0)
+   {
+      std::memcpy(out, text, size);
+      return EmailShape::Invalid;
+   }
+   return EmailShape::Valid;
+}
+
+/**
+ * @brief Домен адреса почты (после последнего '@'); пусто, если '@' нет.
+ */
+std::string_view email_domain(std::string_view email)
+{
+   const size_t at = email.rfind('@');
+   return at == std::string_view::npos ? std::string_view() : email.substr(at + 1);
+}
+
+// Таблица регистра покрывает коды до U+0500 (латиница, Latin-1, кириллица).
+// Все они кодируются в UTF-8 одним или двумя байтами, поэтому смена регистра
+// не меняет длину строки и выполняется на месте
+const size_t NAME_CASE_RANGE = 0x500;
+
+/**
+ * @brief Заглавные и строчные пары букв и признак буквы для кодов до NAME_CASE_RANGE.
+ */
+struct NameCaseTable
+{
+   std::array<uint16_t, NAME_CASE_RANGE> upper{};
+   std::array<uint16_t, NAME_CASE_RANGE> lower{};
+   std::array<bool, NAME_CASE_RANGE> letter{};
+
+   constexpr void add_pair(uint16_t capital, uint16_t small)
+   {
+      upper[capital] = upper[small] = capital;
+      lower[capital] = lower[small] = small;
+      letter[capital] = letter[small] = true;
+   }
+};
+
+constexpr NameCaseTable make_name_case_table()
+{
+   NameCaseTable table{};
+   for (uint16_t cp = 0; cp < NAME_CASE_RANGE; ++cp)
+   {
+      table.upper[cp] = table.lower[cp] = cp;
+   }
+   for (uint16_t cp = 'A'; cp <= 'Z'; ++cp)
+   {
+      table.add_pair(cp, static_cast<uint16_t>(cp + 0x20));
+   }
+   for (uint16_t cp = 0xC0; cp <= 0xDE; ++cp) // À-Þ, кроме знака умножения
+   {
+      if (cp != 0xD7)
+      {
+         table.add_pair(cp, static_cast<uint16_t>(cp + 0x20));
+      }
+   }
+   table.letter[0xDF] = table.letter[0xFF] = true; // ß и ÿ без пары в таблице
+   for (uint16_t cp = 0x400; cp <= 0x40F; ++cp) // Ѐ-Џ (Ё, Є, І, Ї, Ў ...)
+   {
+      table.add_pair(cp, static_cast<uint16_t>(cp + 0x50));
+   }
+   for (uint16_t cp = 0x410; cp <= 0x42F; ++cp) // А-Я
+   {
+      table.add_pair(cp, static_cast<uint16_t>(cp + 0x20));
+   }
+   table.add_pair(0x490, 0x491); // Ґ
+   return table;
+}
+
+const NameCaseTable NAME_CASE = make_name_case_table();
+
+/**
+ * @brief Приводит имя к виду "Пономарев", "Петров-Водкин", "Анна Мария" на месте.
+ *
+ * Первая буква каждой части (после пробела, дефиса и любого другого не
+ * буквенного символа) становится заглавной, остальные - строчными. Регистр
+ * определяется по таблице NAME_CASE, без локали и towupper; символы вне
+ * таблицы (и неверные последовательности UTF-8) не меняются.
+ *
+ * @param data Буфер с полем в UTF-8.
+ * @param size Длина поля в байтах.
+ */
+void title_case_name(char *data, size_t size)
+{
+   bool word_start = true;
+   size_t i = 0;
+   while (i < size)
+   {
+      const unsigned char lead = static_cast<unsigned char>(data[i]);
+      if (lead < 0x80)
+      {
+         data[i] = static_cast<char>(word_start ? NAME_CASE.upper[lead] : NAME_CASE.lower[lead]);
+         word_start = !NAME_CASE.letter[lead];
+         ++i;
+         continue;
+      }
+      if ((lead & 0xE0) == 0xC0 && i + 1 < size && (static_cast<unsigned char>(data[i + 1]) & 0xC0) == 0x80)
+      {
+         const uint16_t cp = static_cast<uint16_t>(((lead & 0x1F) << 6) | (static_cast<unsigned char>(data[i + 1]) & 0x3F));
+         if (cp < NAME_CASE_RANGE)
+         {
+            const uint16_t cased = word_start ? NAME_CASE.upper[cp] : NAME_CASE.lower[cp];
+            data[i] = static_cast<char>(0xC0 | (cased >> 6));
+            data[i + 1] = static_cast<char>(0x80 | (cased & 0x3F));
+            word_start = !NAME_CASE.letter[cp];
+         }
+         else
+         {
+            word_start = false;
+         }
+         i += 2;
+         continue;
+      }
+      // Прочие символы (иероглифы, эмодзи) - часть слова, регистр не меняется
+      word_start = false;
+      ++i;
+      while (i < size && (static_cast<unsigned char>(data[i]) & 0xC0) == 0x80)
+      {
+         ++i;
+      }
+   }
+}
+
+/**
+ * @brief Арена байтов: выделение сдвигом указателя, освобождение всего сразу.
+ *
+ * Память берется блоками не меньше block_size и не возвращается до
+ * уничтожения арены: reset() только переводит указатель в начало. Если
+ * между сбросами понадобилось несколько блоков, при сбросе они заменяются
+ * одним блоком суммарного размера, поэтому после первых сбросов арена
+ * работает без обращений к malloc. Не потокобезопасна: у каждого потока своя.
+ */
+class Arena
+{
+public:
+   static constexpr size_t DEFAULT_BLOCK_SIZE = 64 << 10; // 64 КиБ
+
+   explicit Arena(size_t block_size = DEFAULT_BLOCK_SIZE) : block_size_(std::max<size_t>(block_size, 64)) {}
+
+   Arena(const Arena &) = delete;
+   Arena &operator=(const Arena &) = delete;
+
+   /**
+    * @brief Выделяет size байтов (без выравнивания - только для текста).
+    */
+   char *allocate(size_t size)
+   {
+      if (size > static_cast<size_t>(end_ - cursor_))
+      {
+         add_block(size);
+      }
+      char *result = cursor_;
+      cursor_ += size;
+      return result;
+   }
+
+   /**
+    * @brief Копирует text в арену и возвращает изменяемую копию.
+    */
+   char *duplicate(std::string_view text)
+   {
+      char *data = allocate(text.size());
+      if (!text.empty())
+      {
+         std::memcpy(data, text.data(), text.size());
+      }
+      return data;
+   }
+
+   /**
+    * @brief Копирует text в арену.
+    */
+   std::string_view copy(std::string_view text) { return std::string_view(duplicate(text), text.size()); }
+
+   /**
+    * @brief Освобождает все выделенное (представления в арену становятся недействительными).
+    */
+   void reset()
+   {
+      if (blocks_.size() > 1)
+      {
+         const size_t total = capacity_;
+         blocks_.clear();
+         capacity_ = 0;
+         add_block(total);
+      }
+      if (!blocks_.empty())
+      {
+         cursor_ = blocks_.front().get();
+      }
+   }
+
+   /**
+    * @brief Сколько памяти занимают блоки арены.
+    */
+   size_t capacity() const { return capacity_; }
+
+private:
+   void add_block(size_t size)
+   {
+      const size_t block = std::max(block_size_, size);
+      blocks_.emplace_back(new char[block]); // Без обнуления
+      cursor_ = blocks_.back().get();
+      end_ = cursor_ + block;
+      capacity_ += block;
+   }
+
+   size_t block_size_;
+   std::vector<std::unique_ptr<char[]>> blocks_;
+   char *cursor_ = nullptr; // Начало свободной части текущего блока
+   char *end_ = nullptr;
+   size_t capacity_ = 0;
+};
+
+/**
+ * @brief Переиспользуемые буферы для обработки строк данных.
+ *
+ * Каждый поток обработки владеет своим экземпляром. Буферы очищаются, но не
+ * освобождаются между строками, поэтому после первых строк (когда емкость
+ * достигла максимальной длины строки) обработка строки не выделяет память.
+ * Настоящие данные хранятся только для синтезированных значений, например
+ * "Группа Фамилия" (в арене потока); остальные поля - представления во входной буфер.
+ */
+struct RowScratch
+{
+   std::vector<std::string_view> input_fields; // Поля текущей входной строки
+   std::string field_scratch;                  // Распакованные поля с экранированными кавычками
+   Arena arena;                                // Синтезированные поля; сбрасывается перед каждой строкой
+};
+
+
+// --- Схема входного и выходного файлов ---
+
+// Заголовок для выходного файла (формат Google Contacts)
+const std::string_view OUTPUT_HEADER = "First Name,Middle Name,Last Name,Phonetic First Name,Phonetic Middle Name,Phonetic Last Name,Name Prefix,Name Suffix,Nickname,File As,Organization Name,Organization Title,Organization Department,Birthday,Notes,Photo,Labels,E-mail 1 - Label,E-mail 1 - Value,E-mail 2 - Label,E-mail 2 - Value,Phone 1 - Label,Phone 1 - Value";
+const int NUM_OUTPUT_COLUMNS = 23; // Количество столбцов в заголовке Google Contacts
+
+// Индексы нужных столбцов во ВХОДНОМ файле (0-based)
+const int INPUT_IDX_ROLE = 1;             // Должность (не используется для вывода)
+const int INPUT_IDX_FIRSTNAME = 2;        // Имя
+const int INPUT_IDX_GROUPLASTNAME = 3;    // Группа + Фамилия
+const int INPUT_IDX_EMAILLOGIN = 4;       // Email 1 (ЛК)
+const int INPUT_IDX_EMAILCREATED = 5;     // Email 2 (Созданный)
+const int INPUT_IDX_PHONE = 6;            // Телефон
+const int INPUT_NUM_COLUMNS_EXPECTED = 7; // Минимальное ожидаемое кол-во столбцов во входном файле
+                                          // (для встроенной схемы - старший номер столбца + 1)
+
+
+/**
+ * @brief Запись строки с фиксированным набором заполненных столбцов.
+ *
+ * Номера заполняемых столбцов известны на этапе компиляции, поэтому серии
+ * пустых столбцов между ними (например, ",,,,,,,,,,,,,," между Last Name и
+ * Labels) записываются готовыми литералами, а экранирование выполняется
+ * только для заполняемых полей, и то не для отмеченных в verbatim.
+ *
+ * @tparam ColumnCount Количество столбцов строки.
+ * @tparam Slots Номера заполняемых столбцов по возрастанию.
+ */
+template <size_t ColumnCount, size_t... Slots>
+struct SparseRowEmitter
+{
+   static constexpr size_t SLOT_COUNT = sizeof...(Slots);
+   static constexpr std::array<size_t, SLOT_COUNT> slots{{Slots...}};
+
+   /**
+    * @param fields Поля строки.
+    * @param verbatim Столбцы (биты по номерам), заведомо не требующие кавычек.
+    * @param out Писатель для строки.
+    */
+   static void emit(const std::array<std::string_view, ColumnCount> &fields, uint32_t verbatim, CsvWriter &out)
+   {
+      emit_slots(fields, verbatim, out, std::make_index_sequence<SLOT_COUNT>{});
+      // Запятые после последнего заполняемого столбца
+      constexpr size_t trailing = ColumnCount - 1 - slots[SLOT_COUNT - 1];
+      if constexpr (trailing > 0)
+      {
+         out.write_raw(std::string_view(COMMAS, trailing));
+      }
+      out.end_row();
+   }
+
+private:
+   static_assert(SLOT_COUNT > 0, "Нужен хотя бы один заполняемый столбец");
+   static_assert(ColumnCount <= 32, "Литерал COMMAS рассчитан на строки до 32 столбцов");
+
+   static constexpr const char *COMMAS = ",,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,";
+
+   template <size_t... I>
+   static void emit_slots(const std::array<std::string_view, ColumnCount> &fields, uint32_t verbatim, CsvWriter &out, std::index_sequence<I...>)
+   {
+      (emit_slot<I>(fields, verbatim, out), ...);
+   }
+
+   template <size_t I>
+   static void emit_slot(const std::array<std::string_view, ColumnCount> &fields, uint32_t verbatim, CsvWriter &out)
+   {
+      // Количество запятых перед заполняемым столбцом - константа компиляции
+      constexpr size_t gap = I == 0 ? slots[0] : slots[I] - slots[I - 1];
+      if constexpr (gap > 0)
+      {
+         out.write_raw(std::string_view(COMMAS, gap));
+      }
+      if ((verbatim >> slots[I] & 1) != 0)
+      {
+         out.write_raw(fields[slots[I]]);
+      }
+      else
+      {
+         out.write_field(fields[slots[I]]);
+      }
+   }
+};
+
+/**
+ * @brief Запись строки встроенной схемы: First Name, Last Name, Labels,
+ * E-mail 1 - Value, E-mail 2 - Value и Phone 1 - Value.
+ */
+using BuiltinRowEmitter = SparseRowEmitter<NUM_OUTPUT_COLUMNS, 0, 2, 16, 18, 20, 22>;
+
+
+// --- Сопоставление столбцов ---
+
+/**
+ * @brief Преобразование, применяемое к полю при копировании.
+ */
+enum class FieldTransform : uint8_t
+{
+   Copy,          // Поле как есть
+   GroupLastName, // "Группа Фамилия" из поля вида "ПМ-35   ПОНОМАРЕВ"
+   Group,         // Только группа
+   LastName,      // Только фамилия
+   Label,         // Значение метки (источник не нужен)
+   Phone,         // Телефон в виде +7XXXXXXXXXX (см. normalize_phone)
+   Name,          // Имя с большой буквы (см. title_case_name)
+   Email,         // Адрес почты в едином виде (см. canonicalize_email)
+};
+
+/**
+ * @brief Правило сопоставления: откуда и как заполняется столбец вывода.
+ *
+ * Источник задается номером столбца ввода или именем из заголовка входного
+ * файла; имя разрешается в номер при компиляции плана, когда заголовок прочитан.
+ */
+struct MappingRule
+{
+   int output_index = 0;                             // Номер столбца Google Contacts
+   FieldTransform transform = FieldTransform::Copy;
+   int source_index = -1;                            // Номер столбца ввода (-1 - по имени или не нужен)
+   std::string source_name;                          // Имя столбца в заголовке входного файла
+   std::string auto_keyword;                         // Ключевое слово для --auto-columns
+};
+
+/**
+ * @brief Набор правил сопоставления (из файла --mapping или встроенный).
+ */
+struct MappingSpec
+{
+   std::vector<MappingRule> rules;
+};
+
+const int MAX_INPUT_COLUMNS = 1 << 16; // Номера столбцов в плане хранятся в uint16_t
+
+/**
+ * @brief Операция копирования поля без преобразования.
+ */
+struct FieldCopy
+{
+   uint16_t source;
+   uint16_t output;
+};
+
+/**
+ * @brief Операция копирования с преобразованием.
+ */
+struct CopyOp
+{
+   uint16_t source;
+   uint16_t output;
+   FieldTransform transform;
+};
+
+/**
+ * @brief Скомпилированный план заполнения строки вывода.
+ *
+ * Плоские массивы операций, которые выполняются для каждой строки без
+ * поиска столбцов по именам: простые копирования идут отдельным массивом
+ * и выполняются циклом без ветвлений, операции с преобразованием - вторым.
+ */
+struct CopyPlan
+{
+   std::vector<FieldCopy> copies;
+   std::vector<CopyOp> transforms;
+   size_t min_input_columns = 0; // Строки с меньшим числом столбцов пропускаются
+   bool builtin_layout = false;  // Заполняются ровно столбцы BuiltinRowEmitter
+};
+
+/**
+ * @brief Встроенное сопоставление для выгрузки Google Forms (см. описание файла).
+ */
+MappingSpec default_mapping_spec()
+{
+   MappingSpec spec;
+   // 0: First Name (Имя)
+   spec.rules.push_back({0, FieldTransform::Copy, INPUT_IDX_FIRSTNAME, "", "Имя"});
+   // 1: Middle Name - остается пустым
+   // 2: Last Name (Фамилия) - формируем как "Группа Фамилия"
+   spec.rules.push_back({2, FieldTransform::GroupLastName, INPUT_IDX_GROUPLASTNAME, "", "Групп"});
+   // 3-9: Пусто (Phonetics, Prefix, Suffix, Nickname, File As)
+   // 10: Organization Name <- НЕ ЗАПОЛНЯЕТСЯ (было бы Group из INPUT_IDX_GROUPLASTNAME)
+   // 11: Organization Title <- НЕ ЗАПОЛНЯЕТСЯ (было бы INPUT_IDX_ROLE)
+   // 12-15: Пусто (Department, Birthday, Notes, Photo)
+   // 16: Labels (Метки) - значение, введенное пользователем
+   spec.rules.push_back({16, FieldTransform::Label, -1, "", ""});
+   // 17: E-mail 1 - Label <- НЕ ЗАПОЛНЯЕТСЯ
+   // 18: E-mail 1 - Value (Созданный Email)
+   spec.rules.push_back({18, FieldTransform::Copy, INPUT_IDX_EMAILCREATED, "", "Почта 2"});
+   // 19: E-mail 2 - Label <- НЕ ЗАПОЛНЯЕТСЯ
+   // 20: E-mail 2 - Value (Email ЛК)
+   spec.rules.push_back({20, FieldTransform::Copy, INPUT_IDX_EMAILLOGIN, "", "Почта 1"});
+   // 21: Phone 1 - Label <- НЕ ЗАПОЛНЯЕТСЯ
+   // 22: Phone 1 - Value (Телефон)
+   spec.rules.push_back({22, FieldTransform::Copy, INPUT_IDX_PHONE, "", "елефон"});
+   return spec;
+}
+
+/**
+ * @brief Убирает пробелы (и UTF-8 BOM) по краям имени столбца.
+ */
+std::string_view trim_column_name(std::string_view name)
+{
+   if (name.size() >= 3 && name.compare(0, 3, "\xEF\xBB\xBF") == 0)
+   {
+      name.remove_prefix(3);
+   }
+   while (!name.empty() && (name.front() == ' ' || name.front() == '\t'))
+   {
+      name.remove_prefix(1);
+   }
+   while (!name.empty() && (name.back() == ' ' || name.back() == '\t' || name.back() == '\r'))
+   {
+      name.remove_suffix(1);
+   }
+   return name;
+}
+
+/**
+ * @brief Находит номер столбца Google Contacts по имени из OUTPUT_HEADER.
+ * @return Номер столбца или -1.
+ */
+int output_column_index(std::string_view name)
+{
+   std::string_view header = OUTPUT_HEADER;
+   for (int index = 0; !header.empty(); ++index)
+   {
+      const size_t comma = header.find(',');
+      if (header.substr(0, comma) == name)
+      {
+         return index;
+      }
+      if (comma == std::string_view::npos)
+      {
+         break;
+      }
+      header.remove_prefix(comma + 1);
+   }
+   return -1;
+}
+
+/**
+ * @brief Разбирает неотрицательное целое число.
+ */
+bool parse_index(std::string_view text, int &value)
+{
+   if (text.empty() || text.size() > 6)
+   {
+      return false;
+   }
+   value = 0;
+   for (char c : text)
+   {
+      if (c < '0' || c > '9')
+      {
+         return false;
+      }
+      value = value * 10 + (c - '0');
+   }
+   return true;
+}
+
+/**
+ * @brief Загружает правила сопоставления из файла --mapping.
+ *
+ * Формат - по одному правилу в строке, '#' начинает комментарий:
+ *   <столбец Google Contacts> = <источник>
+ *   <столбец Google Contacts> = <преобразование>(<источник>)
+ *   <столбец Google Contacts> = label
+ * Источник - номер столбца ввода (с 0) или имя столбца из заголовка входного
+ * файла (можно в кавычках). Преобразования: copy, group_lastname, group, lastname, phone.
+ * Столбец вывода задается именем из заголовка Google Contacts или номером.
+ */
+bool load_mapping_file(const std::string &path, MappingSpec &spec)
+{
+   MappedFile file;
+   if (!file.open(path))
+   {
+      std::cerr << "Ошибка: Не удалось открыть файл сопоставления столбцов: " << path << std::endl;
+      return false;
+   }
+   const char *cursor = file.data();
+   const char *const end = cursor + file.size();
+   std::string_view line;
+   int line_number = 0;
+   spec.rules.clear();
+   while (cursor < end)
+   {
+      const char *newline = static_cast<const char *>(std::memchr(cursor, '\n', end - cursor));
+      line = std::string_view(cursor, (newline != nullptr ? newline : end) - cursor);
+      cursor = newline != nullptr ? newline + 1 : end;
+      ++line_number;
+
+      const size_t comment = line.find('#');
+      line = trim_column_name(line.substr(0, comment));
+      if (line.empty())
+      {
+         continue;
+      }
+      auto fail = [&](const char *reason)
+      {
+         std::cerr << "Ошибка: " << path << ", строка " << line_number << ": " << reason << ": " << line << std::endl;
+         return false;
+      };
+
+      const size_t equals = line.find('=');
+      if (equals == std::string_view::npos)
+      {
+         return fail("ожидалось \"столбец = источник\"");
+      }
+      const std::string_view output_name = trim_column_name(line.substr(0, equals));
+      std::string_view source = trim_column_name(line.substr(equals + 1));
+
+      MappingRule rule;
+      if (!parse_index(output_name, rule.output_index))
+      {
+         rule.output_index = output_column_index(output_name);
+      }
+      if (rule.output_index < 0 || rule.output_index >= NUM_OUTPUT_COLUMNS)
+      {
+         return fail("неизвестный столбец Google Contacts");
+      }
+
+      if (source == "label")
+      {
+         rule.transform = FieldTransform::Label;
+         spec.rules.push_back(rule);
+         continue;
+      }
+      const size_t open_paren = source.find('(');
+      if (open_paren != std::string_view::npos && source.back() == ')')
+      {
+         const std::string_view name = trim_column_name(source.substr(0, open_paren));
+         if (name == "copy")
+         {
+            rule.transform = FieldTransform::Copy;
+         }
+         else if (name == "group_lastname")
+         {
+            rule.transform = FieldTransform::GroupLastName;
+         }
+         else if (name == "group")
+         {
+            rule.transform = FieldTransform::Group;
+         }
+         else if (name == "lastname")
+         {
+            rule.transform = FieldTransform::LastName;
+         }
+         else if (name == "phone")
+         {
+            rule.transform = FieldTransform::Phone;
+         }
+         else if (name == "name")
+         {
+            rule.transform = FieldTransform::Name;
+         }
+         else if (name == "email")
+         {
+            rule.transform = FieldTransform::Email;
+         }
+         else
+         {
+            return fail("неизвестное преобразование");
+         }
+         source = trim_column_name(source.substr(open_paren + 1, source.size() - open_paren - 2));
+      }
+      if (source.size() >= 2 && source.front() == '"' && source.back() == '"')
+      {
+         rule.source_name = std::string(source.substr(1, source.size() - 2));
+      }
+      else if (!parse_index(source, rule.source_index))
+      {
+         rule.source_name = std::string(source);
+      }
+      else if (rule.source_index >= MAX_INPUT_COLUMNS)
+      {
+         return fail("номер столбца ввода больше 65535");
+      }
+      if (rule.source_index < 0 && rule.source_name.empty())
+      {
+         return fail("не указан источник");
+      }
+      spec.rules.push_back(rule);
+   }
+   return true;
+}
+
+/**
+ * @brief Компилирует правила в план копирования для конкретного входного файла.
+ *
+ * Имена источников ищутся в заголовке входного файла. С auto_columns
+ * источники правил с ключевым словом определяются по заголовку (первый
+ * столбец, имя которого содержит ключевое слово); если столбец не найден,
+ * остается номер по умолчанию.
+ *
+ * @param spec Правила сопоставления.
+ * @param auto_columns Определять столбцы по заголовку.
+ * @param header Поля заголовка входного файла.
+ * @param plan Выходной план.
+ * @param diag Поток для предупреждений и ошибок.
+ * @return false, если столбец-источник не найден в заголовке.
+ */
+bool compile_copy_plan(const MappingSpec &spec, bool auto_columns, const std::vector<std::string_view> &header, CopyPlan &plan, std::ostream &diag)
+{
+   plan = CopyPlan();
+   for (const MappingRule &rule : spec.rules)
+   {
+      int source = rule.source_index;
+      if (!rule.source_name.empty())
+      {
+         const auto it = std::find_if(header.begin(), header.end(),
+            [&](std::string_view name) { return trim_column_name(name) == rule.source_name; });
+         if (it == header.end())
+         {
+            diag << "Ошибка: Столбец \"" << rule.source_name << "\" не найден в заголовке входного файла." << std::endl;
+            return false;
+         }
+         source = static_cast<int>(it - header.begin());
+      }
+      else if (auto_columns && !rule.auto_keyword.empty())
+      {
+         const auto it = std::find_if(header.begin(), header.end(),
+            [&](std::string_view name) { return name.find(rule.auto_keyword) != std::string_view::npos; });
+         if (it != header.end())
+         {
+            source = static_cast<int>(it - header.begin());
+         }
+         else
+         {
+            diag << "Предупреждение: Столбец со словом \"" << rule.auto_keyword << "\" не найден в заголовке, используется столбец #" << source << "." << std::endl;
+         }
+      }
+
+      if (rule.transform == FieldTransform::Label)
+      {
+         plan.transforms.push_back({0, static_cast<uint16_t>(rule.output_index), rule.transform});
+         continue;
+      }
+      if (source >= MAX_INPUT_COLUMNS)
+      {
+         diag << "Ошибка: Столбец ввода #" << source << " за пределами поддерживаемых " << MAX_INPUT_COLUMNS << " столбцов." << std::endl;
+         return false;
+      }
+      plan.min_input_columns = std::max(plan.min_input_columns, static_cast<size_t>(source) + 1);
+      if (rule.transform == FieldTransform::Copy)
+      {
+         plan.copies.push_back({static_cast<uint16_t>(source), static_cast<uint16_t>(rule.output_index)});
+      }
+      else
+      {
+         plan.transforms.push_back({static_cast<uint16_t>(source), static_cast<uint16_t>(rule.output_index), rule.transform});
+      }
+   }
+
+   // Если заполняются ровно столбцы встроенной схемы, строку пишет специализированный BuiltinRowEmitter
+   std::vector<size_t> outputs;
+   for (const FieldCopy &copy : plan.copies)
+   {
+      outputs.push_back(copy.output);
+   }
+   for (const CopyOp &op : plan.transforms)
+   {
+      outputs.push_back(op.output);
+   }
+   std::sort(outputs.begin(), outputs.end());
+   plan.builtin_layout = std::equal(outputs.begin(), outputs.end(), BuiltinRowEmitter::slots.begin(), BuiltinRowEmitter::slots.end());
+   return true;
+}
+
+
+// --- Удаление повторов ---
+
+/**
+ * @brief Поле, по которому строки считаются повторами (--dedup).
+ */
+enum class DedupKey : uint8_t
+{
+   None,  // Повторы не удаляются
+   Email, // Созданная почта (E-mail 1 - Value)
+   Login, // Почта ЛК (E-mail 2 - Value)
+   Phone, // Телефон (Phone 1 - Value)
+};
+
+/**
+ * @brief Какую из повторных строк оставлять (--dedup-keep).
+ */
+enum class DedupKeep : uint8_t
+{
+   First,  // Первую в файле
+   Latest, // Самую позднюю по отметке времени (столбец 0)
+};
+
+/**
+ * @brief Передает в add байты нормализованного ключа.
+ *
+ * Почта: без пробельных символов, латиница в нижнем регистре. Телефон:
+ * цифры номера, приведенного normalize_phone ("8 912 ...", "+7 912 ..." и
+ * "912 ..." совпадают), а номер, который привести не удалось, - просто его
+ * цифры. Нормализация выполняется по ходу обхода поля, без копирования строки.
+ */
+template <typename Sink>
+void for_each_key_byte(std::string_view field, DedupKey key, Sink &&add)
+{
+   if (key == DedupKey::Phone)
+   {
+      char normalized[PHONE_E164_LENGTH];
+      if (normalize_phone(field, normalized))
+      {
+         for (size_t i = 1; i < PHONE_E164_LENGTH; ++i) // Без '+'
+         {
+            add(normalized[i]);
+         }
+         return;
+      }
+      for (char c : field)
+      {
+         if (c >= '0' && c <= '9')
+         {
+            add(c);
+         }
+      }
+      return;
+   }
+   for (char c : field)
+   {
+      if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+      {
+         continue;
+      }
+      add(c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c);
+   }
+}
+
+/**
+ * @brief 64-битный хеш FNV-1a.
+ */
+uint64_t hash_bytes(std::string_view bytes)
+{
+   uint64_t hash = 14695981039346656037ull;
+   for (char c : bytes)
+   {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+   }
+   return hash;
+}
+
+/**
+ * @brief Финальное перемешивание хеша: и старшие, и младшие биты зависят от всего ключа.
+ */
+inline uint64_t mix_hash(uint64_t hash)
+{
+   hash ^= hash >> 33;
+   hash *= 0xff51afd7ed558ccdull;
+   hash ^= hash >> 33;
+   hash *= 0xc4ceb9fe1a85ec53ull;
+   hash ^= hash >> 33;
+   return hash;
+}
+
+/**
+ * @brief Вычисляет 64-битный отпечаток нормализованного ключа (FNV-1a, см. for_each_key_byte).
+ *
+ * @return Отпечаток или 0, если после нормализации ключ пуст (такие строки
+ *         повторами не считаются).
+ */
+uint64_t dedup_fingerprint(std::string_view field, DedupKey key)
+{
+   uint64_t hash = 14695981039346656037ull;
+   size_t length = 0;
+   for_each_key_byte(field, key, [&](char c)
+   {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+      ++length;
+   });
+   if (length == 0)
+   {
+      return 0;
+   }
+   hash = mix_hash(hash);
+   return hash == 0 ? 1 : hash;
+}
+
+/**
+ * @brief Разбирает отметку времени Google Forms в число вида ГГГГММДДччммсс.
+ *
+ * Понимает "ДД.ММ.ГГГГ чч:мм:сс" и "ГГГГ-ММ-ДД чч:мм:сс" (также с '/'),
+ * время необязательно; суффиксы AM/PM учитываются.
+ *
+ * @return Значение для сравнения или -1, если отметку разобрать не удалось.
+ */
+int64_t parse_timestamp(std::string_view text)
+{
+   int64_t parts[6] = {};
+   size_t widths[6] = {};
+   size_t count = 0;
+   for (size_t i = 0; i < text.size() && count < 6;)
+   {
+      if (text[i] < '0' || text[i] > '9')
+      {
+         ++i;
+         continue;
+      }
+      for (; i < text.size() && text[i] >= '0' && text[i] <= '9'; ++i)
+      {
+         if (++widths[count] > 4)
+         {
+            return -1;
+         }
+         parts[count] = parts[count] * 10 + (text[i] - '0');
+      }
+      ++count;
+   }
+   if (count < 3)
+   {
+      return -1;
+   }
+
+   const bool year_first = widths[0] == 4;
+   const int64_t year = year_first ? parts[0] : parts[2];
+   const int64_t month = parts[1];
+   const int64_t day = year_first ? parts[2] : parts[0];
+   int64_t hour = parts[3];
+   if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || parts[4] > 59 || parts[5] > 60)
+   {
+      return -1;
+   }
+   if (text.find("PM") != std::string_view::npos && hour < 12)
+   {
+      hour += 12;
+   }
+   else if (text.find("AM") != std::string_view::npos && hour == 12)
+   {
+      hour = 0;
+   }
+   return ((((year * 100 + month) * 100 + day) * 100 + hour) * 100 + parts[4]) * 100 + parts[5];
+}
+
+/**
+ * @brief Индекс ключей для удаления повторов: для каждого отпечатка - строка, которая остается.
+ *
+ * Хеш-таблица с открытой адресацией (линейное пробирование) хранит записи
+ * фиксированного размера - отпечаток, отметку времени и номер строки, без
+ * самих строк и отдельных выделений памяти на ключ. Таблица разбита на
+ * шарды по старшим битам отпечатка, у каждого своя блокировка, поэтому
+ * участки файла можно индексировать параллельно. Результат не зависит от
+ * порядка вставки: при DedupKeep::First остается строка с меньшим номером,
+ * при DedupKeep::Latest - с большей отметкой времени (при равных - с
+ * большим номером). Совпадение 64-битных отпечатков разных ключей считается
+ * невозможным.
+ */
+class DedupIndex
+{
+public:
+   explicit DedupIndex(DedupKeep keep) : keep_(keep) {}
+
+   DedupKeep keep() const { return keep_; }
+
+   /**
+    * @brief Учитывает строку с ключом fingerprint (потокобезопасно).
+    */
+   void insert(uint64_t fingerprint, int64_t timestamp, int line_number)
+   {
+      Shard &shard = shards_[fingerprint >> (64 - SHARD_BITS)];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      // Заполнение не больше 3/4, иначе цепочки пробирования становятся длинными
+      if ((shard.size + 1) * 4 > shard.entries.size() * 3)
+      {
+         grow(shard);
+      }
+      Entry &entry = shard.entries[probe(shard.entries, fingerprint)];
+      if (entry.fingerprint == 0)
+      {
+         entry = {fingerprint, timestamp, line_number};
+         ++shard.size;
+      }
+      else if (keep_ == DedupKeep::First ? line_number < entry.line_number
+                                         : timestamp > entry.timestamp || (timestamp == entry.timestamp && line_number > entry.line_number))
+      {
+         entry.timestamp = timestamp;
+         entry.line_number = line_number;
+      }
+   }
+
+   /**
+    * @brief Номер строки, которая остается для ключа fingerprint.
+    *
+    * Вызывается после завершения всех insert (без блокировки).
+    *
+    * @return Номер строки или 0, если ключ не встречался.
+    */
+   int winner(uint64_t fingerprint) const
+   {
+      const Shard &shard = shards_[fingerprint >> (64 - SHARD_BITS)];
+      return shard.entries.empty() ? 0 : shard.entries[probe(shard.entries, fingerprint)].line_number;
+   }
+
+   /**
+    * @brief Количество различных ключей.
+    */
+   size_t size() const
+   {
+      size_t total = 0;
+      for (const Shard &shard : shards_)
+      {
+         total += shard.size;
+      }
+      return total;
+   }
+
+private:
+   struct Entry
+   {
+      uint64_t fingerprint = 0; // 0 - свободная ячейка
+      int64_t timestamp = 0;
+      int line_number = 0;
+   };
+
+   struct Shard
+   {
+      std::mutex mutex;
+      std::vector<Entry> entries; // Размер - степень двойки
+      size_t size = 0;
+   };
+
+   static constexpr unsigned SHARD_BITS = 6;
+   static constexpr size_t SHARD_COUNT = size_t(1) << SHARD_BITS;
+   static constexpr size_t INITIAL_CAPACITY = 256;
+
+   /**
+    * @brief Ячейка с ключом fingerprint или первая свободная на его цепочке.
+    */
+   static size_t probe(const std::vector<Entry> &entries, uint64_t fingerprint)
+   {
+      const size_t mask = entries.size() - 1;
+      size_t i = static_cast<size_t>(fingerprint) & mask;
+      while (entries[i].fingerprint != 0 && entries[i].fingerprint != fingerprint)
+      {
+         i = (i + 1) & mask;
+      }
+      return i;
+   }
+
+   static void grow(Shard &shard)
+   {
+      std::vector<Entry> entries(std::max(INITIAL_CAPACITY, shard.entries.size() * 2));
+      for (const Entry &entry : shard.entries)
+      {
+         if (entry.fingerprint != 0)
+         {
+            entries[probe(entries, entry.fingerprint)] = entry;
+         }
+      }
+      shard.entries.swap(entries);
+   }
+
+   DedupKeep keep_;
+   std::array<Shard, SHARD_COUNT> shards_;
+};
+
+/**
+ * @brief Номер столбца ввода, из которого берется ключ удаления повторов.
+ *
+ * Ключ - источник соответствующего столбца вывода в плане (с учетом
+ * --mapping и --auto-columns); если столбец не заполняется простым
+ * копированием (или нормализацией почты и телефона), используется номер встроенной схемы.
+ */
+size_t dedup_key_column(const CopyPlan &plan, DedupKey key)
+{
+   int output = 18; // E-mail 1 - Value
+   int fallback = INPUT_IDX_EMAILCREATED;
+   if (key == DedupKey::Login)
+   {
+      output = 20; // E-mail 2 - Value
+      fallback = INPUT_IDX_EMAILLOGIN;
+   }
+   else if (key == DedupKey::Phone)
+   {
+      output = 22; // Phone 1 - Value
+      fallback = INPUT_IDX_PHONE;
+   }
+   for (const FieldCopy &copy : plan.copies)
+   {
+      if (copy.output == output)
+      {
+         return copy.source;
+      }
+   }
+   for (const CopyOp &op : plan.transforms)
+   {
+      if (op.output == output && (op.transform == FieldTransform::Phone || op.transform == FieldTransform::Email))
+      {
+         return op.source;
+      }
+   }
+   return static_cast<size_t>(fallback);
+}
+
+
+// --- Параметры командной строки ---
+
+/**
+ * @brief Поле ключа сортировки вывода (--sort-by).
+ */
+enum class SortField : uint8_t
+{
+   Group,    // Группа из Last Name "Группа Фамилия" (см. splitGroupLastName)
+   LastName, // Фамилия оттуда же
+};
+
+/**
+ * @brief Параметры запуска, полученные из командной строки.
+ */
+struct Options
+{
+   std::string input_filename = "input.csv";   // Имя входного файла по умолчанию
+   std::string output_filename = "output.csv"; // Имя выходного файла по умолчанию
+   bool stream_input = false;                  // Потоковое чтение блоками вместо отображения в память
+   bool pipeline = false;                      // Чтение и запись в отдельных потоках (--pipeline)
+   size_t chunk_size = CsvRecordReader::DEFAULT_CHUNK_SIZE; // Размер блока потокового чтения
+   std::string simd = "auto";                  // Вариант ядра сканирования: auto, avx2, sse2, scalar
+   unsigned threads = 0;                       // Количество потоков (0 - не задано: 1, в пакетном режиме - по числу ядер)
+   std::string batch_manifest;                 // Файл-список заданий пакетного режима
+   std::string batch_glob;                     // Шаблон входных файлов пакетного режима (например, "выгрузки/*.csv")
+   std::string output_dir;                     // Каталог для выходных файлов при --batch-glob
+   std::string mapping_file;                   // Файл сопоставления столбцов (--mapping)
+   bool auto_columns = false;                  // Определять столбцы по заголовку входного файла
+   std::shared_ptr<const MappingSpec> mapping; // Загруженные правила сопоставления
+   std::string label;                          // Значение поля Labels из --label
+   bool label_given = false;                   // Метка задана в командной строке (не запрашивать)
+   DedupKey dedup_key = DedupKey::None;        // Поле для удаления повторов (--dedup)
+   DedupKeep dedup_keep = DedupKeep::First;    // Какую из повторных строк оставлять
+   bool incremental = false;                   // Обрабатывать только записи, добавленные с прошлого запуска
+   std::string merge_file;                     // Существующий файл Google Contacts для слияния (--merge)
+   bool normalize_phone = false;               // Приводить Phone 1 - Value к виду +7XXXXXXXXXX
+   bool normalize_email = true;                // Приводить E-mail 1 и 2 к единому виду (--no-normalize-email - нет)
+   std::string created_domain;                 // Домен созданной почты для исправления перепутанных адресов
+   bool name_case = false;                     // Приводить имя и фамилию к виду "Пономарев"
+   std::vector<SortField> sort_by;             // Поля сортировки вывода (--sort-by), пусто - порядок файла
+   bool label_per_group = false;               // Метка - группа строки (--label-per-group)
+   InputEncoding encoding = InputEncoding::Auto; // Кодировка входного файла (--encoding)
+   size_t max_rows_per_file = 0;               // Строк данных в одной части вывода (0 - без разбиения)
+   size_t max_bytes_per_file = 0;              // Размер одной части вывода в байтах (0 - без разбиения)
+   std::string split_by_group_dir;             // Каталог для файлов по группам (--split-by-group)
+   size_t max_warnings = 10;                   // Предупреждений каждой категории для вывода (0 - все)
+   std::string rejects_file;                   // Куда записывать отклоненные записи (--rejects)
+   bool check = false;                         // Только проверить вход (--check)
+   int sample_stride = 1;                      // Проверять каждую N-ю запись (--sample)
+   std::string stats_json;                     // Куда записать статистику прохода в JSON (--stats-json)
+   std::string generate_file;                  // Куда записать синтетическую выгрузку (--generate)
+   bool benchmark = false;                     // Выполнить замеры производительности (--benchmark)
+   size_t bench_rows = 100000;                 // Строк синтетической выгрузки (--rows)
+   unsigned long long seed = 1;                // Начальное значение генератора (--seed)
+
+   bool sharded_output() const { return max_rows_per_file != 0 || max_bytes_per_file != 0; }
+
+   bool batch_mode() const { return !batch_manifest.empty() || !batch_glob.empty(); }
+};
+
+/**
+ * @brief Разбирает размер в байтах с необязательным суффиксом K, M или G.
+ *
+ * @param text Текст значения (например, "4M").
+ * @param value Выходной параметр для разобранного значения.
+ * @return true, если значение корректно и больше нуля.
+ */
+bool parse_size_value(const std::string &text, size_t &value)
+{
+   size_t pos = 0;
+   unsigned long long number = 0;
+   if (text.empty() || text[0] < '0' || text[0] > '9')
+   {
+      return false; // std::stoull принимает "-1" и пробелы в начале
+   }
+   try
+   {
+      number = std::stoull(text, &pos);
+   }
+   catch (const std::exception &)
+   {
+      return false;
+   }
+   std::string suffix = text.substr(pos);
+   int shift = 0;
+   if (suffix == "K" || suffix == "k")
+   {
+      shift = 10;
+   }
+   else if (suffix == "M" || suffix == "m")
+   {
+      shift = 20;
+   }
+   else if (suffix == "G" || suffix == "g")
+   {
+      shift = 30;
+   }
+   else if (!suffix.empty())
+   {
+      return false;
+   }
+   if (number > (SIZE_MAX >> shift))
+   {
+      return false;
+   }
+   value = static_cast<size_t>(number) << shift;
+   return value > 0;
+}
+
+/**
+ * @brief Выводит справку по использованию программы.
+ */
+void print_usage(const char *program)
+{
+   std::cerr << "Использование: " << program << " [параметры] [\"путь/к/входному файлу.csv\"] [\"путь/к/выходному файлу.csv\"]" << std::endl;
+   std::cerr << "Параметры:" << std::endl;
+   std::cerr << "  --label МЕТКА        Значение поля Labels (без запроса с консоли)" << std::endl;
+   std::cerr << "  --mapping ФАЙЛ      Сопоставление столбцов (\"Столбец Google Contacts = источник\")" << std::endl;
+   std::cerr << "  --auto-columns      Определять столбцы по заголовку входного файла" << std::endl;
+   std::cerr << "  --normalize-phone   Приводить телефоны к виду +7XXXXXXXXXX" << std::endl;
+   std::cerr << "  --name-case         Приводить имя и фамилию к виду \"Пономарев\" (с большой буквы)" << std::endl;
+   std::cerr << "  --no-normalize-email Не приводить почту к единому виду (по умолчанию - без пробелов," << std::endl;
+   std::cerr << "                      домен строчными, с предупреждением об адресах неверного вида)" << std::endl;
+   std::cerr << "  --created-domain ДОМЕН Домен созданной почты: если адрес на нем оказался в почте ЛК," << std::endl;
+   std::cerr << "                      а не в созданной, адреса меняются местами" << std::endl;
+   std::cerr << "  --dedup КЛЮЧ        Удалять повторы по полю: email, login или phone" << std::endl;
+   std::cerr << "  --dedup-keep ПРАВИЛО Какой из повторов оставлять: first (по умолчанию) или latest" << std::endl;
+   std::cerr << "  --merge ФАЙЛ        Слить результат с существующим CSV Google Contacts" << std::endl;
+   std::cerr << "                      (совпадающие по почте или телефону контакты получают новую метку)" << std::endl;
+   std::cerr << "  --incremental       Дописывать только строки, добавленные с прошлого запуска" << std::endl;
+   std::cerr << "                      (состояние - в файле \"<выходной файл>.state\")" << std::endl;
+   std::cerr << "  --encoding КОДИРОВКА Кодировка входного файла: auto (по умолчанию), utf-8, cp1251" << std::endl;
+   std::cerr << "  --max-rows-per-file N Разбивать вывод на части по N строк (вывод_001.csv, вывод_002.csv, ...)" << std::endl;
+   std::cerr << "  --max-bytes-per-file N Разбивать вывод на части размером до N байтов (например, 20M)" << std::endl;
+   std::cerr << "  --split-by-group КАТАЛОГ Вместо выходного файла - файл на каждую группу в КАТАЛОГЕ" << std::endl;
+   std::cerr << "                      (ПМ-35.csv, ..., строки без группы - без_группы.csv)" << std::endl;
+   std::cerr << "  --stream            Читать входной файл блоками вместо отображения в память" << std::endl;
+   std::cerr << "  --pipeline          Читать вход и писать вывод в отдельных потоках (включает --stream)" << std::endl;
+   std::cerr << "  --chunk-size N      Размер блока потокового чтения (например, 4M; по умолчанию 1M)" << std::endl;
+   std::cerr << "  --simd ВАРИАНТ      Ядро сканирования CSV: auto (по умолчанию), avx2, sse2, scalar" << std::endl;
+   std::cerr << "  --threads N         Количество потоков преобразования (0 - по числу ядер; по умолчанию 1," << std::endl;
+   std::cerr << "                      в пакетном режиме - по числу ядер)" << std::endl;
+   std::cerr << "  --batch ФАЙЛ        Пакетный режим: строки файла \"вход,выход,метка\" (CSV)" << std::endl;
+   std::cerr << "  --batch-glob ШАБЛОН Пакетный режим: все файлы по шаблону (например, \"выгрузки/*.csv\")," << std::endl;
+   std::cerr << "                      метка - имя файла без расширения" << std::endl;
+   std::cerr << "  --output-dir КАТАЛОГ Каталог для выходных файлов при --batch-glob" << std::endl;
+   std::cerr << "  --max-warnings N    Показывать первые N предупреждений каждого вида (по умолчанию 10, 0 - все)" << std::endl;
+   std::cerr << "  --sort-by ПОЛЯ      Упорядочить вывод: group, lastname или group,lastname" << std::endl;
+   std::cerr << "  --label-per-group   Метка (Labels) - группа строки вместо общей метки" << std::endl;
+   std::cerr << "  --rejects ФАЙЛ      Записывать отклоненные строки (номер, причина, исходная запись) в CSV" << std::endl;
+   std::cerr << "  --check             Проверить вход (столбцы, почта, телефоны, кодировка) без записи вывода" << std::endl;
+   std::cerr << "  --sample N          С --check проверять только каждую N-ю запись" << std::endl;
+   std::cerr << "  --stats-json ФАЙЛ   Записать статистику прохода (строки, предупреждения, время этапов) в JSON" << std::endl;
+   std::cerr << "  --generate ФАЙЛ     Записать синтетическую выгрузку Google Forms (см. --rows, --seed)" << std::endl;
+   std::cerr << "  --benchmark         Замеры производительности на синтетической выгрузке" << std::endl;
+   std::cerr << "  --rows N            Строк синтетической выгрузки (по умолчанию 100000)" << std::endl;
+   std::cerr << "  --seed N            Начальное значение генератора выгрузки (по умолчанию 1)" << std::endl;
+   std::cerr << "Вместо имени входного или выходного файла можно указать \"-\" (стандартный ввод/вывод)." << std::endl;
+   std::cerr << "Примечание: Используйте кавычки, если пути содержат пробелы." << std::endl;
+   std::cerr << "Сжатый вход (.gz, .zst) распаковывается на лету, выходной файл .gz или .zst записывается сжатым"
+      << " (gzip: " << (compression_supported(Compression::Gzip) ? "да" : "нет")
+      << ", zstd: " << (compression_supported(Compression::Zstd) ? "да" : "нет") << ")." << std::endl;
+}
+
+/**
+ * @brief Разбирает аргументы командной строки.
+ *
+ * Позиционных аргументов должно быть либо ноль, либо два (входной и
+ * выходной файлы). Параметры, начинающиеся с "--", могут стоять в любом месте.
+ *
+ * @return true, если аргументы корректны; иначе выводит ошибку и справку.
+ */
+bool parse_arguments(int argc, char *argv[], Options &options)
+{
+   std::vector<std::string> positional;
+   for (int i = 1; i < argc; ++i)
+   {
+      std::string arg = argv[i];
+      // Значение параметра - следующий аргумент
+      auto next_value = [&](std::string &value) -> bool
+      {
+         if (i + 1 >= argc)
+         {
+            std::cerr << "Ошибка: Для параметра " << arg << " не указано значение." << std::endl;
+            return false;
+         }
+         value = argv[++i];
+         return true;
+      };
+
+      if (arg == "--label")
+      {
+         if (!next_value(options.label))
+         {
+            return false;
+         }
+         options.label_given = true;
+      }
+      else if (arg == "--mapping")
+      {
+         if (!next_value(options.mapping_file))
+         {
+            return false;
+         }
+      }
+      else if (arg == "--auto-columns")
+      {
+         options.auto_columns = true;
+      }
+      else if (arg == "--dedup")
+      {
+         std::string value;
+         if (!next_value(value))
+         {
+            return false;
+         }
+         if (value == "email")
+         {
+            options.dedup_key = DedupKey::Email;
+         }
+         else if (value == "login")
+         {
+            options.dedup_key = DedupKey::Login;
+         }
+         else if (value == "phone")
+         {
+            options.dedup_key = DedupKey::Phone;
+         }
+         else
+         {
+            std::cerr << "Ошибка: Неизвестный ключ удаления повторов: " << value << " (ожидается email, login или phone)" << std::endl;
+            return false;
+         }
+      }
+      else if (arg == "--dedup-keep")
+      {
+         std::string value;
+         if (!next_value(value))
+         {
+            return false;
+         }
+         if (value == "first")
+         {
+            options.dedup_keep = DedupKeep::First;
+         }
+         else if (value == "latest")
+         {
+            options.dedup_keep = DedupKeep::Latest;
+         }
+         else
+         {
+            std::cerr << "Ошибка: Неизвестное правило --dedup-keep: " << value << " (ожидается first или latest)" << std::endl;
+            return false;
+         }
+      }
+      else if (arg == "--normalize-phone")
+      {
+         options.normalize_phone = true;
+      }
+      else if (arg == "--name-case")
+      {
+         options.name_case = true;
+      }
+      else if (arg == "--no-normalize-email")
+      {
+         options.normalize_email = false;
+      }
+      else if (arg == "--created-domain")
+      {
+         if (!next_value(options.created_domain))
+         {
+            return false;
+         }
+         if (!options.created_domain.empty() && options.created_domain.front() == '@')
+         {
+            options.created_domain.erase(0, 1);
+         }
+         for (char &c : options.created_domain)
+         {
+            if (c >= 'A' && c <= 'Z')
+            {
+               c = static_cast<char>(c | 0x20);
+            }
+         }
+         if (options.created_domain.empty() || options.created_domain.find('@') != std::string::npos)
+         {
+            std::cerr << "Ошибка: Неверный домен --created-domain (ожидается, например, student.example.ru)" << std::endl;
+            return false;
+         }
+      }
+      else if (arg == "--merge")
+      {
+         if (!next_value(options.merge_file))
+         {
+            return false;
+         }
+      }
+      else if (arg == "--incremental")
+      {
+         options.incremental = true;
+      }
+      else if (arg == "--encoding")
+      {
+         std::string value;
+         if (!next_value(value))
+         {
+            return false;
+         }
+         if (value == "auto")
+         {
+            options.encoding = InputEncoding::Auto;
+         }
+         else if (value == "utf-8" || value == "utf8")
+         {
+            options.encoding = InputEncoding::Utf8;
+         }
+         else if (value == "cp1251" || value == "windows-1251")
+         {
+            options.encoding = InputEncoding::Cp1251;
+         }
+         else
+         {
+            std::cerr << "Ошибка: Неизвестная кодировка: " << value << " (ожидается auto, utf-8 или cp1251)" << std::endl;
+            return false;
+         }
+      }
+      else if (arg == "--max-rows-per-file" || arg == "--max-bytes-per-file")
+      {
+         std::string value;
+         if (!next_value(value))
+         {
+            return false;
+         }
+         const bool rows = arg == "--max-rows-per-file";
+         size_t limit = 0;
+         size_t pos = 0;
+         try
+         {
+            limit = rows ? static_cast<size_t>(std::stoull(value, &pos)) : 0;
+         }
+         catch (const std::exception &)
+         {
+            pos = 0;
+         }
+         if (rows ? (pos != value.size() || limit == 0) : !parse_size_value(value, limit))
+         {
+            std::cerr << "Ошибка: Некорректное значение " << arg << ": " << value << std::endl;
+            return false;
+         }
+         (rows ? options.max_rows_per_file : options.max_bytes_per_file) = limit;
+      }
+      else if (arg == "--split-by-group")
+      {
+         if (!next_value(options.split_by_group_dir))
+         {
+            return false;
+         }
+      }
+      else if (arg == "--stream")
+      {
+         options.stream_input = true;
+      }
+      else if (arg == "--pipeline")
+      {
+         options.pipeline = true;
+         options.stream_input = true;
+      }
+      else if (arg == "--chunk-size")
+      {
+         std::string value;
+         if (!next_value(value))
+         {
+            return false;
+         }
+         if (!parse_size_value(value, options.chunk_size))
+         {
+            std::cerr << "Ошибка: Некорректный размер блока: " << value << std::endl;
+            return false;
+         }
+         if (options.chunk_size > CsvRecordReader::MAX_CHUNK_SIZE)
+         {
+            std::cerr << "Ошибка: Размер блока больше " << (CsvRecordReader::MAX_CHUNK_SIZE >> 20) << "M: " << value << std::endl;
+            return false;
+         }
+      }
+      else if (arg == "--simd")
+      {
+         if (!next_value(options.simd))
+         {
+            return false;
+         }
+         if (!select_block_classifier(options.simd, g_classify_block))
+         {
+            std::cerr << "Ошибка: Ядро сканирования " << options.simd << " неизвестно или не поддерживается процессором." << std::endl;
+            return false;
+         }
+      }
+      else if (arg == "--threads")
+      {
+         std::string value;
+         if (!next_value(value))
+         {
+            return false;
+         }
+         try
+         {
+            size_t pos = 0;
+            unsigned long threads = std::stoul(value, &pos);
+            if (pos != value.size() || threads > 1024)
+            {
+               throw std::invalid_argument(value);
+            }
+            options.threads = threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : static_cast<unsigned>(threads);
+         }
+         catch (const std::exception &)
+         {
+            std::cerr << "Ошибка: Некорректное количество потоков: " << value << std::endl;
+            return false;
+         }
+      }
+      else if (arg == "--batch")
+      {
+         if (!next_value(options.batch_manifest))
+         {
+            return false;
+         }
+      }
+      else if (arg == "--batch-glob")
+      {
+         if (!next_value(options.batch_glob))
+         {
+            return false;
+         }
+      }
+      else if (arg == "--output-dir")
+      {
+         if (!next_value(options.output_dir))
+         {
+            return false;
+         }
+      }
+      else if (arg == "--max-warnings")
+      {
+         std::string value;
+         if (!next_value(value))
+         {
+            return false;
+         }
+         try
+         {
+            size_t pos = 0;
+            options.max_warnings = static_cast<size_t>(std::stoull(value, &pos));
+            if (pos != value.size())
+            {
+               throw std::invalid_argument(value);
+            }
+         }
+         catch (const std::exception &)
+         {
+            std::cerr << "Ошибка: Некорректное значение --max-warnings: " << value << std::endl;
+            return false;
+         }
+      }
+      else if (arg == "--sort-by")
+      {
+         std::string value;
+         if (!next_value(value))
+         {
+            return false;
+         }
+         options.sort_by.clear();
+         size_t begin = 0;
+         while (begin <= value.size())
+         {
+            size_t next = value.find(',', begin);
+            if (next == std::string::npos)
+            {
+               next = value.size();
+            }
+            const std::string name = value.substr(begin, next - begin);
+            begin = next + 1;
+            SortField field;
+            if (name == "group")
+            {
+               field = SortField::Group;
+            }
+            else if (name == "lastname")
+            {
+               field = SortField::LastName;
+            }
+            else
+            {
+               std::cerr << "Ошибка: Неизвестное поле сортировки: " << name << " (ожидается group, lastname или group,lastname)" << std::endl;
+               return false;
+            }
+            if (std::find(options.sort_by.begin(), options.sort_by.end(), field) == options.sort_by.end())
+            {
+               options.sort_by.push_back(field);
+            }
+         }
+      }
+      else if (arg == "--label-per-group")
+      {
+         options.label_per_group = true;
+      }
+      else if (arg == "--rejects")
+      {
+         if (!next_value(options.rejects_file))
+         {
+            return false;
+         }
+      }
+      else if (arg == "--check")
+      {
+         options.check = true;
+      }
+      else if (arg == "--sample")
+      {
+         std::string value;
+         if (!next_value(value))
+         {
+            return false;
+         }
+         size_t pos = 0;
+         int stride = 0;
+         try
+         {
+            stride = std::stoi(value, &pos);
+         }
+         catch (const std::exception &)
+         {
+            pos = 0;
+         }
+         if (pos != value.size() || stride < 1)
+         {
+            std::cerr << "Ошибка: Некорректное значение " << arg << ": " << value << std::endl;
+            return false;
+         }
+         options.sample_stride = stride;
+      }
+      else if (arg == "--stats-json")
+      {
+         if (!next_value(options.stats_json))
+         {
+            return false;
+         }
+      }
+      else if (arg == "--generate")
+      {
+         if (!next_value(options.generate_file))
+         {
+            return false;
+         }
+      }
+      else if (arg == "--benchmark")
+      {
+         options.benchmark = true;
+      }
+      else if (arg == "--rows" || arg == "--seed")
+      {
+         std::string value;
+         if (!next_value(value))
+         {
+            return false;
+         }
+         try
+         {
+            size_t pos = 0;
+            const unsigned long long number = std::stoull(value, &pos);
+            if (pos != value.size() || (arg == "--rows" && number > 100000000ull))
+            {
+               throw std::invalid_argument(value);
+            }
+            if (arg == "--rows")
+            {
+               options.bench_rows = static_cast<size_t>(number);
+            }
+            else
+            {
+               options.seed = number;
+            }
+         }
+         catch (const std::exception &)
+         {
+            std::cerr << "Ошибка: Некорректное значение " << arg << ": " << value << std::endl;
+            return false;
+         }
+      }
+      else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0)
+      {
+         std::cerr << "Ошибка: Неизвестный параметр: " << arg << std::endl;
+         print_usage(argv[0]);
+         return false;
+      }
+      else
+      {
+         positional.push_back(arg);
+      }
+   }
+
+   if (options.incremental && options.dedup_key != DedupKey::None)
+   {
+      // Ключи строк, обработанных прошлыми запусками, не известны
+      std::cerr << "Ошибка: Параметры --incremental и --dedup несовместимы." << std::endl;
+      return false;
+   }
+   if (options.incremental && !options.merge_file.empty())
+   {
+      // Слияние переписывает выходной файл целиком
+      std::cerr << "Ошибка: Параметры --incremental и --merge несовместимы." << std::endl;
+      return false;
+   }
+   if (!options.sort_by.empty() && (options.incremental || !options.merge_file.empty()))
+   {
+      // Порядок вывода задают дописывание и существующий файл контактов
+      std::cerr << "Ошибка: Сортировка вывода несовместима с --incremental и --merge." << std::endl;
+      return false;
+   }
+   if (options.sharded_output() && (options.incremental || !options.merge_file.empty()))
+   {
+      // Оба режима работают с одним выходным файлом
+      std::cerr << "Ошибка: Разбиение вывода на части несовместимо с --incremental и --merge." << std::endl;
+      return false;
+   }
+   if (!options.split_by_group_dir.empty() && (options.sharded_output() || options.incremental || !options.merge_file.empty()))
+   {
+      std::cerr << "Ошибка: Параметр --split-by-group несовместим с разбиением на части, --incremental и --merge." << std::endl;
+      return false;
+   }
+
+   if (!options.generate_file.empty() || options.benchmark)
+   {
+      if (!positional.empty() || options.batch_mode())
+      {
+         std::cerr << "Ошибка: --generate и --benchmark не принимают имен файлов и не совместимы с пакетным режимом." << std::endl;
+         print_usage(argv[0]);
+         return false;
+      }
+   }
+   else if (options.batch_mode())
+   {
+      if (!positional.empty() || (!options.batch_manifest.empty() && !options.batch_glob.empty()))
+      {
+         std::cerr << "Ошибка: В пакетном режиме задается либо --batch, либо --batch-glob, без имен файлов." << std::endl;
+         print_usage(argv[0]);
+         return false;
+      }
+   }
+   else if (positional.size() == 2 && !options.split_by_group_dir.empty())
+   {
+      std::cerr << "Ошибка: С --split-by-group результат пишется в каталог, выходной файл не задается." << std::endl;
+      print_usage(argv[0]);
+      return false;
+   }
+   else if (positional.size() == 2)
+   {
+      options.input_filename = positional[0];
+      options.output_filename = positional[1];
+   }
+   else if (positional.size() == 1 && (!options.split_by_group_dir.empty() || options.check))
+   {
+      // Выходного файла нет: вывод - файлы групп в каталоге или его нет вовсе (--check)
+      options.input_filename = positional[0];
+   }
+   else if (!positional.empty())
+   {
+      // Если количество имен файлов не 0 и не 2
+      std::cerr << "Ошибка: Неверное количество аргументов." << std::endl;
+      print_usage(argv[0]);
+      return false;
+   }
+
+   if (options.sample_stride > 1 && !options.check)
+   {
+      std::cerr << "Ошибка: Параметр --sample используется только вместе с --check." << std::endl;
+      return false;
+   }
+   if (options.check && (options.batch_mode() || options.incremental || !options.merge_file.empty() || !options.sort_by.empty()
+      || options.sharded_output() || !options.split_by_group_dir.empty()))
+   {
+      // Проверка ничего не записывает: параметры вывода к ней не относятся
+      std::cerr << "Ошибка: Параметр --check несовместим с пакетным режимом и параметрами вывода"
+         " (--incremental, --merge, --sort-by, разбиение вывода)." << std::endl;
+      return false;
+   }
+   if (!options.created_domain.empty() && !options.normalize_email)
+   {
+      // Домены сравниваются в едином виде (после приведения адресов)
+      std::cerr << "Ошибка: Параметр --created-domain несовместим с --no-normalize-email." << std::endl;
+      return false;
+   }
+   if (options.sharded_output() && compression_for_path(options.output_filename) != Compression::None)
+   {
+      std::cerr << "Ошибка: Части разбитого вывода не сжимаются: укажите выходной файл .csv." << std::endl;
+      return false;
+   }
+   if (!options.split_by_group_dir.empty() && options.batch_mode())
+   {
+      // Файлы разных заданий с одной группой попали бы в один файл
+      std::cerr << "Ошибка: Параметр --split-by-group не поддерживается в пакетном режиме." << std::endl;
+      return false;
+   }
+   if (!options.rejects_file.empty() && options.batch_mode())
+   {
+      // Задания пакета выполняются параллельно, а файл отклоненных - один
+      std::cerr << "Ошибка: Параметр --rejects не поддерживается в пакетном режиме." << std::endl;
+      return false;
+   }
+   if (options.stats_json == "-" && options.output_filename == "-")
+   {
+      std::cerr << "Ошибка: Статистика и результат не могут одновременно выводиться в стандартный вывод." << std::endl;
+      return false;
+   }
+   if (options.rejects_file == "-" && (options.output_filename == "-" || options.stats_json == "-"))
+   {
+      std::cerr << "Ошибка: Отклоненные записи не могут выводиться в стандартный вывод вместе с результатом или статистикой." << std::endl;
+      return false;
+   }
+   std::error_code same_file_error;
+   if (!options.stats_json.empty() && options.stats_json != "-" && options.input_filename != "-" && !options.batch_mode()
+      && std::filesystem::equivalent(options.input_filename, options.stats_json, same_file_error) && !same_file_error)
+   {
+      // Статистика записывается и после ошибки преобразования
+      std::cerr << "Ошибка: Входной файл нельзя перезаписать результатом: " << options.stats_json << std::endl;
+      return false;
+   }
+
+   // Правила сопоставления загружаются один раз и общие для всех файлов пакета
+   auto mapping = std::make_shared<MappingSpec>(default_mapping_spec());
+   if (!options.mapping_file.empty() && !load_mapping_file(options.mapping_file, *mapping))
+   {
+      return false;
+   }
+   if (options.normalize_phone)
+   {
+      // Phone 1 - Value (столбец 22) заполняется нормализованным номером
+      for (MappingRule &rule : mapping->rules)
+      {
+         if (rule.output_index == 22 && rule.transform == FieldTransform::Copy)
+         {
+            rule.transform = FieldTransform::Phone;
+         }
+      }
+   }
+   if (options.normalize_email)
+   {
+      // E-mail 1 - Value (18) и E-mail 2 - Value (20) - без пробелов по краям, домен строчными
+      for (MappingRule &rule : mapping->rules)
+      {
+         if ((rule.output_index == 18 || rule.output_index == 20) && rule.transform == FieldTransform::Copy)
+         {
+            rule.transform = FieldTransform::Email;
+         }
+      }
+   }
+   if (options.name_case)
+   {
+      // First Name и скопированная Last Name - с большой буквы; фамилию из
+      // "Группа Фамилия" приводит convert_row (см. ConversionSettings::name_case)
+      for (MappingRule &rule : mapping->rules)
+      {
+         if ((rule.output_index == 0 || rule.output_index == 2) && rule.transform == FieldTransform::Copy)
+         {
+            rule.transform = FieldTransform::Name;
+         }
+      }
+   }
+   options.mapping = mapping;
+   return true;
+}
+
+
+// --- Пул потоков ---
+
+/**
+ * @brief Пул потоков с перехватом работы (work stealing).
+ *
+ * У каждого потока своя очередь: задачи, поставленные из потока пула,
+ * попадают в его очередь и берутся с хвоста (LIFO - данные еще в кэше),
+ * а простаивающий поток забирает задачи из головы чужих очередей. Задачи
+ * из внешних потоков раскладываются по очередям по кругу. Ожидание
+ * результата через wait() не блокирует поток: пока результат не готов,
+ * ожидающий выполняет другие задачи, поэтому задачи могут ставить
+ * вложенные задачи и ждать их (пакет файлов -> участки файла) без
+ * взаимной блокировки.
+ */
+class ThreadPool
+{
+public:
+   explicit ThreadPool(unsigned thread_count)
+   {
+      thread_count = std::max(thread_count, 1u);
+      for (unsigned i = 0; i < thread_count; ++i)
+      {
+         queues_.push_back(std::make_unique<WorkerQueue>());
+      }
+      for (unsigned i = 0; i < thread_count; ++i)
+      {
+         workers_.emplace_back([this, i] { worker_loop(i); });
+      }
+   }
+
+   ~ThreadPool()
+   {
+      {
+         std::lock_guard<std::mutex> lock(sleep_mutex_);
+         stopping_ = true;
+      }
+      wake_.notify_all();
+      for (std::thread &worker : workers_)
+      {
+         worker.join();
+      }
+   }
+
+   ThreadPool(const ThreadPool &) = delete;
+   ThreadPool &operator=(const ThreadPool &) = delete;
+
+   size_t size() const { return workers_.size(); }
+
+   /**
+    * @brief Ставит задачу в очередь.
+    * @return std::future с результатом задачи (исключение задачи передается через него).
+    */
+   template <typename F>
+   auto submit(F &&task) -> std::future<decltype(task())>
+   {
+      using Result = decltype(task());
+      auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+      std::future<Result> result = packaged->get_future();
+      const size_t index = current_pool_ == this ? current_index_ : next_queue_++ % queues_.size();
+      {
+         std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+         queues_[index]->tasks.emplace_back([packaged] { (*packaged)(); });
+      }
+      {
+         std::lock_guard<std::mutex> lock(sleep_mutex_);
+         ++pending_;
+      }
+      wake_.notify_one();
+      return result;
+   }
+
+   /**
+    * @brief Дожидается результата, выполняя в это время другие задачи пула.
+    */
+   template <typename T>
+   T wait(std::future<T> &result)
+   {
+      while (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      {
+         if (!try_run_one())
+         {
+            result.wait_for(std::chrono::microseconds(200));
+         }
+      }
+      return result.get();
+   }
+
+private:
+   struct WorkerQueue
+   {
+      std::mutex mutex;
+      std::deque<std::function<void()>> tasks;
+   };
+
+   /**
+    * @brief Выполняет одну задачу: сначала из своей очереди, затем перехваченную из чужой.
+    * @return false, если задач нет.
+    */
+   bool try_run_one()
+   {
+      std::function<void()> task;
+      const bool is_worker = current_pool_ == this;
+      if (is_worker)
+      {
+         WorkerQueue &own = *queues_[current_index_];
+         std::lock_guard<std::mutex> lock(own.mutex);
+         if (!own.tasks.empty())
+         {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+         }
+      }
+      for (size_t k = 0; !task && k < queues_.size(); ++k)
+      {
+         const size_t victim = is_worker ? (current_index_ + 1 + k) % queues_.size() : k;
+         WorkerQueue &other = *queues_[victim];
+         std::lock_guard<std::mutex> lock(other.mutex);
+         if (!other.tasks.empty())
+         {
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+         }
+      }
+      if (!task)
+      {
+         return false;
+      }
+      {
+         std::lock_guard<std::mutex> lock(sleep_mutex_);
+         --pending_;
+      }
+      task();
+      return true;
+   }
+
+   void worker_loop(size_t index)
+   {
+      current_pool_ = this;
+      current_index_ = index;
+      for (;;)
+      {
+         if (try_run_one())
+         {
+            continue;
+         }
+         std::unique_lock<std::mutex> lock(sleep_mutex_);
+         wake_.wait(lock, [this] { return stopping_ || pending_ > 0; });
+         if (stopping_ && pending_ == 0)
+         {
+            return; // Остановка и задач больше нет
+         }
+      }
+   }
+
+   static thread_local ThreadPool *current_pool_; // Пул, которому принадлежит текущий поток
+   static thread_local size_t current_index_;     // Номер очереди текущего потока в этом пуле
+
+   std::vector<std::unique_ptr<WorkerQueue>> queues_;
+   std::vector<std::thread> workers_;
+   std::atomic<size_t> next_queue_{0};
+   std::mutex sleep_mutex_;
+   std::condition_variable wake_;
+   size_t pending_ = 0; // Задач в очередях (под sleep_mutex_)
+   bool stopping_ = false;
+};
+
+thread_local ThreadPool *ThreadPool::current_pool_ = nullptr;
+thread_local size_t ThreadPool::current_index_ = 0;
+
+
+// --- Таблица контактов по столбцам ---
+
+/**
+ * @brief Таблица контактов в памяти, хранимая по столбцам.
+ *
+ * Для каждого столбца - один непрерывный буфер байтов значений и массив
+ * 32-битных смещений из rows() + 1 элементов: значение строки r - байты
+ * [offsets[r], offsets[r + 1]). Значения хранятся уже без экранирования CSV,
+ * поэтому память близка к суммарному размеру полей плюс 4 байта на поле, без
+ * отдельного выделения памяти на значение. Проходы по одному столбцу (ключи
+ * сортировки, повторов, слияния) читают подряд лежащие байты.
+ */
+class ContactTable
+{
+public:
+   explicit ContactTable(size_t column_count) : columns_(column_count)
+   {
+      for (Column &column : columns_)
+      {
+         column.offsets.push_back(0);
+      }
+   }
+
+   /**
+    * @brief Резервирует место под rows строк и bytes байтов значений столбца column.
+    */
+   void reserve(size_t column, size_t rows, size_t bytes)
+   {
+      columns_[column].offsets.reserve(rows + 1);
+      columns_[column].bytes.reserve(std::min<size_t>(bytes, UINT32_MAX));
+   }
+
+   /**
+    * @brief Добавляет строку: недостающие поля пусты, лишние отбрасываются.
+    * @return false, если буфер столбца превысил бы 4 ГиБ (строка не добавлена).
+    */
+   bool add_row(const std::vector<std::string_view> &fields)
+   {
+      const size_t count = std::min(fields.size(), columns_.size());
+      for (size_t j = 0; j < count; ++j)
+      {
+         if (fields[j].size() > UINT32_MAX - columns_[j].bytes.size())
+         {
+            return false;
+         }
+      }
+      for (size_t j = 0; j < columns_.size(); ++j)
+      {
+         Column &column = columns_[j];
+         if (j < count)
+         {
+            column.bytes.append(fields[j].data(), fields[j].size());
+         }
+         column.offsets.push_back(static_cast<uint32_t>(column.bytes.size()));
+      }
+      ++rows_;
+      return true;
+   }
+
+   std::string_view field(size_t row, size_t column) const
+   {
+      const Column &values = columns_[column];
+      return std::string_view(values.bytes.data() + values.offsets[row], values.offsets[row + 1] - values.offsets[row]);
+   }
+
+   /**
+    * @brief Записывает строку row в CSV (с экранированием) и завершает ее.
+    */
+   void write_row(size_t row, CsvWriter &out) const
+   {
+      for (size_t j = 0; j < columns_.size(); ++j)
+      {
+         if (j > 0)
+         {
+            out.put(',');
+         }
+         out.write_field(field(row, j));
+      }
+      out.end_row();
+   }
+
+   size_t rows() const { return rows_; }
+   size_t columns() const { return columns_.size(); }
+
+   /**
+    * @brief Сколько байтов занимают значения и смещения (без запаса емкости).
+    */
+   size_t memory_bytes() const
+   {
+      size_t total = 0;
+      for (const Column &column : columns_)
+      {
+         total += column.bytes.size() + column.offsets.size() * sizeof(uint32_t);
+      }
+      return total;
+   }
+
+private:
+   struct Column
+   {
+      std::string bytes;             // Значения подряд
+      std::vector<uint32_t> offsets; // Начало значения каждой строки и конец последнего
+   };
+
+   std::vector<Column> columns_;
+   size_t rows_ = 0;
+};
+
+
+// --- Сортировка по группе и фамилии ---
+
+/**
+ * @brief Ранги символов для сравнения без учета регистра.
+ *
+ * 0 - конец строки; далее ASCII (строчные латинские буквы приравнены к
+ * заглавным), затем русский алфавит (Ё - между Е и Ж, строчные - как
+ * заглавные). Остальные символы получают ранг SORT_RANK_OTHER и
+ * упорядочиваются после них по номеру символа.
+ */
+const uint8_t SORT_RANK_OTHER = 255;
+
+constexpr std::array<uint8_t, NAME_CASE_RANGE> make_sort_ranks()
+{
+   std::array<uint8_t, NAME_CASE_RANGE> ranks{};
+   for (size_t cp = 0; cp < NAME_CASE_RANGE; ++cp)
+   {
+      ranks[cp] = SORT_RANK_OTHER;
+   }
+   uint8_t next = 1;
+   for (uint16_t cp = 1; cp < 0x80; ++cp)
+   {
+      if (cp >= 'a' && cp <= 'z')
+      {
+         continue;
+      }
+      ranks[cp] = next++;
+   }
+   for (uint16_t cp = 'a'; cp <= 'z'; ++cp)
+   {
+      ranks[cp] = ranks[cp - 0x20];
+   }
+   for (uint16_t cp = 0x410; cp <= 0x42F; ++cp) // А-Я, Ё после Е
+   {
+      ranks[cp] = ranks[cp + 0x20] = next++;
+      if (cp == 0x415)
+      {
+         ranks[0x401] = ranks[0x451] = next++;
+      }
+   }
+   return ranks;
+}
+
+const std::array<uint8_t, NAME_CASE_RANGE> SORT_RANK = make_sort_ranks();
+
+/**
+ * @brief Вес очередного символа UTF-8 строки text начиная с i (i сдвигается за символ).
+ *
+ * Вес меньше 256 - ранг из SORT_RANK; прочие символы - 256 + номер символа.
+ * Байт неверной последовательности считается символом со своим номером.
+ */
+inline uint32_t next_sort_weight(std::string_view text, size_t &i)
+{
+   const unsigned char lead = static_cast<unsigned char>(text[i]);
+   uint32_t cp = lead;
+   size_t length = 1;
+   if (lead >= 0xC0)
+   {
+      length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : 2;
+      if (i + length > text.size())
+      {
+         length = 1;
+      }
+      else
+      {
+         cp = lead & (0x7F >> length);
+         for (size_t k = 1; k < length; ++k)
+         {
+            const unsigned char next = static_cast<unsigned char>(text[i + k]);
+            if ((next & 0xC0) != 0x80)
+            {
+               cp = lead;
+               length = 1;
+               break;
+            }
+            cp = (cp << 6) | (next & 0x3F);
+         }
+      }
+   }
+   i += length;
+   const uint8_t rank = cp < NAME_CASE_RANGE ? SORT_RANK[cp] : SORT_RANK_OTHER;
+   return rank != SORT_RANK_OTHER ? rank : 256 + cp;
+}
+
+/**
+ * @brief Сравнивает строки по весам символов (см. next_sort_weight).
+ * @return Отрицательное число, ноль или положительное число.
+ */
+int compare_sort_text(std::string_view a, std::string_view b)
+{
+   size_t i = 0, j = 0;
+   while (i < a.size() && j < b.size())
+   {
+      const uint32_t wa = next_sort_weight(a, i);
+      const uint32_t wb = next_sort_weight(b, j);
+      if (wa != wb)
+      {
+         return wa < wb ? -1 : 1;
+      }
+   }
+   return (i < a.size()) - (j < b.size());
+}
+
+/**
+ * @brief Первые символы строки как целые: по байту на символ, 8 символов на
+ * слово, старший байт - первый символ.
+ *
+ * Байт - вес символа, ограниченный сверху SORT_RANK_OTHER, поэтому порядок
+ * ключей не противоречит compare_sort_text, а равные ключи упорядочиваются
+ * сравнением целиком. exact сбрасывается, если строка не поместилась в ключ
+ * или содержит символы с рангом SORT_RANK_OTHER (ключ не определяет порядок).
+ * После этого ключ обрывается: остальные байты (и ключи следующих полей,
+ * если exact уже сброшен при вызове) - нули, чтобы все строки с тем же
+ * началом попали в одну серию равных ключей и досортировались целиком.
+ *
+ * @param key Слова ключа (заполняются все words слов).
+ */
+void sort_prefix_key(std::string_view text, uint64_t *key, size_t words, bool &exact)
+{
+   size_t i = exact ? 0 : text.size(); // Ключ уже оборван на предыдущем поле
+   for (size_t word = 0; word < words; ++word)
+   {
+      uint64_t value = 0;
+      for (int shift = 56; shift >= 0 && i < text.size(); shift -= 8)
+      {
+         const uint32_t weight = next_sort_weight(text, i);
+         value |= static_cast<uint64_t>(std::min<uint32_t>(weight, SORT_RANK_OTHER)) << shift;
+         if (weight >= SORT_RANK_OTHER)
+         {
+            exact = false;
+            i = text.size();
+         }
+      }
+      key[word] = value;
+   }
+   if (i < text.size())
+   {
+      exact = false;
+   }
+}
+
+// Столбцы таблицы сортировки: ключ и строка вывода целиком (выводится без повторного форматирования)
+const size_t SORT_KEY_COLUMN = 0;    // Last Name - "Группа Фамилия"
+const size_t SORT_RECORD_COLUMN = 1; // Запись CSV без перевода строки
+const size_t SORT_TABLE_COLUMNS = 2;
+const size_t SORT_APPEND_BATCH_SIZE = 1 << 20; // Строки вывода добавляются к таблице порциями ~1 МиБ
+
+/**
+ * @brief Добавляет преобразованные строки (столбцы OUTPUT_HEADER, без заголовка) к таблице сортировки.
+ *
+ * Из строки разбирается только Last Name - по границам полей, найденным
+ * при поиске конца записи.
+ * @return false, если таблица переполнилась (см. ContactTable::add_row).
+ */
+bool append_sort_rows(ContactTable &table, std::string_view converted, std::string &scratch)
+{
+   const size_t LAST_NAME = 2; // Номер столбца Last Name в OUTPUT_HEADER
+   const char *cursor = converted.data();
+   const char *const end = cursor + converted.size();
+   CsvRecord record;
+   std::vector<std::string_view> row(SORT_TABLE_COLUMNS);
+   while (read_next_record(cursor, end, record))
+   {
+      row[SORT_KEY_COLUMN] = csv_record_field(record, LAST_NAME, scratch);
+      row[SORT_RECORD_COLUMN] = record.text;
+      if (!table.add_row(row))
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+/**
+ * @brief Порядок строк таблицы сортировки по группе и (или) фамилии из Last Name.
+ *
+ * Ключ строки - первые символы полей сортировки, упакованные в 64-битные
+ * целые (sort_prefix_key): группа - 8 символов, фамилия - 16. Части таблицы
+ * сортируются параллельно поразрядной сортировкой LSD по байтам ключа
+ * (гистограммы всех байтов слова - за один проход; байты, одинаковые у всех
+ * строк части, пропускаются), затем попарно сливаются. Обе стадии устойчивы,
+ * поэтому строки с равными ключами остаются в порядке файла. Только серии
+ * равных ключей, где ключ не определяет порядок (очень длинные значения),
+ * досортировываются сравнением полей целиком.
+ *
+ * @param table Таблица сортировки (SORT_KEY_COLUMN - Last Name).
+ * @param fields Поля сортировки по старшинству (одно или два).
+ * @param pool Пул потоков (nullptr - в текущем потоке).
+ * @return Номера строк таблицы в порядке вывода.
+ */
+std::vector<uint32_t> sort_contact_rows(const ContactTable &table, const std::vector<SortField> &fields, ThreadPool *pool)
+{
+   static constexpr size_t MAX_KEY_WORDS = 3;
+   struct Entry
+   {
+      uint64_t key[MAX_KEY_WORDS];
+      uint32_t row;
+      bool exact;
+   };
+   const size_t count = table.rows();
+   std::vector<Entry> entries(count);
+   std::vector<Entry> buffer(count);
+
+   auto sort_field = [&](size_t row, SortField field)
+   {
+      std::string_view group, lastName;
+      splitGroupLastName(table.field(row, SORT_KEY_COLUMN), group, lastName);
+      return field == SortField::Group ? group : lastName;
+   };
+   auto field_words = [](SortField field) -> size_t { return field == SortField::Group ? 1 : 2; };
+   size_t key_words = 0;
+   for (SortField field : fields)
+   {
+      key_words += field_words(field);
+   }
+
+   // Части для параллельной сортировки: не меньше 64 тыс. строк в части
+   const size_t MIN_PART_ROWS = 1 << 16;
+   const size_t threads = pool != nullptr ? pool->size() : 1;
+   const size_t part_count = std::max<size_t>(1, std::min(threads, count / MIN_PART_ROWS));
+   std::vector<size_t> bounds(part_count + 1);
+   for (size_t p = 0; p <= part_count; ++p)
+   {
+      bounds[p] = count * p / part_count;
+   }
+
+   auto sort_part = [&](size_t begin, size_t end)
+   {
+      for (size_t r = begin; r < end; ++r)
+      {
+         Entry &entry = entries[r];
+         entry.row = static_cast<uint32_t>(r);
+         entry.exact = true;
+         size_t word = 0;
+         for (SortField field : fields)
+         {
+            sort_prefix_key(sort_field(r, field), entry.key + word, field_words(field), entry.exact);
+            word += field_words(field);
+         }
+      }
+      // Младшие байты младшего слова ключа - первыми
+      Entry *from = entries.data() + begin;
+      Entry *to = buffer.data() + begin;
+      const size_t size = end - begin;
+      for (size_t word = key_words; word-- > 0;)
+      {
+         std::vector<std::array<size_t, 256>> counts(8);
+         for (size_t i = 0; i < size; ++i)
+         {
+            const uint64_t key = from[i].key[word];
+            for (size_t b = 0; b < 8; ++b)
+            {
+               ++counts[b][(key >> (8 * b)) & 0xFF];
+            }
+         }
+         for (size_t b = 0; b < 8; ++b)
+         {
+            std::array<size_t, 256> &offsets = counts[b];
+            if (std::find(offsets.begin(), offsets.end(), size) != offsets.end())
+            {
+               continue; // Байт одинаков у всех строк части
+            }
+            size_t offset = 0;
+            for (size_t &bucket : offsets)
+            {
+               const size_t bucket_size = bucket;
+               bucket = offset;
+               offset += bucket_size;
+            }
+            const unsigned shift = static_cast<unsigned>(8 * b);
+            for (size_t i = 0; i < size; ++i)
+            {
+               to[offsets[(from[i].key[word] >> shift) & 0xFF]++] = from[i];
+            }
+            std::swap(from, to);
+         }
+      }
+      if (from != entries.data() + begin)
+      {
+         std::copy(from, from + size, entries.data() + begin);
+      }
+   };
+
+   auto run_parallel = [&](size_t tasks, auto &&task)
+   {
+      if (pool == nullptr || tasks == 1)
+      {
+         for (size_t t = 0; t < tasks; ++t)
+         {
+            task(t);
+         }
+         return;
+      }
+      std::vector<std::future<void>> futures;
+      for (size_t t = 0; t < tasks; ++t)
+      {
+         futures.push_back(pool->submit([&task, t] { task(t); }));
+      }
+      for (std::future<void> &future : futures)
+      {
+         pool->wait(future);
+      }
+   };
+
+   run_parallel(part_count, [&](size_t p) { sort_part(bounds[p], bounds[p + 1]); });
+
+   // Попарное слияние отсортированных частей
+   auto key_less = [key_words](const Entry &a, const Entry &b)
+   {
+      return std::lexicographical_compare(a.key, a.key + key_words, b.key, b.key + key_words);
+   };
+   for (size_t width = 1; width < part_count; width *= 2)
+   {
+      const size_t merges = (part_count + 2 * width - 1) / (2 * width);
+      run_parallel(merges, [&](size_t m)
+      {
+         const size_t first = bounds[2 * m * width];
+         const size_t middle = bounds[std::min(part_count, (2 * m + 1) * width)];
+         const size_t last = bounds[std::min(part_count, (2 * m + 2) * width)];
+         std::merge(entries.begin() + first, entries.begin() + middle, entries.begin() + middle, entries.begin() + last,
+            buffer.begin() + first, key_less);
+      });
+      entries.swap(buffer);
+   }
+
+   // Досортировка серий равных ключей, где ключ не определяет порядок
+   auto full_less = [&](const Entry &a, const Entry &b)
+   {
+      for (SortField field : fields)
+      {
+         const int order = compare_sort_text(sort_field(a.row, field), sort_field(b.row, field));
+         if (order != 0)
+         {
+            return order < 0;
+         }
+      }
+      return false;
+   };
+   for (size_t begin = 0; begin < count;)
+   {
+      size_t end = begin + 1;
+      bool exact = entries[begin].exact;
+      while (end < count && std::equal(entries[end].key, entries[end].key + key_words, entries[begin].key))
+      {
+         exact = exact && entries[end].exact;
+         ++end;
+      }
+      if (!exact && end - begin > 1)
+      {
+         std::stable_sort(entries.begin() + begin, entries.begin() + end, full_less);
+      }
+      begin = end;
+   }
+
+   std::vector<uint32_t> order(count);
+   for (size_t i = 0; i < count; ++i)
+   {
+      order[i] = entries[i].row;
+   }
+   return order;
+}
+
+
+// --- Слияние с существующими контактами ---
+
+/**
+ * @brief Индекс контактов по нормализованному ключу (почта или телефон).
+ *
+ * Нормализованные ключи хранятся подряд в одном буфере (арене); ячейка
+ * хеш-таблицы с открытой адресацией - отпечаток, смещение и длина ключа
+ * в арене и номер контакта, без отдельного выделения памяти на ключ.
+ * Совпадение проверяется сравнением байтов ключа, а не только отпечатка.
+ */
+class ContactKeyIndex
+{
+public:
+   explicit ContactKeyIndex(DedupKey key) : key_(key) {}
+
+   /**
+    * @brief Номер контакта с ключом field или -1 (в том числе для пустого ключа).
+    */
+   int find(std::string_view field)
+   {
+      if (!normalize(field) || slots_.empty())
+      {
+         return -1;
+      }
+      return slots_[probe(mix_hash(hash_bytes(key_scratch_)), key_scratch_)].row;
+   }
+
+   /**
+    * @brief Запоминает за ключом field контакт row (если ключ не пуст и еще не встречался).
+    */
+   void insert(std::string_view field, int row)
+   {
+      if (!normalize(field))
+      {
+         return;
+      }
+      if ((size_ + 1) * 4 > slots_.size() * 3)
+      {
+         grow();
+      }
+      const uint64_t fingerprint = mix_hash(hash_bytes(key_scratch_));
+      Slot &slot = slots_[probe(fingerprint, key_scratch_)];
+      if (slot.row < 0)
+      {
+         slot = {fingerprint, static_cast<uint32_t>(arena_.size()), static_cast<uint32_t>(key_scratch_.size()), row};
+         arena_ += key_scratch_;
+         ++size_;
+      }
+   }
+
+private:
+   struct Slot
+   {
+      uint64_t fingerprint = 0;
+      uint32_t offset = 0; // Смещение ключа в арене
+      uint32_t length = 0;
+      int row = -1;        // -1 - свободная ячейка
+   };
+
+   bool normalize(std::string_view field)
+   {
+      key_scratch_.clear();
+      for_each_key_byte(field, key_, [this](char c) { key_scratch_ += c; });
+      return !key_scratch_.empty();
+   }
+
+   size_t probe(uint64_t fingerprint, std::string_view key) const
+   {
+      const size_t mask = slots_.size() - 1;
+      size_t i = static_cast<size_t>(fingerprint) & mask;
+      while (slots_[i].row >= 0
+         && (slots_[i].fingerprint != fingerprint || std::string_view(arena_.data() + slots_[i].offset, slots_[i].length) != key))
+      {
+         i = (i + 1) & mask;
+      }
+      return i;
+   }
+
+   void grow()
+   {
+      std::vector<Slot> slots(std::max<size_t>(1024, slots_.size() * 2));
+      slots.swap(slots_);
+      for (const Slot &slot : slots)
+      {
+         if (slot.row >= 0)
+         {
+            // Ключи в арене различны - достаточно найти свободную ячейку
+            const size_t mask = slots_.size() - 1;
+            size_t i = static_cast<size_t>(slot.fingerprint) & mask;
+            while (slots_[i].row >= 0)
+            {
+               i = (i + 1) & mask;
+            }
+            slots_[i] = slot;
+         }
+      }
+   }
+
+   DedupKey key_;
+   std::vector<Slot> slots_; // Размер - степень двойки
+   size_t size_ = 0;
+   std::string arena_;       // Нормализованные ключи подряд
+   std::string key_scratch_;
+};
+
+/**
+ * @brief Слияние преобразованных строк с существующим файлом Google Contacts (--merge).
+ *
+ * Существующий файл читается в память целиком (поэтому он может совпадать
+ * с выходным) и индексируется по E-mail 1 - Value и Phone 1 - Value.
+ * Преобразованная строка с той же почтой (или, если почты нет, тем же
+ * телефоном) не добавляется, а дополняет метки найденного контакта;
+ * остальные строки добавляются новыми контактами. Результат записывается
+ * одним проходом: существующие контакты в исходном порядке, затем новые.
+ * Существующие контакты - представления в прочитанный файл, новые хранятся
+ * в таблице по столбцам (ContactTable), поэтому преобразованный текст после
+ * upsert() не нужен.
+ */
+class ContactMerger
+{
+public:
+   static constexpr size_t UPSERT_BATCH_SIZE = 1 << 20; // Преобразованный текст добавляется порциями ~1 МиБ
+
+   /**
+    * @brief Загружает и индексирует существующий файл контактов.
+    * @return false, если файл не удалось прочитать или в нем нет нужных столбцов.
+    */
+   bool load(const std::string &path, std::ostream &diag)
+   {
+      MappedFile file;
+      if (!file.open(path))
+      {
+         diag << "Ошибка: Не удалось открыть файл контактов для слияния: " << path << std::endl;
+         return false;
+      }
+      text_.assign(file.data(), file.size());
+
+      const char *cursor = text_.data();
+      const char *const end = cursor + text_.size();
+      CsvRecord record;
+      bool has_header = false;
+      while (read_next_record(cursor, end, record))
+      {
+         if (record.text.empty())
+         {
+            continue;
+         }
+         if (!has_header)
+         {
+            has_header = true;
+            header_ = record.text;
+            read_header(record);
+            if (labels_column_ < 0 || (email_column_ < 0 && phone_column_ < 0))
+            {
+               diag << "Ошибка: В файле " << path << " нет столбцов Labels и E-mail 1 - Value или Phone 1 - Value." << std::endl;
+               return false;
+            }
+            continue;
+         }
+         split_csv_record(record, fields_, field_scratch_);
+         add_contact(record.text, false, fields_, email_column_, phone_column_);
+      }
+      if (!has_header)
+      {
+         diag << "Ошибка: Файл контактов для слияния пуст: " << path << std::endl;
+         return false;
+      }
+      existing_count_ = contacts_.size();
+      return true;
+   }
+
+   /**
+    * @brief Добавляет преобразованные строки (23 столбца Google Contacts, без заголовка).
+    *
+    * Может вызываться несколько раз подряд для последовательных порций строк.
+    * @return false, если новые контакты не поместились в таблицу.
+    */
+   bool upsert(std::string_view converted, std::ostream &diag)
+   {
+      const char *cursor = converted.data();
+      const char *const end = cursor + converted.size();
+      CsvRecord record;
+      while (read_next_record(cursor, end, record))
+      {
+         split_csv_record(record, fields_, field_scratch_);
+         if (!add_contact(record.text, true, fields_, OUTPUT_IDX_EMAIL1, OUTPUT_IDX_PHONE1))
+         {
+            diag << "Ошибка: Слишком много новых контактов для слияния." << std::endl;
+            return false;
+         }
+      }
+      return true;
+   }
+
+   /**
+    * @brief Записывает BOM, заголовок существующего файла и все контакты.
+    */
+   void write(CsvWriter &out)
+   {
+      out.write_raw("\xEF\xBB\xBF");
+      out.write_raw(trim_bom(header_));
+      out.end_row();
+      for (const Contact &contact : contacts_)
+      {
+         if (contact.converted)
+         {
+            // Новый контакт - из таблицы, в порядке столбцов существующего файла
+            if (contact.labels < 0 && same_layout_)
+            {
+               added_.write_row(contact.row, out);
+               continue;
+            }
+            for (size_t j = 0; j < column_map_.size(); ++j)
+            {
+               if (j > 0)
+               {
+                  out.put(',');
+               }
+               const int source = column_map_[j];
+               if (static_cast<int>(j) == labels_column_ && contact.labels >= 0)
+               {
+                  out.write_field(labels_[contact.labels]);
+               }
+               else if (source >= 0)
+               {
+                  out.write_field(added_.field(contact.row, static_cast<size_t>(source)));
+               }
+            }
+            out.end_row();
+            continue;
+         }
+         if (contact.labels < 0)
+         {
+            out.write_raw(contact.text);
+            out.end_row();
+            continue;
+         }
+         parse_csv_line(contact.text, fields_, field_scratch_);
+         const size_t columns = std::max(fields_.size(), static_cast<size_t>(labels_column_) + 1);
+         for (size_t j = 0; j < columns; ++j)
+         {
+            if (j > 0)
+            {
+               out.put(',');
+            }
+            if (static_cast<int>(j) == labels_column_)
+            {
+               out.write_field(labels_[contact.labels]);
+            }
+            else if (j < fields_.size())
+            {
+               out.write_field(fields_[j]);
+            }
+         }
+         out.end_row();
+      }
+   }
+
+   size_t updated_count() const { return updated_count_; }
+   size_t added_count() const { return contacts_.size() - existing_count_; }
+
+private:
+   // Столбцы преобразованной строки (см. default_mapping_spec)
+   static constexpr int OUTPUT_IDX_LABELS = 16;
+   static constexpr int OUTPUT_IDX_EMAIL1 = 18;
+   static constexpr int OUTPUT_IDX_PHONE1 = 22;
+
+   struct Contact
+   {
+      std::string_view text; // Запись существующего файла без перевода строки
+      bool converted;        // Строка из преобразования (столбцы OUTPUT_HEADER, в added_)
+      size_t row = 0;        // Номер строки в added_ для преобразованной строки
+      int labels = -1;       // Номер обновленного значения Labels в labels_ или -1
+   };
+
+   static std::string_view trim_bom(std::string_view text)
+   {
+      return text.substr(0, 3) == "\xEF\xBB\xBF" ? text.substr(3) : text;
+   }
+
+   void read_header(const CsvRecord &record)
+   {
+      split_csv_record(record, fields_, field_scratch_);
+      // Свой буфер: поля заголовка в кавычках ссылаются в field_scratch_
+      std::vector<std::string_view> output_columns;
+      std::string output_scratch;
+      parse_csv_line(OUTPUT_HEADER, output_columns, output_scratch);
+      column_map_.assign(fields_.size(), -1);
+      for (size_t j = 0; j < fields_.size(); ++j)
+      {
+         const std::string_view name = trim_column_name(fields_[j]);
+         const auto it = std::find(output_columns.begin(), output_columns.end(), name);
+         if (it != output_columns.end())
+         {
+            column_map_[j] = static_cast<int>(it - output_columns.begin());
+         }
+      }
+      auto existing_column = [&](int output) -> int
+      {
+         const auto it = std::find(column_map_.begin(), column_map_.end(), output);
+         return it == column_map_.end() ? -1 : static_cast<int>(it - column_map_.begin());
+      };
+      labels_column_ = existing_column(OUTPUT_IDX_LABELS);
+      email_column_ = existing_column(OUTPUT_IDX_EMAIL1);
+      phone_column_ = existing_column(OUTPUT_IDX_PHONE1);
+      same_layout_ = trim_bom(record.text) == OUTPUT_HEADER;
+   }
+
+   bool add_contact(std::string_view text, bool converted, const std::vector<std::string_view> &fields, int email_column, int phone_column)
+   {
+      auto field = [&](int column) { return column >= 0 && static_cast<size_t>(column) < fields.size() ? fields[column] : std::string_view(); };
+      const std::string_view email = field(email_column);
+      const std::string_view phone = field(phone_column);
+      if (converted)
+      {
+         // Контакт ищется по почте, а если ее нет - по телефону
+         const int found = dedup_fingerprint(email, DedupKey::Email) != 0 ? email_index_.find(email) : phone_index_.find(phone);
+         if (found >= 0)
+         {
+            ++updated_count_;
+            add_labels(found, field(OUTPUT_IDX_LABELS));
+            return true;
+         }
+      }
+      // Существующие контакты сохраняются все, даже с повторяющимися ключами
+      const int row = static_cast<int>(contacts_.size());
+      if (converted)
+      {
+         if (!added_.add_row(fields))
+         {
+            return false;
+         }
+         contacts_.push_back({std::string_view(), true, added_.rows() - 1});
+      }
+      else
+      {
+         contacts_.push_back({text, false});
+      }
+      email_index_.insert(email, row);
+      phone_index_.insert(phone, row);
+      return true;
+   }
+
+   /**
+    * @brief Дописывает к меткам контакта недостающие метки (разделитель " ::: ").
+    *
+    * Новое значение собирается в буфере и, если изменилось, копируется в
+    * арену меток; прежнее значение остается в арене до конца слияния.
+    */
+   void add_labels(int row, std::string_view added)
+   {
+      Contact &contact = contacts_[row];
+      if (contact.labels < 0)
+      {
+         std::string_view current;
+         if (contact.converted)
+         {
+            current = added_.field(contact.row, OUTPUT_IDX_LABELS);
+         }
+         else
+         {
+            // Поля added - представления в fields_/field_scratch_, поэтому разбор в отдельные буферы
+            parse_csv_line(contact.text, label_fields_, label_scratch_);
+            const size_t column = static_cast<size_t>(labels_column_);
+            current = column < label_fields_.size() ? label_fields_[column] : std::string_view();
+         }
+         labels_.push_back(label_arena_.copy(current));
+         contact.labels = static_cast<int>(labels_.size() - 1);
+      }
+      std::string &labels = labels_scratch_;
+      labels.assign(labels_[contact.labels]);
+      const std::string_view SEPARATOR = " ::: ";
+      size_t begin = 0;
+      while (!added.empty() && begin <= added.size())
+      {
+         size_t next = added.find(SEPARATOR, begin);
+         if (next == std::string_view::npos)
+         {
+            next = added.size();
+         }
+         const std::string_view label = trim_column_name(added.substr(begin, next - begin));
+         begin = next + SEPARATOR.size();
+         if (label.empty() || has_label(labels, label))
+         {
+            continue;
+         }
+         if (!labels.empty())
+         {
+            labels += SEPARATOR;
+         }
+         labels += label;
+      }
+      if (labels.size() != labels_[contact.labels].size())
+      {
+         labels_[contact.labels] = label_arena_.copy(labels);
+      }
+   }
+
+   static bool has_label(std::string_view labels, std::string_view label)
+   {
+      const std::string_view SEPARATOR = " ::: ";
+      size_t begin = 0;
+      while (begin <= labels.size())
+      {
+         size_t next = labels.find(SEPARATOR, begin);
+         if (next == std::string_view::npos)
+         {
+            next = labels.size();
+         }
+         if (trim_column_name(labels.substr(begin, next - begin)) == label)
+         {
+            return true;
+         }
+         begin = next + SEPARATOR.size();
+      }
+      return false;
+   }
+
+   std::string text_;                 // Содержимое существующего файла (строки - представления внутрь)
+   std::string_view header_;
+   std::vector<int> column_map_;      // Для столбца существующего файла - номер столбца OUTPUT_HEADER или -1
+   bool same_layout_ = false;         // Заголовок совпадает с OUTPUT_HEADER
+   int labels_column_ = -1;
+   int email_column_ = -1;
+   int phone_column_ = -1;
+   std::vector<Contact> contacts_;
+   ContactTable added_{NUM_OUTPUT_COLUMNS}; // Новые контакты из преобразования
+   std::vector<std::string_view> labels_; // Обновленные значения Labels (в label_arena_)
+   Arena label_arena_;
+   std::string labels_scratch_;
+   std::vector<std::string_view> label_fields_;
+   std::string label_scratch_;
+   size_t existing_count_ = 0;
+   size_t updated_count_ = 0;
+   ContactKeyIndex email_index_{DedupKey::Email};
+   ContactKeyIndex phone_index_{DedupKey::Phone};
+   std::vector<std::string_view> fields_;
+   std::string field_scratch_;
+};
+
+
+// --- Инкрементальное преобразование ---
+
+/**
+ * @brief Состояние прошлого прохода --incremental (файл "<выход>.state").
+ *
+ * По нему следующий запуск начинает чтение сразу с первой новой записи.
+ * Выгрузка считается той же, если совпадает хеш заголовка и хеш последних
+ * INCREMENTAL_TAIL_WINDOW байтов перед offset (проверка всего префикса
+ * стоила бы столько же, сколько полный проход).
+ */
+struct IncrementalState
+{
+   uint64_t offset = 0;       // Конец последней обработанной записи (байт от начала файла)
+   int next_line_number = 1;  // Номер строки, с которой начинается следующая запись
+   uint64_t header_hash = 0;  // Хеш заголовка входного файла
+   uint64_t tail_hash = 0;    // Хеш байтов перед offset
+};
+
+const size_t INCREMENTAL_TAIL_WINDOW = 4096;
+
+/**
+ * @brief Имя файла состояния для выходного файла.
+ */
+std::string incremental_state_path(const std::string &output_filename)
+{
+   return output_filename + ".state";
+}
+
+/**
+ * @brief Читает size байтов файла, начиная с offset.
+ * @return false, если файл не открылся или закончился раньше.
+ */
+bool read_file_range(const std::string &path, uint64_t offset, size_t size, std::string &bytes)
+{
+   FileByteSource source;
+   if (!source.open(path) || !source.seek(offset))
+   {
+      return false;
+   }
+   bytes.resize(size);
+   size_t done = 0;
+   while (done < size)
+   {
+      const size_t bytes_read = source.read(&bytes[done], size - done);
+      if (bytes_read == 0)
+      {
+         return false;
+      }
+      done += bytes_read;
+   }
+   return true;
+}
+
+/**
+ * @brief Хеш до INCREMENTAL_TAIL_WINDOW байтов файла, предшествующих offset.
+ *
+ * @param terminated Выходной параметр: предшествующий offset байт - перевод строки (или offset = 0).
+ */
+bool hash_file_tail(const std::string &path, uint64_t offset, uint64_t &hash, bool &terminated)
+{
+   const uint64_t start = offset > INCREMENTAL_TAIL_WINDOW ? offset - INCREMENTAL_TAIL_WINDOW : 0;
+   std::string tail;
+   if (!read_file_range(path, start, static_cast<size_t>(offset - start), tail))
+   {
+      return false;
+   }
+   hash = hash_bytes(tail);
+   terminated = tail.empty() || tail.back() == '\n';
+   return true;
+}
+
+/**
+ * @brief Загружает состояние прошлого прохода.
+ * @return false, если файла нет или он поврежден.
+ */
+bool load_incremental_state(const std::string &path, IncrementalState &state)
+{
+   std::error_code error;
+   if (!std::filesystem::exists(path, error))
+   {
+      return false;
+   }
+   MappedFile file;
+   if (!file.open(path))
+   {
+      return false;
+   }
+   std::istringstream text(std::string(file.data(), file.size()));
+   std::string magic;
+   text >> magic >> state.offset >> state.next_line_number >> std::hex >> state.header_hash >> state.tail_hash;
+   return !text.fail() && magic == "bz4-state-1" && state.next_line_number > 0;
+}
+
+/**
+ * @brief Сохраняет состояние (через временный файл, чтобы прерванная запись не испортила старое).
+ */
+bool save_incremental_state(const std::string &path, const IncrementalState &state)
+{
+   const std::string temp_path = path + ".tmp";
+   std::FILE *file = std::fopen(temp_path.c_str(), "wb");
+   if (file == nullptr)
+   {
+      return false;
+   }
+   const int written = std::fprintf(file, "bz4-state-1\n%llu %d\n%016llx %016llx\n",
+      static_cast<unsigned long long>(state.offset), state.next_line_number,
+      static_cast<unsigned long long>(state.header_hash), static_cast<unsigned long long>(state.tail_hash));
+   if (std::fclose(file) != 0 || written < 0)
+   {
+      return false;
+   }
+   std::error_code error;
+   std::filesystem::rename(temp_path, path, error);
+   return !error;
+}
+
+/**
+ * @brief Определяет, можно ли продолжить с места, где остановился прошлый проход.
+ *
+ * @param input_size Текущий размер входного файла.
+ * @param header_hash Хеш заголовка текущего входного файла.
+ * @param resume_offset Выходной параметр: байт, с которого начинаются новые записи.
+ * @return true, если выгрузка - продолжение прежней; иначе (с предупреждением) нужен полный проход.
+ */
+bool can_resume(const IncrementalState &state, const std::string &input_filename, uint64_t input_size, uint64_t header_hash,
+   uint64_t &resume_offset, std::ostream &diag)
+{
+   uint64_t tail_hash = 0;
+   bool terminated = true;
+   const char *reason = nullptr;
+   if (state.header_hash != header_hash)
+   {
+      reason = "изменился заголовок";
+   }
+   else if (state.offset > input_size)
+   {
+      reason = "файл стал короче";
+   }
+   else if (!hash_file_tail(input_filename, state.offset, tail_hash, terminated) || tail_hash != state.tail_hash)
+   {
+      reason = "изменились ранее обработанные строки";
+   }
+   resume_offset = state.offset;
+   if (reason == nullptr && !terminated && resume_offset < input_size)
+   {
+      // Последняя запись прошлого прохода была без перевода строки: теперь
+      // за ней должен идти перевод строки, иначе эта запись дописывалась
+      std::string next;
+      if (!read_file_range(input_filename, resume_offset, static_cast<size_t>(std::min<uint64_t>(2, input_size - resume_offset)), next))
+      {
+         reason = "не удалось прочитать файл";
+      }
+      else
+      {
+         if (next[0] == '\r' && next.size() > 1 && next[1] == '\n')
+         {
+            resume_offset += 2;
+         }
+         else if (next[0] == '\n')
+         {
+            resume_offset += 1;
+         }
+         else
+         {
+            reason = "изменилась последняя обработанная строка";
+         }
+      }
+   }
+   if (reason != nullptr)
+   {
+      diag << "Предупреждение: Инкрементальный режим: " << reason << " - выполняется полное преобразование." << std::endl;
+      return false;
+   }
+   return true;
+}
+
+
+// --- Разбиение вывода на части ---
+
+/**
+ * @brief Имя части выходного файла: "contacts.csv" -> "contacts_001.csv".
+ *
+ * @param output_filename Имя выходного файла из командной строки.
+ * @param number Номер части, начиная с 1.
+ */
+std::string shard_filename(const std::string &output_filename, size_t number)
+{
+   const std::filesystem::path path(output_filename);
+   char suffix[32];
+   std::snprintf(suffix, sizeof(suffix), "_%03zu", number);
+   std::filesystem::path shard = path.parent_path() / (path.stem().string() + suffix + path.extension().string());
+   return shard.string();
+}
+
+/**
+ * @brief Потоки записи блоков в файлы для вывода из нескольких файлов.
+ *
+ * Блоки одного файла должны ставиться в очередь одного и того же потока
+ * (порядок блоков внутри файла сохраняется); разные потоки пишут
+ * параллельно с преобразованием и друг с другом. Поток держит открытым не
+ * больше одного файла, поэтому открытых файлов не больше WRITER_COUNT, сколько
+ * бы файлов ни создавалось. Очередь каждого потока ограничена, поэтому
+ * память не зависит от объема вывода.
+ */
+class FileWriterPool
+{
+public:
+   static constexpr size_t WRITER_COUNT = 2;
+   static constexpr size_t MAX_QUEUED_BLOCKS = 4; // На один поток писателя
+
+   struct Block
+   {
+      std::string path;    // Непусто, если перед блоком файл открывается
+      bool append = false; // Открыть для дописывания, а не создать заново
+      std::string data;
+      bool last = false;   // После блока файл закрывается
+   };
+
+   FileWriterPool()
+   {
+      for (Writer &writer : writers_)
+      {
+         writer.thread = std::thread([this, &writer] { run_writer(writer); });
+      }
+   }
+
+   ~FileWriterPool()
+   {
+      for (Writer &writer : writers_)
+      {
+         {
+            std::lock_guard<std::mutex> lock(writer.mutex);
+            writer.stop = true;
+         }
+         writer.ready.notify_all();
+      }
+      for (Writer &writer : writers_)
+      {
+         writer.thread.join();
+      }
+   }
+
+   FileWriterPool(const FileWriterPool &) = delete;
+   FileWriterPool &operator=(const FileWriterPool &) = delete;
+
+   /**
+    * @brief Ставит блок в очередь потока (номер берется по модулю WRITER_COUNT).
+    *
+    * Ждет, если очередь потока заполнена.
+    */
+   void enqueue(size_t writer_index, Block block)
+   {
+      Writer &writer = writers_[writer_index % WRITER_COUNT];
+      std::unique_lock<std::mutex> lock(writer.mutex);
+      writer.space.wait(lock, [&] { return writer.queue.size() < MAX_QUEUED_BLOCKS; });
+      writer.queue.push_back(std::move(block));
+      lock.unlock();
+      writer.ready.notify_one();
+   }
+
+   /**
+    * @brief Дожидается записи всех поставленных блоков.
+    * @return Первый файл, который не удалось записать, или пустая строка.
+    */
+   std::string finish()
+   {
+      for (Writer &writer : writers_)
+      {
+         std::unique_lock<std::mutex> lock(writer.mutex);
+         writer.space.wait(lock, [&] { return writer.queue.empty() && !writer.busy; });
+      }
+      std::lock_guard<std::mutex> lock(failure_mutex_);
+      return failed_path_;
+   }
+
+private:
+   struct Writer
+   {
+      std::thread thread;
+      std::mutex mutex;
+      std::condition_variable ready; // Появился блок или пора завершаться
+      std::condition_variable space; // Очередь освободилась
+      std::deque<Block> queue;
+      bool busy = false;
+      bool stop = false;
+   };
+
+   void run_writer(Writer &writer)
+   {
+      std::FILE *file = nullptr;
+      std::string path;
+      bool failed = false;
+      for (;;)
+      {
+         Block block;
+         {
+            std::unique_lock<std::mutex> lock(writer.mutex);
+            writer.ready.wait(lock, [&] { return !writer.queue.empty() || writer.stop; });
+            if (writer.queue.empty())
+            {
+               break;
+            }
+            block = std::move(writer.queue.front());
+            writer.queue.pop_front();
+            writer.busy = true;
+         }
+         writer.space.notify_all();
+
+         if (!block.path.empty())
+         {
+            path = std::move(block.path);
+            file = std::fopen(path.c_str(), block.append ? "ab" : "wb");
+            failed = file == nullptr;
+         }
+         if (file != nullptr && std::fwrite(block.data.data(), 1, block.data.size(), file) != block.data.size())
+         {
+            failed = true;
+         }
+         if (block.last && file != nullptr)
+         {
+            failed = std::fclose(file) != 0 || failed;
+            file = nullptr;
+         }
+         if (failed && block.last)
+         {
+            std::lock_guard<std::mutex> lock(failure_mutex_);
+            if (failed_path_.empty())
+            {
+               failed_path_ = path;
+            }
+         }
+
+         {
+            std::lock_guard<std::mutex> lock(writer.mutex);
+            writer.busy = false;
+         }
+         writer.space.notify_all();
+      }
+      if (file != nullptr)
+      {
+         std::fclose(file);
+      }
+   }
+
+   std::array<Writer, WRITER_COUNT> writers_;
+   std::mutex failure_mutex_;
+   std::string failed_path_; // Первый файл, который не удалось записать
+};
+
+/**
+ * @brief Вывод, разбитый на части по количеству строк и/или размеру
+ * (--max-rows-per-file, --max-bytes-per-file).
+ *
+ * Преобразованные строки пишутся в писатель в памяти rows(); на границах
+ * строк commit() разрезает накопленное на части. Каждая часть начинается
+ * с BOM и заголовка. Запись частей в файлы выполняет FileWriterPool:
+ * часть целиком закреплена за одним потоком, а разные части пишутся
+ * параллельно с преобразованием и друг с другом.
+ */
+class ShardedOutput
+{
+public:
+   static constexpr size_t COMMIT_THRESHOLD = 1 << 20;  // Сколько строк копить перед разрезанием
+   static constexpr size_t WRITE_BLOCK_SIZE = 4 << 20;  // Размер блока, передаваемого писателю
+
+   /**
+    * @param output_filename Имя выходного файла, из которого получаются имена частей.
+    * @param max_rows Максимум строк данных в части (0 - без ограничения).
+    * @param max_bytes Максимальный размер части вместе с BOM и заголовком (0 - без ограничения).
+    */
+   ShardedOutput(std::string output_filename, size_t max_rows, size_t max_bytes)
+      : output_filename_(std::move(output_filename)), max_rows_(max_rows), max_bytes_(max_bytes), rows_(COMMIT_THRESHOLD * 2)
+   {
+   }
+
+   ShardedOutput(const ShardedOutput &) = delete;
+   ShardedOutput &operator=(const ShardedOutput &) = delete;
+
+   /**
+    * @brief Писатель в памяти для преобразованных строк.
+    */
+   CsvWriter &rows() { return rows_; }
+
+   /**
+    * @brief Разрезает накопленные строки на части, если их набралось достаточно.
+    *
+    * Вызывается только на границе строк (после целой записи или участка).
+    */
+   void commit()
+   {
+      if (rows_.size() >= COMMIT_THRESHOLD)
+      {
+         distribute();
+      }
+   }
+
+   /**
+    * @brief Записывает оставшиеся строки, завершает последнюю часть и дожидается писателей.
+    *
+    * @return false, если какую-либо часть не удалось создать или записать.
+    */
+   bool close(std::ostream &diag)
+   {
+      distribute();
+      if (shard_count_ == 0)
+      {
+         start_shard(); // Вход без строк данных: одна часть с заголовком
+      }
+      finish_shard();
+      const std::string failed_path = writers_.finish();
+      if (!failed_path.empty())
+      {
+         diag << "Ошибка: Не удалось записать выходной файл: " << failed_path << std::endl;
+         return false;
+      }
+      // Лишние части прошлого запуска с тем же именем импортировались бы вместе с новыми
+      std::error_code error;
+      const std::string stale = shard_filename(output_filename_, shard_count_ + 1);
+      if (std::filesystem::exists(stale, error))
+      {
+         diag << "Предупреждение: Остался файл от прошлого запуска: " << stale << " (не относится к текущему выводу)." << std::endl;
+      }
+      return true;
+   }
+
+   /**
+    * @brief Количество созданных частей.
+    */
+   size_t shard_count() const { return shard_count_; }
+
+   /**
+    * @brief Суммарный размер частей в байтах.
+    */
+   uint64_t bytes_written() const { return bytes_written_; }
+
+private:
+   /**
+    * @brief Распределяет накопленные строки по частям и очищает буфер строк.
+    */
+   void distribute()
+   {
+      const char *cursor = rows_.data();
+      const char *const end = cursor + rows_.size();
+      const char *run = cursor; // Начало строк, еще не добавленных в текущую часть
+      // Перевод строки внутри поля всегда в кавычках: без кавычек в буфере
+      // каждая строка заканчивается первым '\n' и полный разбор CSV не нужен
+      const bool quoted = std::memchr(cursor, '"', rows_.size()) != nullptr;
+      CsvRecord record;
+      while (cursor < end)
+      {
+         const char *const row = cursor;
+         if (quoted)
+         {
+            read_next_record(cursor, end, record);
+         }
+         else
+         {
+            const void *newline = std::memchr(cursor, '\n', static_cast<size_t>(end - cursor));
+            cursor = newline != nullptr ? static_cast<const char *>(newline) + 1 : end;
+         }
+         const size_t row_size = static_cast<size_t>(cursor - row);
+         if (shard_count_ == 0 || (shard_rows_ > 0 && ((max_rows_ != 0 && shard_rows_ >= max_rows_)
+            || (max_bytes_ != 0 && shard_bytes_ + row_size > max_bytes_))))
+         {
+            append(std::string_view(run, static_cast<size_t>(row - run)));
+            run = row;
+            if (shard_count_ != 0)
+            {
+               finish_shard();
+            }
+            start_shard();
+         }
+         ++shard_rows_;
+         shard_bytes_ += row_size;
+      }
+      append(std::string_view(run, static_cast<size_t>(end - run)));
+      rows_.clear();
+   }
+
+   void start_shard()
+   {
+      ++shard_count_;
+      shard_rows_ = 0;
+      pending_path_ = shard_filename(output_filename_, shard_count_);
+      block_.assign("\xEF\xBB\xBF");
+      block_ += OUTPUT_HEADER;
+      block_ += '\n';
+      shard_bytes_ = block_.size();
+      bytes_written_ += block_.size();
+   }
+
+   void append(std::string_view data)
+   {
+      bytes_written_ += data.size();
+      block_.append(data.data(), data.size());
+      if (block_.size() >= WRITE_BLOCK_SIZE)
+      {
+         enqueue(false);
+      }
+   }
+
+   void finish_shard()
+   {
+      enqueue(true);
+   }
+
+   /**
+    * @brief Передает накопленный блок текущей части ее потоку писателя.
+    */
+   void enqueue(bool last)
+   {
+      FileWriterPool::Block block{std::move(pending_path_), false, std::move(block_), last};
+      pending_path_.clear();
+      block_.clear();
+      writers_.enqueue(shard_count_ - 1, std::move(block));
+   }
+
+   const std::string output_filename_;
+   const size_t max_rows_;
+   const size_t max_bytes_;
+   CsvWriter rows_;          // Преобразованные строки, еще не распределенные по частям
+   std::string block_;       // Текущий блок текущей части
+   std::string pending_path_; // Имя файла, если блок - первый в части
+   size_t shard_count_ = 0;
+   size_t shard_rows_ = 0;   // Строк данных в текущей части
+   size_t shard_bytes_ = 0;  // Байтов в текущей части (с BOM и заголовком)
+   uint64_t bytes_written_ = 0;
+   FileWriterPool writers_;  // Последний член: потоки завершаются до уничтожения остальных
+};
+
+/**
+ * @brief Имя файла группы в каталоге --split-by-group: "ПМ-35.csv".
+ *
+ * Символы, недопустимые в именах файлов Windows, и управляющие заменяются
+ * на '_', точки и пробелы в конце убираются, к зарезервированным именам
+ * (CON, NUL, COM1...) добавляется '_'. Строки без группы попадают в
+ * "без_группы.csv".
+ *
+ * @param group Группа из Last Name.
+ * @return Имя файла без каталога.
+ */
+std::string group_filename(std::string_view group)
+{
+   std::string name;
+   name.reserve(group.size() + 5);
+   for (char c : group)
+   {
+      const bool invalid = static_cast<unsigned char>(c) < 0x20 || std::strchr("<>:\"/\\|?*", c) != nullptr;
+      name += invalid ? '_' : c;
+   }
+   while (!name.empty() && (name.back() == '.' || name.back() == ' '))
+   {
+      name.pop_back();
+   }
+   if (name.empty())
+   {
+      name = "без_группы";
+   }
+   static const char *const RESERVED[] = {"CON", "PRN", "AUX", "NUL", "COM1", "COM2", "COM3", "COM4", "COM5",
+      "COM6", "COM7", "COM8", "COM9", "LPT1", "LPT2", "LPT3", "LPT4", "LPT5", "LPT6", "LPT7", "LPT8", "LPT9"};
+   for (const char *reserved : RESERVED)
+   {
+      const size_t size = std::strlen(reserved);
+      if (name.size() == size && std::equal(name.begin(), name.end(), reserved,
+         [](char a, char b) { return NAME_CASE.upper[static_cast<unsigned char>(a) & 0x7F] == static_cast<unsigned char>(b); }))
+      {
+         name += '_';
+         break;
+      }
+   }
+   return name + ".csv";
+}
+
+/**
+ * @brief Вывод, разбитый на файлы по группам (--split-by-group КАТАЛОГ).
+ *
+ * Преобразованные строки пишутся в писатель в памяти rows(); на границах
+ * строк commit() раскладывает накопленное по буферам групп (группа - из
+ * Last Name "Группа Фамилия"). Буфер группы сбрасывается в ее файл, когда
+ * набирает GROUP_BLOCK_SIZE, когда все буферы вместе превышают
+ * MAX_PENDING_BYTES, и при закрытии. Каждый сброс - отдельный блок
+ * FileWriterPool, который открывает файл, дописывает и сразу закрывает его:
+ * тысячи мелких групп не держат тысячи открытых файлов, а открытие и
+ * закрытие выполняются потоками писателей параллельно с преобразованием.
+ * Группа закреплена за одним потоком, поэтому порядок строк в файле группы
+ * совпадает с порядком вывода. Первый блок группы создает файл с BOM и
+ * заголовком.
+ *
+ * Группы, отличающиеся только регистром ("пм-35" и "ПМ-35"), пишутся в
+ * один файл (с именем по первому написанию): в Windows это один и тот же файл.
+ */
+class GroupSplitOutput
+{
+public:
+   static constexpr size_t COMMIT_THRESHOLD = 1 << 20;     // Сколько строк копить перед раскладкой
+   static constexpr size_t GROUP_BLOCK_SIZE = 256 << 10;   // Буфер группы, после которого он сбрасывается
+   static constexpr size_t MAX_PENDING_BYTES = 32 << 20;   // Все буферы групп вместе
+
+   /**
+    * @param directory Каталог для файлов групп (создается при open()).
+    */
+   explicit GroupSplitOutput(std::string directory)
+      : directory_(std::move(directory)), rows_(COMMIT_THRESHOLD * 2)
+   {
+   }
+
+   GroupSplitOutput(const GroupSplitOutput &) = delete;
+   GroupSplitOutput &operator=(const GroupSplitOutput &) = delete;
+
+   /**
+    * @brief Создает каталог для файлов групп.
+    *
+    * @return false, если каталог не удалось создать.
+    */
+   bool open(std::ostream &diag)
+   {
+      std::error_code error;
+      std::filesystem::create_directories(directory_, error);
+      if (error || !std::filesystem::is_directory(directory_, error))
+      {
+         diag << "Ошибка: Не удалось создать каталог для файлов групп: " << directory_ << std::endl;
+         return false;
+      }
+      return true;
+   }
+
+   /**
+    * @brief Писатель в памяти для преобразованных строк.
+    */
+   CsvWriter &rows() { return rows_; }
+
+   /**
+    * @brief Раскладывает накопленные строки по группам, если их набралось достаточно.
+    *
+    * Вызывается только на границе строк (после целой записи или участка).
+    */
+   void commit()
+   {
+      if (rows_.size() >= COMMIT_THRESHOLD)
+      {
+         distribute();
+      }
+   }
+
+   /**
+    * @brief Раскладывает оставшиеся строки, сбрасывает все буферы и дожидается писателей.
+    *
+    * @return false, если какой-либо файл группы не удалось создать или записать.
+    */
+   bool close(std::ostream &diag)
+   {
+      distribute();
+      flush_all();
+      const std::string failed_path = writers_.finish();
+      if (!failed_path.empty())
+      {
+         diag << "Ошибка: Не удалось записать выходной файл: " << failed_path << std::endl;
+         return false;
+      }
+      return true;
+   }
+
+   /**
+    * @brief Количество файлов групп.
+    */
+   size_t file_count() const { return groups_.size(); }
+
+   /**
+    * @brief Суммарный размер файлов групп в байтах.
+    */
+   uint64_t bytes_written() const { return bytes_written_; }
+
+private:
+   struct Group
+   {
+      std::string path;     // Полный путь к файлу группы
+      std::string pending;  // Строки, еще не переданные писателю
+      bool created = false; // Файл уже создан (следующие блоки дописываются)
+   };
+
+   /**
+    * @brief Распределяет накопленные строки по буферам групп и очищает буфер строк.
+    */
+   void distribute()
+   {
+      const size_t LAST_NAME = 2; // Номер столбца Last Name в OUTPUT_HEADER
+      const char *cursor = rows_.data();
+      const char *const end = cursor + rows_.size();
+      CsvRecord record;
+      size_t current = SIZE_MAX; // Группа предыдущей строки: строки одной группы обычно идут подряд
+      while (cursor < end)
+      {
+         const char *const row = cursor;
+         read_next_record(cursor, end, record);
+         std::string_view group;
+         std::string_view last_name;
+         splitGroupLastName(csv_record_field(record, LAST_NAME, field_scratch_), group, last_name);
+         if (current == SIZE_MAX || group != current_group_)
+         {
+            current = find_group(group);
+            current_group_.assign(group.data(), group.size());
+         }
+         Group &target = groups_[current];
+         const size_t row_size = static_cast<size_t>(cursor - row);
+         target.pending.append(row, row_size);
+         pending_bytes_ += row_size;
+         bytes_written_ += row_size;
+         if (target.pending.size() >= GROUP_BLOCK_SIZE)
+         {
+            flush(current);
+         }
+         else if (pending_bytes_ > MAX_PENDING_BYTES)
+         {
+            flush_all();
+         }
+      }
+      rows_.clear();
+   }
+
+   /**
+    * @brief Находит группу по имени ее файла (без учета регистра) или заводит новую.
+    *
+    * Ключ - имя файла, а не название группы: группы, дающие одно имя файла
+    * ("a/b" и "a_b"), пишутся в один файл, а не затирают друг друга.
+    */
+   size_t find_group(std::string_view group)
+   {
+      key_.assign(group.data(), group.size());
+      const auto known = by_name_.find(key_);
+      if (known != by_name_.end())
+      {
+         return known->second;
+      }
+      const std::string filename = group_filename(group);
+      std::string file_key = filename;
+      upper_case_key(file_key);
+      auto found = by_file_.find(file_key);
+      if (found == by_file_.end())
+      {
+         Group created;
+         created.path = (std::filesystem::path(directory_) / filename).string();
+         groups_.push_back(std::move(created));
+         found = by_file_.emplace(std::move(file_key), groups_.size() - 1).first;
+      }
+      by_name_.emplace(key_, found->second);
+      return found->second;
+   }
+
+   /**
+    * @brief Приводит буквы ключа группы к заглавным (по таблице NAME_CASE, длина не меняется).
+    */
+   static void upper_case_key(std::string &key)
+   {
+      for (size_t i = 0; i < key.size(); ++i)
+      {
+         const unsigned char lead = static_cast<unsigned char>(key[i]);
+         if (lead < 0x80)
+         {
+            key[i] = static_cast<char>(NAME_CASE.upper[lead]);
+         }
+         else if ((lead & 0xE0) == 0xC0 && i + 1 < key.size() && (static_cast<unsigned char>(key[i + 1]) & 0xC0) == 0x80)
+         {
+            const uint16_t cp = static_cast<uint16_t>(((lead & 0x1F) << 6) | (static_cast<unsigned char>(key[i + 1]) & 0x3F));
+            if (cp < NAME_CASE_RANGE)
+            {
+               const uint16_t upper = NAME_CASE.upper[cp];
+               key[i] = static_cast<char>(0xC0 | (upper >> 6));
+               key[i + 1] = static_cast<char>(0x80 | (upper & 0x3F));
+            }
+            ++i;
+         }
+      }
+   }
+
+   /**
+    * @brief Передает буфер группы ее потоку писателя.
+    */
+   void flush(size_t index)
+   {
+      Group &group = groups_[index];
+      pending_bytes_ -= std::min(pending_bytes_, group.pending.size());
+      FileWriterPool::Block block;
+      block.path = group.path;
+      block.append = group.created;
+      block.last = true;
+      if (!group.created)
+      {
+         block.data.reserve(group.pending.size() + OUTPUT_HEADER.size() + 4);
+         block.data.assign("\xEF\xBB\xBF");
+         block.data += OUTPUT_HEADER;
+         block.data += '\n';
+         bytes_written_ += block.data.size();
+         block.data += group.pending;
+         group.pending.clear();
+         group.created = true;
+      }
+      else
+      {
+         block.data = std::move(group.pending);
+         group.pending = std::string();
+      }
+      writers_.enqueue(index, std::move(block));
+   }
+
+   /**
+    * @brief Сбрасывает буферы всех групп, в которых есть строки (и еще не созданные файлы).
+    */
+   void flush_all()
+   {
+      for (size_t i = 0; i < groups_.size(); ++i)
+      {
+         if (!groups_[i].pending.empty() || !groups_[i].created)
+         {
+            flush(i);
+         }
+      }
+      pending_bytes_ = 0;
+   }
+
+   const std::string directory_;
+   CsvWriter rows_;                  // Преобразованные строки, еще не разложенные по группам
+   std::vector<Group> groups_;       // В порядке первого появления
+   std::unordered_map<std::string, size_t> by_file_; // Имя файла (заглавными) -> номер в groups_
+   std::unordered_map<std::string, size_t> by_name_; // Название группы как в строке -> номер в groups_
+   std::string key_;                 // Буфер названия для поиска
+   std::string current_group_;       // Группа предыдущей строки
+   std::string field_scratch_;       // Буфер для Last Name в кавычках
+   size_t pending_bytes_ = 0;        // Байтов во всех буферах групп
+   uint64_t bytes_written_ = 0;
+   FileWriterPool writers_;          // Последний член: потоки завершаются до уничтожения остальных
+};
+
+
+// --- Статистика преобразования ---
+
+/**
+ * @brief Категория предупреждения о строке данных.
+ */
+enum class WarningKind : uint8_t
+{
+   EmptyLine, // Пустая строка
+   ShortRow,  // Недостаточно столбцов
+   Duplicate, // Повтор (--dedup)
+   BadPhone,  // Телефон не приведен к +7XXXXXXXXXX (--normalize-phone, --check)
+   RowError,  // Исключение при обработке строки
+   BadEmail,  // Почта неверного вида
+};
+
+const size_t WARNING_KIND_COUNT = 6;
+
+// Имена категорий в --stats-json и описания для итоговых сообщений
+const char *const WARNING_KIND_NAMES[WARNING_KIND_COUNT] = {"empty_line", "short_row", "duplicate", "bad_phone", "row_error", "bad_email"};
+const char *const WARNING_KIND_TITLES[WARNING_KIND_COUNT] = {"пустых строк", "строк с недостаточным количеством столбцов",
+   "повторов", "телефонов, не приведенных к виду +7XXXXXXXXXX", "строк с ошибками обработки", "адресов почты неверного вида"};
+
+// Заголовок файла отклоненных записей (--rejects); Reason - имя категории из WARNING_KIND_NAMES
+const std::string_view REJECTS_HEADER = "Line,Reason,Detail,Record";
+
+/**
+ * @brief Этап обработки строки для замера времени.
+ */
+enum class Stage : uint8_t
+{
+   Read,      // Поиск границ записи (чтение)
+   Parse,     // Разбор записи на поля
+   Transform, // Заполнение полей вывода по плану
+   Write,     // Форматирование и запись строки
+};
+
+const size_t STAGE_COUNT = 4;
+const char *const STAGE_NAMES[STAGE_COUNT] = {"read", "parse", "transform", "write"};
+
+/**
+ * @brief Дешевые отметки времени для замеров этапов: счетчик тактов на x86.
+ *
+ * Перевод в секунды - по калибровке относительно steady_clock за время
+ * прохода (см. ConversionStats::stage_seconds).
+ */
+inline uint64_t stage_clock()
+{
+#if BZ4_X86
+   return __rdtsc();
+#else
+   return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+/**
+ * @brief Статистика прохода: счетчики предупреждений по категориям, время
+ * этапов и объемы данных; выборка предупреждений для вывода.
+ *
+ * Предупреждения о строках не выводятся все подряд: по каждой категории
+ * показываются первые warning_limit, остальные только считаются (итог - в
+ * print_summary). Участки параллельного преобразования ведут собственную
+ * статистику без вывода (out == nullptr), а merge добавляет ее к общей в
+ * порядке участков, поэтому показанные предупреждения те же, что при
+ * последовательном проходе.
+ *
+ * Время этапов замеряется, только если timed (--stats-json), и не на каждой
+ * записи, а на каждой STAGE_SAMPLE_INTERVAL-й с пересчетом на все записи:
+ * чтение счетчика тактов (десятки наносекунд в виртуальной машине) на
+ * каждом этапе каждой строки заметно замедлило бы проход. В параллельном
+ * режиме время этапов суммируется по потокам.
+ */
+class ConversionStats
+{
+public:
+   static constexpr size_t DEFAULT_WARNING_LIMIT = 10;
+   static constexpr uint64_t STAGE_SAMPLE_INTERVAL = 16; // Замеряется каждая 16-я запись
+
+   /**
+    * @param out Куда выводить показанные предупреждения (nullptr - накапливать для merge).
+    * @param warning_limit Сколько предупреждений каждой категории показывать (0 - все).
+    * @param timed Замерять время этапов.
+    */
+   ConversionStats(std::ostream *out, size_t warning_limit, bool timed)
+      : out_(out), warning_limit_(warning_limit), timed_(timed),
+        started_(std::chrono::steady_clock::now()), started_ticks_(stage_clock())
+   {
+   }
+
+   /**
+    * @brief Учитывает предупреждение и, если оно попадает в выборку, выводит его.
+    *
+    * Текст собирается из parts только для показанных предупреждений.
+    */
+   template <typename... Parts>
+   void warn(WarningKind kind, const Parts &...parts)
+   {
+      const size_t seen = warnings_[static_cast<size_t>(kind)]++;
+      if (warning_limit_ != 0 && seen >= warning_limit_)
+      {
+         return;
+      }
+      message_.str(std::string());
+      (message_ << ... << parts);
+      emit(kind, message_.str());
+   }
+
+   /**
+    * @brief Направляет отклоненные записи в писатель (--rejects) вместо вывода предупреждений.
+    */
+   void set_rejects(CsvWriter *rejects) { rejects_ = rejects; }
+
+   bool rejecting() const { return rejects_ != nullptr; }
+
+   /**
+    * @brief Учитывает отклоненную запись и дописывает ее в файл отклоненных.
+    *
+    * Строка файла: номер строки, категория (как в --stats-json), подробности
+    * и исходная запись без изменений. Вызывается, только если rejecting().
+    */
+   void reject(WarningKind kind, int line_number, std::string_view detail, std::string_view record)
+   {
+      ++warnings_[static_cast<size_t>(kind)];
+      ++rejected_[static_cast<size_t>(kind)];
+      char number[16];
+      const int length = std::snprintf(number, sizeof(number), "%d,", line_number);
+      rejects_->write_raw(std::string_view(number, static_cast<size_t>(length)));
+      rejects_->write_raw(WARNING_KIND_NAMES[static_cast<size_t>(kind)]);
+      rejects_->put(',');
+      rejects_->write_field(detail);
+      rejects_->put(',');
+      rejects_->write_field(record);
+      rejects_->end_row();
+   }
+
+   /**
+    * @brief Начинает отсчет этапов (перед чтением первой записи прохода или участка).
+    */
+   void start_stages()
+   {
+      sampling_ = timed_;
+      if (sampling_)
+      {
+         mark_ = stage_clock();
+      }
+   }
+
+   /**
+    * @brief Относит время с конца предыдущего этапа к stage; с этого момента идет следующий.
+    *
+    * Этапы записи идут подряд (чтение, разбор, преобразование, запись),
+    * поэтому на один этап - одно чтение счетчика, и только у замеряемых записей.
+    */
+   void lap(Stage stage)
+   {
+      if (sampling_)
+      {
+         const uint64_t now = stage_clock();
+         ticks_[static_cast<size_t>(stage)] += now - mark_;
+         mark_ = now;
+      }
+   }
+
+   /**
+    * @brief Завершает запись и решает, замерять ли следующую.
+    */
+   void end_record()
+   {
+      if (!timed_)
+      {
+         return;
+      }
+      sampled_records_ += sampling_ ? 1 : 0;
+      sampling_ = ++stage_records_ % STAGE_SAMPLE_INTERVAL == 0;
+      if (sampling_)
+      {
+         mark_ = stage_clock();
+      }
+   }
+
+   /**
+    * @brief Добавляет статистику участка (в порядке участков).
+    */
+   void merge(const ConversionStats &chunk)
+   {
+      std::array<size_t, WARNING_KIND_COUNT> taken{};
+      for (const Sample &sample : chunk.samples_)
+      {
+         const size_t index = static_cast<size_t>(sample.kind);
+         if (warning_limit_ == 0 || warnings_[index] + taken[index] < warning_limit_)
+         {
+            emit(sample.kind, sample.text);
+         }
+         ++taken[index];
+      }
+      if (rejects_ != nullptr && chunk.rejects_ != nullptr)
+      {
+         rejects_->write_raw(std::string_view(chunk.rejects_->data(), chunk.rejects_->size()));
+      }
+      for (size_t i = 0; i < WARNING_KIND_COUNT; ++i)
+      {
+         warnings_[i] += chunk.warnings_[i];
+         rejected_[i] += chunk.rejected_[i];
+      }
+      for (size_t i = 0; i < STAGE_COUNT; ++i)
+      {
+         ticks_[i] += chunk.ticks_[i];
+      }
+      stage_records_ += chunk.stage_records_;
+      sampled_records_ += chunk.sampled_records_;
+      records += chunk.records;
+   }
+
+   /**
+    * @brief Выводит итоги по категориям, где показаны не все предупреждения.
+    *
+    * Записи, ушедшие в файл отклоненных, в этих итогах не учитываются.
+    */
+   void print_summary(std::ostream &out) const
+   {
+      for (size_t i = 0; i < WARNING_KIND_COUNT; ++i)
+      {
+         const size_t reported = warnings_[i] - rejected_[i];
+         if (warning_limit_ != 0 && reported > warning_limit_)
+         {
+            out << "Предупреждение: Всего " << WARNING_KIND_TITLES[i] << ": " << reported
+               << " (показаны первые " << warning_limit_ << ", см. --max-warnings)." << std::endl;
+         }
+      }
+   }
+
+   size_t warnings(WarningKind kind) const { return warnings_[static_cast<size_t>(kind)]; }
+
+   /**
+    * @brief Сколько записей отклонено (записано в файл отклоненных).
+    */
+   size_t rejected() const
+   {
+      size_t total = 0;
+      for (size_t count : rejected_)
+      {
+         total += count;
+      }
+      return total;
+   }
+
+   size_t total_warnings() const
+   {
+      size_t total = 0;
+      for (size_t count : warnings_)
+      {
+         total += count;
+      }
+      return total;
+   }
+
+   bool timed() const { return timed_; }
+   size_t warning_limit() const { return warning_limit_; }
+
+   /**
+    * @brief Время с начала прохода, в секундах.
+    */
+   double elapsed_seconds() const
+   {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - started_).count();
+   }
+
+   /**
+    * @brief Оценка времени этапа на всех записях, в секундах.
+    *
+    * Такты замеренных записей пересчитываются на все записи и переводятся
+    * в секунды по калибровке счетчика за время прохода.
+    */
+   double stage_seconds(Stage stage) const
+   {
+      const double elapsed = elapsed_seconds();
+      const uint64_t elapsed_ticks = stage_clock() - started_ticks_;
+      if (elapsed <= 0.0 || elapsed_ticks == 0 || sampled_records_ == 0)
+      {
+         return 0.0;
+      }
+      const double scale = static_cast<double>(stage_records_) / static_cast<double>(sampled_records_);
+      return static_cast<double>(ticks_[static_cast<size_t>(stage)]) * scale * elapsed / static_cast<double>(elapsed_ticks);
+   }
+
+   int rows_converted = 0;  // Успешно записанных строк данных
+   uint64_t records = 0;    // Прочитанных записей (без заголовка)
+   uint64_t bytes_in = 0;   // Прочитано байтов входа
+   uint64_t bytes_out = 0;  // Записано байтов вывода
+   bool success = false;
+
+private:
+   struct Sample
+   {
+      WarningKind kind;
+      std::string text;
+   };
+
+   void emit(WarningKind kind, const std::string &text)
+   {
+      if (out_ != nullptr)
+      {
+         // Одна запись на сообщение, без сброса потока после каждого
+         *out_ << text << '\n';
+      }
+      else
+      {
+         samples_.push_back({kind, text});
+      }
+   }
+
+   std::ostream *out_;
+   size_t warning_limit_;
+   bool timed_;
+   std::chrono::steady_clock::time_point started_;
+   uint64_t started_ticks_;
+   std::array<size_t, WARNING_KIND_COUNT> warnings_{};
+   std::array<size_t, WARNING_KIND_COUNT> rejected_{}; // Из них записанных в файл отклоненных
+   CsvWriter *rejects_ = nullptr; // Файл отклоненных (у участка - писатель в памяти)
+   std::array<uint64_t, STAGE_COUNT> ticks_{};
+   uint64_t mark_ = 0;           // Конец предыдущего этапа
+   bool sampling_ = false;       // Текущая запись замеряется
+   uint64_t stage_records_ = 0;  // Записей, прошедших через end_record
+   uint64_t sampled_records_ = 0; // Из них замеренных
+   std::vector<Sample> samples_; // Предупреждения участка, попавшие в его выборку
+   std::ostringstream message_;
+};
+
+/**
+ * @brief Имя текущего ядра сканирования (см. --simd).
+ */
+const char *block_classifier_name()
+{
+#if BZ4_X86
+   if (g_classify_block == classify_block_avx2)
+   {
+      return "avx2";
+   }
+   if (g_classify_block == classify_block_sse2)
+   {
+      return "sse2";
+   }
+#endif
+   return "scalar";
+}
+
+/**
+ * @brief Дописывает строку JSON в кавычках с экранированием.
+ */
+void write_json_string(std::ostream &out, std::string_view text)
+{
+   out << '"';
+   for (char c : text)
+   {
+      const unsigned char byte = static_cast<unsigned char>(c);
+      if (c == '"' || c == '\\')
+      {
+         out << '\\' << c;
+      }
+      else if (byte < 0x20)
+      {
+         char escaped[8];
+         std::snprintf(escaped, sizeof(escaped), "\\u%04x", byte);
+         out << escaped;
+      }
+      else
+      {
+         out << c;
+      }
+   }
+   out << '"';
+}
+
+/**
+ * @brief Статистика одного преобразованного файла для --stats-json.
+ */
+struct FileStatsEntry
+{
+   std::string input_filename;
+   std::string output_filename;
+   const ConversionStats *stats;
+   double seconds; // Время преобразования файла
+};
+
+/**
+ * @brief Записывает статистику в формате JSON (--stats-json).
+ *
+ * Формат: {"threads": N, "simd": "...", "files": [{"input", "output",
+ * "success", "rows_converted", "records", "bytes_in", "bytes_out",
+ * "rejected", "warnings": {категория: N}, "seconds": {"total", "read", "parse",
+ * "transform", "write"}}]}.
+ *
+ * @param path Имя файла или "-" для стандартного вывода.
+ * @return false, если файл не удалось записать.
+ */
+bool write_stats_json(const std::string &path, const Options &options, const char *simd, const std::vector<FileStatsEntry> &files)
+{
+   std::ostringstream json;
+   json.imbue(std::locale::classic()); // Десятичная точка независимо от локали
+   json << "{\n  \"threads\": " << std::max(1u, options.threads) << ",\n  \"simd\": ";
+   write_json_string(json, simd);
+   json << ",\n  \"files\": [";
+   for (size_t f = 0; f < files.size(); ++f)
+   {
+      const FileStatsEntry &entry = files[f];
+      const ConversionStats &stats = *entry.stats;
+      json << (f == 0 ? "\n" : ",\n") << "    {\n      \"input\": ";
+      write_json_string(json, entry.input_filename);
+      json << ",\n      \"output\": ";
+      write_json_string(json, entry.output_filename);
+      json << ",\n      \"success\": " << (stats.success ? "true" : "false")
+         << ",\n      \"rows_converted\": " << stats.rows_converted
+         << ",\n      \"records\": " << stats.records
+         << ",\n      \"bytes_in\": " << stats.bytes_in
+         << ",\n      \"bytes_out\": " << stats.bytes_out
+         << ",\n      \"rejected\": " << stats.rejected()
+         << ",\n      \"warnings\": {";
+      for (size_t i = 0; i < WARNING_KIND_COUNT; ++i)
+      {
+         json << (i == 0 ? "" : ", ") << '"' << WARNING_KIND_NAMES[i] << "\": " << stats.warnings(static_cast<WarningKind>(i));
+      }
+      json << "},\n      \"seconds\": {\"total\": " << entry.seconds;
+      for (size_t i = 0; i < STAGE_COUNT; ++i)
+      {
+         json << ", \"" << STAGE_NAMES[i] << "\": " << stats.stage_seconds(static_cast<Stage>(i));
+      }
+      json << "}\n    }";
+   }
+   json << "\n  ]\n}\n";
+
+   CsvWriter out;
+   if (path == "-" ? !out.open_stdout() : !out.open(path))
+   {
+      std::cerr << "Ошибка: Не удалось открыть файл статистики: " << path << std::endl;
+      return false;
+   }
+   out.write_raw(json.str());
+   if (!out.close())
+   {
+      std::cerr << "Ошибка: Не удалось записать файл статистики: " << path << std::endl;
+      return false;
+   }
+   return true;
+}
+
+
+// --- Преобразование ---
+
+/**
+ * @brief Параметры преобразования строк, общие для всех потоков.
+ */
+struct ConversionSettings
+{
+   std::string_view label;           // Значение поля Labels
+   bool label_verbatim = false;      // Метка не требует кавычек (проверено один раз)
+   CopyPlan plan;                    // План заполнения строки вывода
+   const DedupIndex *dedup = nullptr; // Индекс повторов (nullptr - повторы не удаляются)
+   DedupKey dedup_key = DedupKey::None;
+   size_t dedup_column = 0;          // Столбец ввода с ключом повторов
+   bool name_case = false;           // Фамилию из "Группа Фамилия" - с большой буквы
+   std::string_view created_domain;  // Домен созданной почты (--created-domain; пусто - адреса не меняются местами)
+   bool label_per_group = false;     // Метка - группа строки (источник операции Label - поле группы)
+   bool check_only = false;          // --check: строки проверяются, но не записываются
+   int sample_stride = 1;            // --sample: проверяется каждая N-я запись (по номеру строки)
+   std::vector<uint16_t> email_sources; // Столбцы ввода с почтой (для --check)
+   int phone_source = -1;            // Столбец ввода с телефоном (для --check; -1 - нет)
+};
+
+/**
+ * @brief Сообщает о строке с недостаточным количеством столбцов (или отклоняет ее).
+ */
+void report_short_row(std::string_view line, int line_number, size_t columns, const CopyPlan &plan, ConversionStats &stats)
+{
+   if (stats.rejecting())
+   {
+      stats.reject(WarningKind::ShortRow, line_number, std::to_string(columns) + " из "
+         + std::to_string(plan.min_input_columns) + " столбцов", line);
+      return;
+   }
+   stats.warn(WarningKind::ShortRow, "Предупреждение: Строка #", line_number, " пропущена из-за недостаточного количества столбцов (",
+      columns, " найдено, ожидалось минимум ", plan.min_input_columns, "). Строка: ", line);
+}
+
+/**
+ * @brief Проверяет одну строку данных без преобразования (--check).
+ *
+ * Число столбцов берется из границ, найденных сканером, а из полей
+ * извлекаются только почта и телефон (csv_record_field), поэтому строка
+ * целиком не разбирается. Сообщения - те же, что при преобразовании.
+ *
+ * @return true, если в строке достаточно столбцов (строка проверена).
+ */
+bool check_row(const CsvRecord &record, int line_number, const ConversionSettings &settings, RowScratch &scratch, ConversionStats &stats)
+{
+   const size_t columns = record.boundaries.size();
+   if (columns < settings.plan.min_input_columns)
+   {
+      report_short_row(record.text, line_number, columns, settings.plan, stats);
+      return false;
+   }
+   scratch.arena.reset();
+   if (settings.dedup != nullptr && columns > settings.dedup_column)
+   {
+      const uint64_t fingerprint = dedup_fingerprint(csv_record_field(record, settings.dedup_column, scratch.field_scratch), settings.dedup_key);
+      const int winner = fingerprint == 0 ? line_number : settings.dedup->winner(fingerprint);
+      if (winner != line_number)
+      {
+         stats.warn(WarningKind::Duplicate, "Предупреждение: Строка #", line_number, " - повтор строки #", winner, ".");
+      }
+   }
+   for (uint16_t source : settings.email_sources)
+   {
+      const std::string_view email = csv_record_field(record, source, scratch.field_scratch);
+      char *const canonical = scratch.arena.allocate(email.size());
+      size_t size = 0;
+      if (canonicalize_email(email, canonical, size) == EmailShape::Invalid)
+      {
+         stats.warn(WarningKind::BadEmail, "Предупреждение: Строка #", line_number, ": почта неверного вида: ", std::string_view(canonical, size));
+      }
+   }
+   if (settings.phone_source >= 0)
+   {
+      const std::string_view phone = csv_record_field(record, static_cast<size_t>(settings.phone_source), scratch.field_scratch);
+      char normalized[PHONE_E164_LENGTH];
+      if (!phone.empty() && !normalize_phone(phone, normalized))
+      {
+         stats.warn(WarningKind::BadPhone, "Предупреждение: Строка #", line_number, ": не удалось привести номер телефона к виду +7XXXXXXXXXX: ", phone);
+      }
+   }
+   return true;
+}
+
+/**
+ * @brief Преобразует одну строку данных и дописывает результат в out.
+ *
+ * @param record Запись входного файла (не пустая и не заголовок).
+ * @param line_number Номер первой строки записи для сообщений об ошибках.
+ * @param settings Параметры преобразования.
+ * @param scratch Переиспользуемые буферы потока.
+ * @param out Писатель для выходной строки.
+ * @param stats Статистика и выборка предупреждений.
+ * @return true, если строка успешно записана.
+ */
+bool convert_row(const CsvRecord &record, int line_number, const ConversionSettings &settings, RowScratch &scratch, CsvWriter &out, ConversionStats &stats)
+{
+   const std::string_view line = record.text;
+   std::vector<std::string_view> &input_fields = scratch.input_fields;
+
+   // Разбираем строку на поля
+   split_csv_record(record, input_fields, scratch.field_scratch);
+   stats.lap(Stage::Parse);
+
+   const CopyPlan &plan = settings.plan;
+
+   // Проверяем, достаточно ли столбцов в прочитанной строке
+   if (input_fields.size() < plan.min_input_columns)
+   {
+      report_short_row(line, line_number, input_fields.size(), plan, stats);
+      return false; // Переходим к следующей строке
+   }
+
+   // Повторная строка: в индексе за этим ключом закреплена другая строка
+   if (settings.dedup != nullptr && input_fields.size() > settings.dedup_column)
+   {
+      const uint64_t fingerprint = dedup_fingerprint(input_fields[settings.dedup_column], settings.dedup_key);
+      const int winner = fingerprint == 0 ? line_number : settings.dedup->winner(fingerprint);
+      if (winner != line_number)
+      {
+         stats.warn(WarningKind::Duplicate, "Предупреждение: Строка #", line_number, " пропущена как повтор строки #", winner, ".");
+         return false;
+      }
+   }
+
+   try
+   {
+      // Поля ВЫХОДНОЙ строки - представления (пустые по умолчанию)
+      std::array<std::string_view, NUM_OUTPUT_COLUMNS> output_fields;
+
+      // Поле без кавычек во входе не содержит запятых, кавычек и '\n' (иначе
+      // сканер отметил бы его FIELD_QUOTED); если в записи нет и '\r', такое
+      // поле и все, что из него получается (части, регистр, номер телефона),
+      // пишется без проверки на кавычки. Биты verbatim - по номерам столбцов вывода
+      static_assert(NUM_OUTPUT_COLUMNS <= 32, "verbatim рассчитан на строки до 32 столбцов");
+      const bool no_carriage_return = std::memchr(line.data(), '\r', line.size()) == nullptr;
+      auto plain_source = [&](size_t source)
+      {
+         return no_carriage_return && (record.boundaries[source] & FIELD_QUOTED) == 0;
+      };
+      uint32_t verbatim = 0;
+
+      // --- Заполнение полей выходной строки по плану ---
+      // Простые копирования - плоский цикл без ветвлений и поиска столбцов
+      for (const FieldCopy &copy : plan.copies)
+      {
+         output_fields[copy.output] = input_fields[copy.source];
+         verbatim = (verbatim & ~(1u << copy.output)) | static_cast<uint32_t>(plain_source(copy.source)) << copy.output;
+      }
+
+      // Операции с преобразованием. Синтезированные значения живут в арене
+      // до записи строки, поэтому арену можно сбрасывать перед каждой строкой
+      Arena &arena = scratch.arena;
+      arena.reset();
+      for (const CopyOp &op : plan.transforms)
+      {
+         std::string_view &output = output_fields[op.output];
+         const bool plain = op.transform == FieldTransform::Label
+            ? settings.label_verbatim && (!settings.label_per_group || plain_source(op.source))
+            : plain_source(op.source);
+         verbatim = (verbatim & ~(1u << op.output)) | static_cast<uint32_t>(plain) << op.output;
+         if (op.transform == FieldTransform::Label)
+         {
+            // Labels (Метки) - значение, введенное пользователем, или группа строки
+            output = settings.label;
+            if (settings.label_per_group)
+            {
+               std::string_view group, lastName;
+               splitGroupLastName(input_fields[op.source], group, lastName);
+               if (!group.empty())
+               {
+                  output = group;
+               }
+            }
+            continue;
+         }
+         if (op.transform == FieldTransform::Phone)
+         {
+            const std::string_view phone = input_fields[op.source];
+            char normalized[PHONE_E164_LENGTH];
+            if (phone.empty())
+            {
+               output = phone;
+            }
+            else if (normalize_phone(phone, normalized))
+            {
+               output = arena.copy(std::string_view(normalized, PHONE_E164_LENGTH));
+            }
+            else
+            {
+               // Номер, который не удалось разобрать, записывается как есть
+               output = phone;
+               stats.warn(WarningKind::BadPhone, "Предупреждение: Строка #", line_number, ": не удалось привести номер телефона к виду +7XXXXXXXXXX: ", phone);
+            }
+            continue;
+         }
+         if (op.transform == FieldTransform::Email)
+         {
+            const std::string_view email = input_fields[op.source];
+            char *const canonical = arena.allocate(email.size());
+            size_t size = 0;
+            const EmailShape shape = canonicalize_email(email, canonical, size);
+            output = std::string_view(canonical, size);
+            if (shape == EmailShape::Valid)
+            {
+               // Допустимый адрес не содержит символов, требующих кавычек
+               verbatim |= 1u << op.output;
+            }
+            else if (shape == EmailShape::Invalid)
+            {
+               stats.warn(WarningKind::BadEmail, "Предупреждение: Строка #", line_number, ": почта неверного вида: ", output);
+            }
+            continue;
+         }
+         if (op.transform == FieldTransform::Name)
+         {
+            // Регистр меняется на месте в копии поля (вход может быть только для чтения)
+            const std::string_view source = input_fields[op.source];
+            char *const name = arena.duplicate(source);
+            title_case_name(name, source.size());
+            output = std::string_view(name, source.size());
+            continue;
+         }
+
+         // Извлекаем Группу и Фамилию из соответствующего поля входного файла
+         std::string_view group, lastName;
+         splitGroupLastName(input_fields[op.source], group, lastName);
+         if (op.transform == FieldTransform::Group)
+         {
+            output = group;
+         }
+         else if (op.transform == FieldTransform::LastName || group.empty())
+         {
+            // Если группа не найдена, записываем только фамилию
+            output = lastName;
+            if (settings.name_case && !lastName.empty())
+            {
+               char *const cased = arena.duplicate(lastName);
+               title_case_name(cased, lastName.size());
+               output = std::string_view(cased, lastName.size());
+            }
+         }
+         else
+         {
+            // "Группа Фамилия" - синтезированное поле, собираем в арене
+            char *const combined = arena.allocate(group.size() + 1 + lastName.size());
+            std::memcpy(combined, group.data(), group.size());
+            combined[group.size()] = ' ';
+            if (!lastName.empty())
+            {
+               std::memcpy(combined + group.size() + 1, lastName.data(), lastName.size());
+            }
+            if (settings.name_case)
+            {
+               title_case_name(combined + group.size() + 1, lastName.size());
+            }
+            output = std::string_view(combined, group.size() + 1 + lastName.size());
+         }
+      }
+
+      if (!settings.created_domain.empty() && email_domain(output_fields[20]) == settings.created_domain
+         && email_domain(output_fields[18]) != settings.created_domain)
+      {
+         // Созданная почта попала в поле почты ЛК: E-mail 1 - Value (18) и
+         // E-mail 2 - Value (20) меняются местами вместе с битами verbatim
+         std::swap(output_fields[18], output_fields[20]);
+         if ((verbatim >> 18 & 1) != (verbatim >> 20 & 1))
+         {
+            verbatim ^= 1u << 18 | 1u << 20;
+         }
+      }
+
+      // --- Форматирование и запись выходной строки ---
+      stats.lap(Stage::Transform);
+      if (plan.builtin_layout)
+      {
+         // Встроенная схема: пустые столбцы - готовые литералы, экранируются только 6 полей
+         BuiltinRowEmitter::emit(output_fields, verbatim, out);
+         stats.lap(Stage::Write);
+         return true;
+      }
+      for (size_t i = 0; i < output_fields.size(); ++i)
+      {
+         // Форматируем каждое поле прямо в буфере писателя (добавляем кавычки, если нужно)
+         if ((verbatim >> i & 1) != 0)
+         {
+            out.write_raw(output_fields[i]);
+         }
+         else
+         {
+            out.write_field(output_fields[i]);
+         }
+         // Добавляем запятую после каждого поля, кроме последнего
+         if (i < output_fields.size() - 1)
+         {
+            out.put(',');
+         }
+      }
+      // Завершаем строку символом новой строки
+      out.end_row(); // Используем '\n' в бинарном режиме
+      stats.lap(Stage::Write);
+      return true;
+   }
+   catch (const std::out_of_range &oor)
+   {
+      // Обработка ошибки: попытка доступа к несуществующему индексу (маловероятно из-за проверки выше)
+      if (stats.rejecting())
+      {
+         stats.reject(WarningKind::RowError, line_number, oor.what(), line);
+         return false;
+      }
+      stats.warn(WarningKind::RowError, "Ошибка: Произошел выход за пределы диапазона при обработке строки #", line_number, ". ", oor.what(), ". Строка: ", line);
+   }
+   catch (const std::exception &e)
+   {
+      // Обработка других возможных исключений при обработке строки
+      if (stats.rejecting())
+      {
+         stats.reject(WarningKind::RowError, line_number, e.what(), line);
+         return false;
+      }
+      stats.warn(WarningKind::RowError, "Ошибка: Произошло исключение при обработке строки #", line_number, ". ", e.what(), ". Строка: ", line);
+   }
+   return false;
+}
+
+/**
+ * @brief Обрабатывает одну запись: пропускает пустые, остальные преобразует.
+ *
+ * @param line_number Номер строки, с которой начинается запись (увеличивается
+ *                    на количество занятых записью строк).
+ * @return true, если строка данных успешно записана.
+ */
+bool process_record(const CsvRecord &record, int &line_number, const ConversionSettings &settings, RowScratch &scratch, CsvWriter &out, ConversionStats &stats)
+{
+   const int record_line = line_number;
+   line_number += 1 + static_cast<int>(record.embedded_newlines);
+   ++stats.records;
+   if (settings.sample_stride > 1 && record_line % settings.sample_stride != 0)
+   {
+      return false; // --sample: запись вне выборки
+   }
+   if (record.text.empty())
+   {
+      // Пропускаем пустые строки
+      stats.warn(WarningKind::EmptyLine, "Предупреждение: Пропущена пустая строка #", record_line);
+      return false;
+   }
+   if (settings.check_only)
+   {
+      return check_row(record, record_line, settings, scratch, stats);
+   }
+   return convert_row(record, record_line, settings, scratch, out, stats);
+}
+
+/**
+ * @brief Преобразует все записи диапазона [begin, end).
+ *
+ * Диапазон должен начинаться с начала записи; заголовок в него не входит.
+ *
+ * @param first_line_number Номер строки, с которой начинается диапазон.
+ * @return Количество успешно обработанных строк данных.
+ */
+int convert_range(const char *begin, const char *end, int first_line_number, const ConversionSettings &settings, RowScratch &scratch, CsvWriter &out, ConversionStats &stats)
+{
+   thread_local CsvRecord record; // Переиспользуем вектор границ между вызовами
+   int line_number = first_line_number;
+   int processed_count = 0;
+   stats.start_stages();
+   while (read_next_record(begin, end, record))
+   {
+      stats.lap(Stage::Read);
+      if (process_record(record, line_number, settings, scratch, out, stats))
+      {
+         processed_count++;
+      }
+      stats.end_record();
+   }
+   return processed_count;
+}
+
+/**
+ * @brief Подсчитывает кавычки и переводы строк в участке (тем же классификатором блока).
+ */
+void count_quotes_and_newlines(const char *p, size_t size, size_t &quotes, size_t &newlines)
+{
+   BlockMasks masks;
+   quotes = 0;
+   newlines = 0;
+   for (size_t offset = 0; offset < size; offset += 64)
+   {
+      if (size - offset >= 64)
+      {
+         g_classify_block(p + offset, masks);
+      }
+      else
+      {
+         char tail[64] = {};
+         std::memcpy(tail, p + offset, size - offset);
+         g_classify_block(tail, masks);
+      }
+      quotes += count_set_bits(masks.quotes);
+      newlines += count_set_bits(masks.newlines);
+   }
+}
+
+/**
+ * @brief Участок входных данных, начинающийся и заканчивающийся на границе записи.
+ */
+struct InputChunk
+{
+   const char *begin;
+   const char *end;
+   int first_line_number; // Номер строки, с которой начинается участок
+};
+
+/**
+ * @brief Делит диапазон записей на участки примерно по chunk_size байтов.
+ *
+ * Граница участка должна приходиться на перевод строки вне кавычек. Чтобы
+ * узнать состояние "внутри кавычек" в произвольной точке, сначала в пуле
+ * параллельно подсчитываются кавычки (и переводы строк - для номеров строк)
+ * в каждом участке; четность количества кавычек от начала диапазона дает
+ * состояние в точке разреза, после чего граница сдвигается к ближайшему
+ * концу записи. Диапазон должен начинаться вне кавычек (с начала записи).
+ */
+std::vector<InputChunk> split_into_chunks(const char *begin, const char *end, int first_line_number, size_t chunk_size, ThreadPool &pool)
+{
+   const size_t size = static_cast<size_t>(end - begin);
+   const size_t count = std::max<size_t>(1, (size + chunk_size - 1) / chunk_size);
+
+   // Подсчет кавычек и переводов строк в каждом участке [i*chunk_size, (i+1)*chunk_size)
+   std::vector<std::future<std::pair<size_t, size_t>>> counts;
+   for (size_t i = 0; i + 1 < count; ++i)
+   {
+      counts.push_back(pool.submit([=]
+      {
+         size_t quotes = 0, newlines = 0;
+         count_quotes_and_newlines(begin + i * chunk_size, chunk_size, quotes, newlines);
+         return std::make_pair(quotes, newlines);
+      }));
+   }
+
+   std::vector<InputChunk> chunks;
+   chunks.push_back({begin, end, first_line_number});
+   size_t quotes_before = 0, newlines_before = 0;
+   std::vector<uint32_t> boundaries; // Границы полей при поиске конца записи не нужны
+   for (size_t i = 0; i + 1 < count; ++i)
+   {
+      const std::pair<size_t, size_t> segment = pool.wait(counts[i]);
+      quotes_before += segment.first;
+      newlines_before += segment.second;
+
+      const char *cut = begin + (i + 1) * chunk_size;
+      if (cut <= chunks.back().begin)
+      {
+         continue; // Предыдущая запись длиннее участка и уже перекрыла эту точку
+      }
+      CsvScanState state;
+      state.in_quotes = (quotes_before & 1) != 0;
+      boundaries.clear();
+      const char *newline = scan_record(cut, end, 0, state, boundaries);
+      if (newline == nullptr || newline + 1 >= end)
+      {
+         break; // До конца данных записей больше не начинается
+      }
+      const char *chunk_begin = newline + 1;
+      const int line = first_line_number + static_cast<int>(newlines_before + std::count(cut, chunk_begin, '\n'));
+      chunks.back().end = chunk_begin;
+      chunks.push_back({chunk_begin, end, line});
+   }
+   return chunks;
+}
+
+/**
+ * @brief Параллельное преобразование участков с записью результатов в исходном порядке.
+ *
+ * Каждый участок преобразуется в пуле в собственный буфер (писатель в памяти),
+ * предупреждения и статистика тоже собираются в участке. Результаты забираются строго
+ * в порядке подачи, поэтому вывод побайтно совпадает с последовательным.
+ * Одновременно в работе не больше двух участков на поток, так что память
+ * ограничена размером участка, а не файла.
+ */
+class OrderedChunkConverter
+{
+public:
+   OrderedChunkConverter(ThreadPool &pool, const ConversionSettings &settings, CsvWriter &out, ConversionStats &stats)
+      : pool_(pool), settings_(settings), out_(out), stats_(stats)
+   {
+   }
+
+   /**
+    * @brief Ставит участок в очередь на преобразование.
+    *
+    * @param chunk Участок входных данных.
+    * @param storage Владелец данных участка (если они не принадлежат отображению файла).
+    */
+   void submit(const InputChunk &chunk, std::shared_ptr<const std::string> storage = nullptr)
+   {
+      while (in_flight_.size() >= pool_.size() * 2)
+      {
+         drain_one();
+      }
+      const ConversionSettings &settings = settings_;
+      const size_t warning_limit = stats_.warning_limit();
+      const bool timed = stats_.timed();
+      const bool rejecting = stats_.rejecting();
+      in_flight_.push_back(pool_.submit([chunk, storage, &settings, warning_limit, timed, rejecting]
+      {
+         thread_local RowScratch scratch; // Буферы строк - свои у каждого потока пула
+         auto result = std::make_unique<ChunkOutput>(static_cast<size_t>(chunk.end - chunk.begin) + 1024, warning_limit, timed);
+         if (rejecting)
+         {
+            result->rejects = std::make_unique<CsvWriter>(REJECTS_BUFFER_SIZE);
+            result->stats.set_rejects(result->rejects.get());
+         }
+         result->processed = convert_range(chunk.begin, chunk.end, chunk.first_line_number, settings, scratch, result->writer, result->stats);
+         return result;
+      }));
+   }
+
+   /**
+    * @brief Дожидается всех участков и записывает их результаты.
+    * @return Количество успешно обработанных строк данных.
+    */
+   int finish()
+   {
+      while (!in_flight_.empty())
+      {
+         drain_one();
+      }
+      return processed_;
+   }
+
+private:
+   static constexpr size_t REJECTS_BUFFER_SIZE = 64 << 10; // Растет при необходимости
+
+   struct ChunkOutput
+   {
+      ChunkOutput(size_t buffer_size, size_t warning_limit, bool timed)
+         : writer(buffer_size), stats(nullptr, warning_limit, timed)
+      {
+      }
+      CsvWriter writer;      // Писатель в памяти
+      ConversionStats stats; // Без вывода: предупреждения выводятся при merge
+      std::unique_ptr<CsvWriter> rejects; // Отклоненные записи участка (--rejects)
+      int processed = 0;
+   };
+
+   void drain_one()
+   {
+      std::unique_ptr<ChunkOutput> result = pool_.wait(in_flight_.front());
+      in_flight_.pop_front();
+      out_.write_raw(std::string_view(result->writer.data(), result->writer.size()));
+      stats_.merge(result->stats);
+      processed_ += result->processed;
+   }
+
+   ThreadPool &pool_;
+   const ConversionSettings &settings_;
+   CsvWriter &out_;
+   ConversionStats &stats_;
+   std::deque<std::future<std::unique_ptr<ChunkOutput>>> in_flight_;
+   int processed_ = 0;
+};
+
+/**
+ * @brief Учитывает запись в индексе повторов (первый проход --dedup).
+ *
+ * Пропускаются те же записи, что и при преобразовании (пустые и с
+ * недостаточным количеством столбцов), а также записи с пустым ключом.
+ *
+ * @param line_number Номер строки, с которой начинается запись (увеличивается
+ *                    на количество занятых записью строк).
+ */
+void index_record(const CsvRecord &record, int &line_number, const ConversionSettings &settings, RowScratch &scratch, DedupIndex &index)
+{
+   const int record_line = line_number;
+   line_number += 1 + static_cast<int>(record.embedded_newlines);
+   if (record.text.empty())
+   {
+      return;
+   }
+   std::vector<std::string_view> &fields = scratch.input_fields;
+   split_csv_record(record, fields, scratch.field_scratch);
+   if (fields.size() < settings.plan.min_input_columns || fields.size() <= settings.dedup_column)
+   {
+      return;
+   }
+   const uint64_t fingerprint = dedup_fingerprint(fields[settings.dedup_column], settings.dedup_key);
+   if (fingerprint != 0)
+   {
+      const int64_t timestamp = index.keep() == DedupKeep::Latest ? parse_timestamp(fields[0]) : 0;
+      index.insert(fingerprint, timestamp, record_line);
+   }
+}
+
+/**
+ * @brief Учитывает в индексе повторов все записи диапазона [begin, end).
+ */
+void index_range(const char *begin, const char *end, int first_line_number, const ConversionSettings &settings, RowScratch &scratch, DedupIndex &index)
+{
+   thread_local CsvRecord record;
+   int line_number = first_line_number;
+   while (read_next_record(begin, end, record))
+   {
+      index_record(record, line_number, settings, scratch, index);
+   }
+}
+
+/**
+ * @brief Первый проход --dedup: строит индекс повторов по данным файла.
+ *
+ * Отображенный файл индексируется участками в пуле (если он есть), при
+ * потоковом чтении файл открывается повторно и читается последовательно.
+ *
+ * @param stream_input Вход читается потоком (--stream или сжатый файл).
+ * @param begin,end Данные отображенного файла после заголовка (при потоковом чтении не используются).
+ * @param first_line_number Номер строки, с которой начинаются данные после заголовка.
+ * @return false, если входной файл не удалось повторно открыть или прочитать.
+ */
+bool build_dedup_index(const Options &options, bool stream_input, const char *begin, const char *end, int first_line_number,
+   const ConversionSettings &settings, ThreadPool *pool, DedupIndex &index, std::ostream &diag)
+{
+   RowScratch scratch;
+   if (!stream_input)
+   {
+      if (pool == nullptr)
+      {
+         index_range(begin, end, first_line_number, settings, scratch, index);
+         return true;
+      }
+      std::vector<std::future<void>> tasks;
+      for (const InputChunk &chunk : split_into_chunks(begin, end, first_line_number, options.chunk_size, *pool))
+      {
+         tasks.push_back(pool->submit([chunk, &settings, &index]
+         {
+            thread_local RowScratch chunk_scratch;
+            index_range(chunk.begin, chunk.end, chunk.first_line_number, settings, chunk_scratch, index);
+         }));
+      }
+      for (std::future<void> &task : tasks)
+      {
+         pool->wait(task);
+      }
+      return true;
+   }
+
+   FileByteSource source;
+   if (!source.open(options.input_filename))
+   {
+      diag << "Ошибка: Не удалось повторно открыть входной файл: " << options.input_filename << std::endl;
+      return false;
+   }
+   // Сообщения о сжатии и кодировке выведет основной проход
+   std::ostringstream decoding_diag;
+   DecompressingByteSource decompressed(source, decoding_diag);
+   if (!decompressed.start())
+   {
+      return false;
+   }
+   DecodingByteSource decoded(decompressed, options.encoding, decoding_diag);
+   CsvRecordReader reader(decoded, options.chunk_size);
+   CsvRecord record;
+   int line_number = 1;
+   while (reader.next_record(record))
+   {
+      if (line_number < first_line_number)
+      {
+         // Заголовок и пустые строки перед ним
+         line_number += 1 + static_cast<int>(record.embedded_newlines);
+         continue;
+      }
+      index_record(record, line_number, settings, scratch, index);
+   }
+   if (decompressed.failed())
+   {
+      if (!decompressed.error().empty())
+      {
+         diag << decompressed.error() << std::endl;
+      }
+      diag << "Ошибка: Не удалось прочитать входной файл: " << options.input_filename << std::endl;
+      return false;
+   }
+   return true;
+}
+
+/**
+ * @brief Преобразует один входной файл в выходной.
+ *
+ * В режиме --incremental при неизменной выгрузке читаются только записи,
+ * добавленные после прошлого прохода, и дописываются в конец выходного
+ * файла; иначе выполняется полный проход. После успешной записи
+ * сохраняется состояние для следующего запуска.
+ *
+ * @param options Параметры запуска (имена файлов, режим чтения, потоки).
+ * @param label Значение поля Labels.
+ * @param pool Пул потоков или nullptr для последовательной обработки.
+ * @param diag Поток для ошибок и сообщений о файле.
+ * @param stats Статистика прохода (предупреждения о строках выводит она сама).
+ * @return true при успехе; false, если файл не удалось открыть, прочитать или записать.
+ */
+bool convert_file(const Options &options, std::string_view label, ThreadPool *pool, std::ostream &diag, ConversionStats &stats)
+{
+   const std::string &input_filename = options.input_filename;
+   const std::string &output_filename = options.output_filename;
+   int processed_count = 0;
+
+   const bool from_stdin = input_filename == "-";
+   if (from_stdin && options.dedup_key != DedupKey::None)
+   {
+      diag << "Ошибка: Для --dedup входной файл читается дважды, стандартный ввод не поддерживается." << std::endl;
+      return false;
+   }
+   if (options.incremental && (from_stdin || output_filename == "-"))
+   {
+      diag << "Ошибка: Инкрементальный режим работает только с файлами, не со стандартным вводом/выводом." << std::endl;
+      return false;
+   }
+   if (options.sharded_output() && output_filename == "-")
+   {
+      diag << "Ошибка: Разбиение вывода на части требует имени выходного файла, не стандартного вывода." << std::endl;
+      return false;
+   }
+   if (output_filename != "-" && !compression_supported(compression_for_path(output_filename)) && !options.check
+      && !options.sharded_output() && options.split_by_group_dir.empty())
+   {
+      diag << "Ошибка: Сжатие вывода " << compression_name(compression_for_path(output_filename))
+         << " не поддерживается этой сборкой программы: " << output_filename << std::endl;
+      return false;
+   }
+
+   // Вход отображен в память или читается по ходу: перезапись его же оборвала бы чтение
+   auto same_as_input = [&](const std::string &path)
+   {
+      std::error_code error;
+      return !from_stdin && !path.empty() && path != "-" && std::filesystem::equivalent(input_filename, path, error) && !error;
+   };
+   const bool writes_output = !options.check && !options.sharded_output() && options.split_by_group_dir.empty();
+   for (const std::string *path : {writes_output ? &output_filename : nullptr, &options.rejects_file})
+   {
+      if (path != nullptr && same_as_input(*path))
+      {
+         diag << "Ошибка: Входной файл нельзя перезаписать результатом: " << *path << std::endl;
+         return false;
+      }
+   }
+
+   // --- Открытие файлов ---
+   // Отображаем входной файл в память (без построчного копирования через std::getline)
+   // или, в потоковом режиме, для стандартного ввода ("-") и сжатого файла, читаем его блоками
+   const bool compressed_file = !from_stdin && file_compression(input_filename) != Compression::None;
+   const bool stream_input = options.stream_input || from_stdin || compressed_file;
+   MappedFile input_file;
+   FileByteSource file_stream;
+   StdinByteSource stdin_stream;
+   ByteSource &raw_stream = from_stdin ? static_cast<ByteSource &>(stdin_stream) : file_stream;
+   if (!from_stdin && (stream_input ? !file_stream.open(input_filename) : !input_file.open(input_filename)))
+   {
+      diag << "Ошибка: Не удалось открыть входной файл: " << input_filename << std::endl;
+      return false;
+   }
+   // Сжатый вход (.gz, .zst - по первым байтам) распаковывается по мере чтения
+   DecompressingByteSource decompressed_stream(raw_stream, diag);
+   if (stream_input && !decompressed_stream.start())
+   {
+      return false;
+   }
+   const bool compressed_input = decompressed_stream.compression() != Compression::None;
+   if (compressed_input && options.incremental)
+   {
+      // Позиции продолжения - в распакованных данных, перейти к ним в сжатом файле нельзя
+      diag << "Ошибка: Инкрементальный режим не поддерживает сжатый входной файл." << std::endl;
+      return false;
+   }
+   // --pipeline и сжатый вход: следующие блоки читает (и распаковывает) отдельный поток,
+   // пока текущий разбирается
+   ReadAheadByteSource read_ahead(decompressed_stream, options.chunk_size);
+   const bool read_ahead_input = options.pipeline || compressed_input;
+   // Вход проверяется на UTF-8 и при необходимости перекодируется из Windows-1251:
+   // поток - по мере чтения, отображение - целиком до разбора
+   DecodingByteSource input_stream(read_ahead_input ? static_cast<ByteSource &>(read_ahead) : decompressed_stream, options.encoding, diag);
+   CsvRecordReader stream_reader(input_stream, options.chunk_size);
+   std::string decoded_input;
+   bool transcoded = false;
+   if (!stream_input && !decode_input(input_file.data(), input_file.size(), options.encoding, decoded_input, transcoded, diag))
+   {
+      return false;
+   }
+
+   // --- Обработка строк входного файла ---
+   ConversionSettings settings;
+   settings.label = label;
+   settings.label_verbatim = !needs_csv_quoting(label);
+   settings.check_only = options.check;
+   settings.sample_stride = options.sample_stride;
+   settings.name_case = options.name_case;
+   settings.created_domain = options.created_domain;
+   CsvRecord record;         // Текущая запись (представление внутрь отображения или буфера чтения)
+   int next_line_number = 1; // Номер строки, с которой начинается следующая запись
+   uint64_t consumed = 0;    // Сколько байтов входа прочитано потоковым чтением
+   RowScratch scratch;       // Буферы, переиспользуемые между строками
+   const char *const input_begin = transcoded ? decoded_input.data() : input_file.data();
+   const char *const input_end = input_begin + (transcoded ? decoded_input.size() : input_file.size());
+   const char *cursor = input_begin;
+
+   auto next_record = [&]() -> bool
+   {
+      if (!stream_input)
+      {
+         return read_next_record(cursor, input_end, record);
+      }
+      if (!stream_reader.next_record(record))
+      {
+         return false;
+      }
+      consumed += record.raw_size;
+      return true;
+   };
+
+   // Пропускаем первую непустую запись (заголовок) входного файла
+   bool has_header = false;
+   while (next_record())
+   {
+      const int line_number = next_line_number;
+      next_line_number += 1 + static_cast<int>(record.embedded_newlines);
+      if (!record.text.empty())
+      {
+         has_header = true;
+         break;
+      }
+      // Пропускаем пустые строки
+      ++stats.records;
+      stats.warn(WarningKind::EmptyLine, "Предупреждение: Пропущена пустая строка #", line_number);
+   }
+
+   // Компилируем план копирования: имена столбцов разрешаются по заголовку
+   std::vector<std::string_view> header_fields;
+   IncrementalState state;
+   if (has_header)
+   {
+      split_csv_record(record, header_fields, scratch.field_scratch);
+      state.header_hash = hash_bytes(record.text);
+   }
+   if (!compile_copy_plan(*options.mapping, options.auto_columns, header_fields, settings.plan, diag))
+   {
+      return false;
+   }
+   if (options.label_per_group)
+   {
+      // Группа для метки берется из того же поля, что и группа в Last Name
+      const auto group_op = std::find_if(settings.plan.transforms.begin(), settings.plan.transforms.end(), [](const CopyOp &op)
+         { return op.transform == FieldTransform::GroupLastName || op.transform == FieldTransform::Group; });
+      if (group_op == settings.plan.transforms.end())
+      {
+         diag << "Ошибка: Для --label-per-group в сопоставлении нужен столбец group_lastname(N) или group(N)." << std::endl;
+         return false;
+      }
+      const uint16_t group_source = group_op->source;
+      for (CopyOp &op : settings.plan.transforms)
+      {
+         if (op.transform == FieldTransform::Label)
+         {
+            op.source = group_source;
+         }
+      }
+      settings.label_per_group = true;
+   }
+   if (options.check)
+   {
+      // Проверяются поля, из которых заполняются E-mail 1 - Value (18), E-mail 2 - Value (20) и Phone 1 - Value (22)
+      for (const FieldCopy &copy : settings.plan.copies)
+      {
+         if (copy.output == 18 || copy.output == 20)
+         {
+            settings.email_sources.push_back(copy.source);
+         }
+         else if (copy.output == 22)
+         {
+            settings.phone_source = copy.source;
+         }
+      }
+      for (const CopyOp &op : settings.plan.transforms)
+      {
+         if ((op.output == 18 || op.output == 20) && op.transform == FieldTransform::Email)
+         {
+            settings.email_sources.push_back(op.source);
+         }
+         else if (op.output == 22 && op.transform == FieldTransform::Phone)
+         {
+            settings.phone_source = op.source;
+         }
+      }
+   }
+
+   // --- Инкрементальный режим: продолжаем с первой новой записи ---
+   const std::string state_path = incremental_state_path(output_filename);
+   bool resume = false;
+   uint64_t start_offset = 0; // С какого байта входа начинается этот проход
+   if (options.incremental && !transcoded)
+   {
+      IncrementalState previous;
+      std::error_code error;
+      const uint64_t input_size = stream_input ? std::filesystem::file_size(input_filename, error) : input_file.size();
+      uint64_t resume_offset = 0;
+      if (load_incremental_state(state_path, previous) && std::filesystem::exists(output_filename, error)
+         && can_resume(previous, input_filename, input_size, state.header_hash, resume_offset, diag))
+      {
+         resume = true;
+         start_offset = resume_offset;
+         next_line_number = previous.next_line_number;
+         if (stream_input)
+         {
+            read_ahead.stop(); // Блоки, прочитанные наперед, относятся к началу файла
+            if (!file_stream.seek(resume_offset))
+            {
+               diag << "Ошибка: Не удалось прочитать входной файл: " << input_filename << std::endl;
+               return false;
+            }
+            input_stream.reset(resume_offset);
+            stream_reader.reset();
+            consumed = resume_offset;
+         }
+         else
+         {
+            cursor = input_file.data() + resume_offset;
+         }
+      }
+   }
+
+   // Первый проход --dedup: для каждого ключа определяется строка, которая останется
+   std::unique_ptr<DedupIndex> dedup_index;
+   if (options.dedup_key != DedupKey::None)
+   {
+      dedup_index = std::make_unique<DedupIndex>(options.dedup_keep);
+      settings.dedup_key = options.dedup_key;
+      settings.dedup_column = dedup_key_column(settings.plan, options.dedup_key);
+      if (!build_dedup_index(options, stream_input, cursor, input_end, next_line_number, settings, pool, *dedup_index, diag))
+      {
+         return false;
+      }
+      settings.dedup = dedup_index.get();
+   }
+
+   // --merge: существующие контакты читаются до открытия вывода (файл может совпадать с выходным),
+   // а преобразованные строки порциями добавляются к таблице новых контактов
+   std::unique_ptr<ContactMerger> merger;
+   CsvWriter merge_buffer;
+   if (!options.merge_file.empty())
+   {
+      if (file_compression(options.merge_file) != Compression::None)
+      {
+         diag << "Ошибка: Файл --merge должен быть несжатым CSV: " << options.merge_file << std::endl;
+         return false;
+      }
+      merger = std::make_unique<ContactMerger>();
+      if (!merger->load(options.merge_file, diag))
+      {
+         return false;
+      }
+   }
+
+   // Открываем выходной файл для записи в БИНАРНОМ режиме (важно для BOM и корректной записи UTF-8)
+   // или используем стандартный вывод ("-"); при продолжении - дописываем в конец.
+   // При разбиении на части и по группам файлы создают потоки писателей ShardedOutput и GroupSplitOutput
+   CsvWriter output_file;
+   std::unique_ptr<ShardedOutput> shards;
+   std::unique_ptr<GroupSplitOutput> groups;
+   if (options.check)
+   {
+      // --check: вывод не создается, строки в sink не попадают
+   }
+   else if (options.sharded_output())
+   {
+      shards = std::make_unique<ShardedOutput>(output_filename, options.max_rows_per_file, options.max_bytes_per_file);
+   }
+   else if (!options.split_by_group_dir.empty())
+   {
+      groups = std::make_unique<GroupSplitOutput>(options.split_by_group_dir);
+      if (!groups->open(diag))
+      {
+         return false;
+      }
+   }
+   else if (output_filename == "-" ? !output_file.open_stdout() : !output_file.open(output_filename, resume))
+   {
+      diag << "Ошибка: Не удалось открыть выходной файл: " << output_filename << std::endl;
+      return false;
+   }
+   else
+   {
+      // Сжатие вывода (.gz, .zst) выполняет поток записи
+      const Compression output_compression = output_filename == "-" ? Compression::None : compression_for_path(output_filename);
+      output_file.compress(output_compression);
+      if (options.pipeline || output_compression != Compression::None)
+      {
+         output_file.write_in_background();
+      }
+   }
+
+   // Отклоненные записи - тем же буферизованным писателем, в отдельный файл
+   CsvWriter rejects_file;
+   if (!options.rejects_file.empty())
+   {
+      // При продолжении заголовок нужен, если файл отклоненных только создается или пуст
+      const bool rejects_to_stdout = options.rejects_file == "-";
+      std::error_code size_error;
+      const bool rejects_new = rejects_to_stdout || !resume
+         || std::filesystem::file_size(options.rejects_file, size_error) == 0 || size_error;
+      if (rejects_to_stdout ? !rejects_file.open_stdout() : !rejects_file.open(options.rejects_file, resume))
+      {
+         diag << "Ошибка: Не удалось открыть файл отклоненных записей: " << options.rejects_file << std::endl;
+         return false;
+      }
+      if (rejects_new)
+      {
+         rejects_file.write_raw("\xEF\xBB\xBF");
+         rejects_file.write_raw(REJECTS_HEADER);
+         rejects_file.end_row();
+      }
+      stats.set_rejects(&rejects_file);
+   }
+
+   // --sort-by: преобразованные строки собираются в таблицу (ключ и запись) и выводятся после сортировки
+   std::unique_ptr<ContactTable> sorted;
+   CsvWriter sort_buffer;
+   if (!options.sort_by.empty())
+   {
+      sorted = std::make_unique<ContactTable>(SORT_TABLE_COLUMNS);
+      if (!stream_input)
+      {
+         // Строки вывода по объему близки к входным: без многократного роста буфера записей
+         sorted->reserve(SORT_RECORD_COLUMN, 0, static_cast<size_t>(input_end - cursor));
+      }
+   }
+
+   // Куда пишутся преобразованные строки
+   CsvWriter &split_sink = shards ? shards->rows() : groups ? groups->rows() : output_file;
+   CsvWriter &sink = merger ? merge_buffer : sorted ? sort_buffer : split_sink;
+   // Вызывается на границах строк: накопленные строки добавляются к слиянию
+   // или к таблице сортировки (тогда в памяти держатся только таблицы), либо раскладываются по частям или группам
+   bool merge_failed = false;
+   bool sort_failed = false;
+   auto row_boundary = [&]
+   {
+      if (merger)
+      {
+         if (merge_buffer.size() >= ContactMerger::UPSERT_BATCH_SIZE && !merge_failed)
+         {
+            merge_failed = !merger->upsert(std::string_view(merge_buffer.data(), merge_buffer.size()), diag);
+            merge_buffer.clear();
+         }
+      }
+      else if (sorted)
+      {
+         if (sort_buffer.size() >= SORT_APPEND_BATCH_SIZE && !sort_failed)
+         {
+            sort_failed = !append_sort_rows(*sorted, std::string_view(sort_buffer.data(), sort_buffer.size()), scratch.field_scratch);
+            sort_buffer.clear();
+         }
+      }
+      else if (shards)
+      {
+         shards->commit();
+      }
+      else if (groups)
+      {
+         groups->commit();
+      }
+   };
+
+   // --- Подготовка выходного файла ---
+   if (!resume && !merger && !shards && !groups && !options.check)
+   {
+      // Записываем UTF-8 BOM (Byte Order Mark) - обязательно для корректного импорта UTF-8 в некоторых программах (включая Google Contacts)
+      output_file.write_raw("\xEF\xBB\xBF");
+
+      // Записываем заголовок в выходной файл
+      output_file.write_raw(OUTPUT_HEADER);
+      output_file.end_row(); // Используем '\n' для новой строки в бинарном режиме
+   }
+
+   if (from_stdin)
+   {
+      // В конвейере готовые строки отдаются дальше до того, как ждать новых данных
+      output_file.flush();
+      // С --pipeline стандартный ввод читает другой поток: вывод сбрасывается, когда ждать приходится разбору
+      (read_ahead_input ? read_ahead.before_read : stdin_stream.before_read) = [&output_file] { output_file.flush(); };
+   }
+
+   if (pool == nullptr)
+   {
+      // Последовательно проходим по записям (запись может занимать несколько строк)
+      stats.start_stages();
+      while (next_record())
+      {
+         stats.lap(Stage::Read);
+         if (process_record(record, next_line_number, settings, scratch, sink, stats))
+         {
+            processed_count++;
+         }
+         row_boundary();
+         stats.end_record();
+      }
+   }
+   else if (!stream_input)
+   {
+      // Отображение уже в памяти - делим его на участки по границам записей
+      OrderedChunkConverter converter(*pool, settings, sink, stats);
+      for (const InputChunk &chunk : split_into_chunks(cursor, input_end, next_line_number, options.chunk_size, *pool))
+      {
+         converter.submit(chunk); // Дописывает в sink только целые участки
+         row_boundary();
+      }
+      processed_count = converter.finish();
+      if (options.incremental && cursor < input_end)
+      {
+         // Номер строки после данных - для состояния следующего прохода
+         next_line_number += static_cast<int>(std::count(cursor, input_end, '\n')) + (input_end[-1] != '\n' ? 1 : 0);
+      }
+   }
+   else
+   {
+      // Потоковое чтение: собираем записи в пакеты примерно по chunk_size байтов.
+      // Копируются исходные байты записи (с '\r' и '\n'), чтобы повторное
+      // сканирование пакета дало те же записи, что и последовательный проход
+      OrderedChunkConverter converter(*pool, settings, sink, stats);
+      auto batch = std::make_shared<std::string>();
+      int batch_line_number = next_line_number;
+      auto submit_batch = [&]
+      {
+         InputChunk chunk{batch->data(), batch->data() + batch->size(), batch_line_number};
+         converter.submit(chunk, batch);
+         row_boundary();
+         batch = std::make_shared<std::string>();
+         batch_line_number = next_line_number;
+      };
+      stats.start_stages();
+      while (next_record())
+      {
+         stats.lap(Stage::Read);
+         batch->append(record.text.data(), record.raw_size);
+         next_line_number += 1 + static_cast<int>(record.embedded_newlines);
+         if (batch->size() >= options.chunk_size)
+         {
+            submit_batch();
+         }
+         stats.end_record(); // Ожидание пула в отправке пакета к чтению не относится
+      }
+      if (!batch->empty())
+      {
+         submit_batch();
+      }
+      processed_count = converter.finish();
+   }
+
+   stats.rows_converted = processed_count;
+   stats.bytes_in = (stream_input ? consumed : input_file.size()) - start_offset;
+   stats.print_summary(diag);
+   if (stats.rejecting())
+   {
+      stats.set_rejects(nullptr);
+      if (!rejects_file.close())
+      {
+         diag << "Ошибка: Не удалось записать файл отклоненных записей: " << options.rejects_file << std::endl;
+         return false;
+      }
+      if (stats.rejected() > 0)
+      {
+         diag << "Отклонено записей: " << stats.rejected() << " (см. " << (options.rejects_file == "-" ? "[стандартный вывод]" : options.rejects_file) << ")." << std::endl;
+      }
+   }
+   if (stream_input && input_stream.failed())
+   {
+      if (!input_stream.decoding_failed())
+      {
+         // Сообщение распаковщика - здесь, а не в потоке чтения наперед
+         if (!decompressed_stream.error().empty())
+         {
+            diag << decompressed_stream.error() << std::endl;
+         }
+         diag << "Ошибка: Не удалось прочитать входной файл: " << input_filename << std::endl;
+      }
+      return false;
+   }
+
+   if (sorted)
+   {
+      if (sort_failed || !append_sort_rows(*sorted, std::string_view(sort_buffer.data(), sort_buffer.size()), scratch.field_scratch))
+      {
+         diag << "Ошибка: Слишком много строк для сортировки в памяти." << std::endl;
+         return false;
+      }
+      for (uint32_t row : sort_contact_rows(*sorted, options.sort_by, pool))
+      {
+         split_sink.write_raw(sorted->field(row, SORT_RECORD_COLUMN));
+         split_sink.end_row();
+         if (shards)
+         {
+            shards->commit();
+         }
+         else if (groups)
+         {
+            groups->commit();
+         }
+      }
+   }
+
+   if (merger)
+   {
+      // Один проход записи: существующие контакты (с обновленными метками), затем новые
+      if (merge_failed || !merger->upsert(std::string_view(merge_buffer.data(), merge_buffer.size()), diag))
+      {
+         return false;
+      }
+      merger->write(output_file);
+      diag << "Слияние с " << options.merge_file << ": обновлено контактов: " << merger->updated_count()
+         << ", добавлено: " << merger->added_count() << std::endl;
+   }
+
+   // --- Завершение работы ---
+   // Закрываем файлы (деструкторы сделали бы это автоматически, но ошибку записи нужно проверить)
+   if (shards)
+   {
+      if (!shards->close(diag))
+      {
+         return false;
+      }
+      stats.bytes_out = shards->bytes_written();
+      diag << "Вывод разбит на части: " << shards->shard_count() << " (" << shard_filename(output_filename, 1)
+         << (shards->shard_count() > 1 ? " - " + shard_filename(output_filename, shards->shard_count()) : std::string()) << ")." << std::endl;
+   }
+   else if (groups)
+   {
+      if (!groups->close(diag))
+      {
+         return false;
+      }
+      stats.bytes_out = groups->bytes_written();
+      diag << "Вывод разбит по группам: " << groups->file_count() << " файлов в " << options.split_by_group_dir << "." << std::endl;
+   }
+   else if (!output_file.close())
+   {
+      diag << "Ошибка: Не удалось записать выходной файл: " << output_filename << std::endl;
+      return false;
+   }
+   else
+   {
+      stats.bytes_out = output_file.bytes_written();
+   }
+
+   if (options.incremental && (transcoded || input_stream.transcoded()))
+   {
+      // Смещения состояния относятся к байтам файла, а читались перекодированные
+      diag << "Предупреждение: Инкрементальный режим поддерживает только входные файлы в UTF-8; состояние не сохранено." << std::endl;
+   }
+   else if (options.incremental)
+   {
+      // Состояние сохраняется только после успешной записи вывода
+      bool terminated = true;
+      state.offset = stream_input ? consumed : input_file.size();
+      state.next_line_number = next_line_number;
+      if (!hash_file_tail(input_filename, state.offset, state.tail_hash, terminated) || !save_incremental_state(state_path, state))
+      {
+         diag << "Предупреждение: Не удалось сохранить состояние инкрементального режима: " << state_path << std::endl;
+      }
+   }
+   stats.success = true;
+   return true;
+}
+
+
+// --- Пакетный режим ---
+
+/**
+ * @brief Задание пакетного режима: один входной файл.
+ */
+struct BatchJob
+{
+   std::string input_filename;
+   std::string output_filename;
+   std::string label; // Значение поля Labels
+};
+
+/**
+ * @brief Итог обработки одного задания пакетного режима.
+ */
+struct BatchJobResult
+{
+   bool success = false;
+   int processed_count = 0;
+   size_t warning_count = 0;
+   double seconds = 0.0;
+   std::string diagnostics; // Предупреждения и ошибки задания
+   std::unique_ptr<ConversionStats> stats; // Для --stats-json (вывод предупреждений уже завершен)
+};
+
+/**
+ * @brief Загружает список заданий: каждая непустая строка - "вход,выход[,метка]".
+ *
+ * Строки разбираются как CSV, поэтому пути с запятыми берутся в кавычки.
+ * Строки, начинающиеся с '#', считаются комментариями.
+ */
+bool load_batch_manifest(const std::string &path, std::vector<BatchJob> &jobs)
+{
+   MappedFile manifest;
+   if (!manifest.open(path))
+   {
+      std::cerr << "Ошибка: Не удалось открыть список заданий: " << path << std::endl;
+      return false;
+   }
+   const char *cursor = manifest.data();
+   const char *const end = cursor + manifest.size();
+   if (manifest.size() >= 3 && std::memcmp(cursor, "\xEF\xBB\xBF", 3) == 0)
+   {
+      cursor += 3; // Пропускаем UTF-8 BOM
+   }
+
+   CsvRecord record;
+   std::vector<std::string_view> fields;
+   std::string scratch;
+   int line_number = 0;
+   while (read_next_record(cursor, end, record))
+   {
+      line_number += 1 + static_cast<int>(record.embedded_newlines);
+      if (record.text.empty() || record.text.front() == '#')
+      {
+         continue;
+      }
+      split_csv_record(record, fields, scratch);
+      if (fields.size() < 2 || fields.size() > 3 || fields[0].empty() || fields[1].empty())
+      {
+         std::cerr << "Ошибка: Строка #" << line_number << " списка заданий должна иметь вид \"вход,выход[,метка]\": " << record.text << std::endl;
+         return false;
+      }
+      jobs.push_back({std::string(fields[0]), std::string(fields[1]), fields.size() > 2 ? std::string(fields[2]) : std::string()});
+   }
+   return true;
+}
+
+/**
+ * @brief Сопоставляет имя файла с шаблоном, где '*' - любая последовательность, '?' - любой символ.
+ */
+bool wildcard_match(std::string_view pattern, std::string_view text)
+{
+   size_t p = 0, t = 0;
+   size_t star = std::string_view::npos, star_text = 0;
+   while (t < text.size())
+   {
+      if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t]))
+      {
+         ++p;
+         ++t;
+      }
+      else if (p < pattern.size() && pattern[p] == '*')
+      {
+         star = p++;
+         star_text = t;
+      }
+      else if (star != std::string_view::npos)
+      {
+         // Откатываемся: '*' поглощает еще один символ
+         p = star + 1;
+         t = ++star_text;
+      }
+      else
+      {
+         return false;
+      }
+   }
+   while (p < pattern.size() && pattern[p] == '*')
+   {
+      ++p;
+   }
+   return p == pattern.size();
+}
+
+/**
+ * @brief Составляет задания по шаблону имени файла (шаблон - только в последней части пути).
+ *
+ * Выходной файл получает имя "<имя>_contacts.csv" в каталоге output_dir
+ * (или рядом с входным), метка - label (если задана --label) или имя
+ * входного файла без расширения.
+ */
+bool expand_batch_glob(const std::string &pattern, const std::string &output_dir, const std::string *label, std::vector<BatchJob> &jobs)
+{
+   namespace fs = std::filesystem;
+   const fs::path pattern_path(pattern);
+   fs::path directory = pattern_path.parent_path();
+   if (directory.empty())
+   {
+      directory = ".";
+   }
+   const std::string name_pattern = pattern_path.filename().string();
+   // Результаты прошлого запуска ("<имя>_contacts.csv" рядом с входами) - не входы,
+   // если только шаблон не называет их явно
+   const bool skip_outputs = name_pattern.find("_contacts") == std::string::npos;
+
+   std::vector<fs::path> inputs;
+   std::error_code error;
+   for (fs::directory_iterator it(directory, error), end; !error && it != end; it.increment(error))
+   {
+      const std::string file_name = it->path().filename().string();
+      if (it->is_regular_file(error) && wildcard_match(name_pattern, file_name)
+         && !(skip_outputs && wildcard_match("*_contacts.csv*", file_name)))
+      {
+         inputs.push_back(it->path());
+      }
+   }
+   if (error)
+   {
+      std::cerr << "Ошибка: Не удалось прочитать каталог " << directory.string() << ": " << error.message() << std::endl;
+      return false;
+   }
+   std::sort(inputs.begin(), inputs.end());
+
+   for (const fs::path &input : inputs)
+   {
+      const fs::path target_dir = output_dir.empty() ? input.parent_path() : fs::path(output_dir);
+      // "ПМ-35.csv.gz" -> "ПМ-35": расширение сжатия отбрасывается вместе с ".csv"
+      const fs::path name = compression_for_path(input.string()) != Compression::None ? input.stem() : input;
+      const fs::path output = target_dir / (name.stem().string() + "_contacts.csv");
+      jobs.push_back({input.string(), output.string(), label != nullptr ? *label : name.stem().string()});
+   }
+   return true;
+}
+
+/**
+ * @brief Проверяет, что ни одно задание пакета не читает файл, который пишет
+ *        какое-либо задание (задания выполняются параллельно: отображенный в
+ *        память вход был бы перезаписан во время чтения).
+ */
+bool check_batch_jobs(const std::vector<BatchJob> &jobs)
+{
+   namespace fs = std::filesystem;
+   // Файлы результатов (в том числе еще не созданные) - по каноническому пути
+   std::vector<std::pair<std::string, size_t>> outputs;
+   for (size_t i = 0; i < jobs.size(); ++i)
+   {
+      std::error_code error;
+      const fs::path output = fs::weakly_canonical(jobs[i].output_filename, error);
+      if (!error)
+      {
+         outputs.emplace_back(output.string(), i);
+      }
+   }
+   std::sort(outputs.begin(), outputs.end());
+   for (const BatchJob &job : jobs)
+   {
+      std::error_code error;
+      const std::string input = fs::weakly_canonical(job.input_filename, error).string();
+      const auto it = std::lower_bound(outputs.begin(), outputs.end(), std::make_pair(input, size_t(0)));
+      if (!error && it != outputs.end() && it->first == input)
+      {
+         std::cerr << "Ошибка: Входной файл " << job.input_filename << " - результат задания "
+            << jobs[it->second].input_filename << " -> " << jobs[it->second].output_filename << "." << std::endl;
+         return false;
+      }
+   }
+   return true;
+}
+
+/**
+ * @brief Обрабатывает все задания в общем пуле потоков и выводит итоги по файлам.
+ *
+ * Задания выполняются параллельно; участки внутри каждого файла ставятся в тот
+ * же пул, так что потоки, освободившиеся от мелких файлов, перехватывают
+ * участки крупных. Предупреждения каждого задания собираются отдельно и
+ * выводятся целиком по мере завершения заданий (в порядке списка).
+ *
+ * @return true, если все задания выполнены успешно.
+ */
+bool run_batch(const Options &options, const std::vector<BatchJob> &jobs, ThreadPool &pool)
+{
+   std::vector<std::future<BatchJobResult>> futures;
+   for (const BatchJob &job : jobs)
+   {
+      Options job_options = options;
+      job_options.input_filename = job.input_filename;
+      job_options.output_filename = job.output_filename;
+      futures.push_back(pool.submit([job_options, &job, &pool]
+      {
+         BatchJobResult result;
+         std::ostringstream diag;
+         result.stats = std::make_unique<ConversionStats>(&diag, job_options.max_warnings, !job_options.stats_json.empty());
+         const auto started = std::chrono::steady_clock::now();
+         result.success = convert_file(job_options, job.label, &pool, diag, *result.stats);
+         result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+         result.diagnostics = diag.str();
+         result.processed_count = result.stats->rows_converted;
+         result.warning_count = result.stats->total_warnings();
+         return result;
+      }));
+   }
+
+   std::vector<BatchJobResult> results;
+   for (size_t i = 0; i < jobs.size(); ++i)
+   {
+      results.push_back(pool.wait(futures[i]));
+      if (!results.back().diagnostics.empty())
+      {
+         std::cerr << "--- " << jobs[i].input_filename << " ---" << std::endl;
+         std::cerr << results.back().diagnostics;
+      }
+   }
+
+   // --- Итоги по файлам ---
+   int total_processed = 0;
+   size_t failed_count = 0;
+   // При --stats-json - стандартный вывод занят статистикой
+   std::ostream &summary = options.stats_json == "-" ? std::cerr : std::cout;
+   summary << "Итоги пакетной обработки (файлов: " << jobs.size() << "):" << std::endl;
+   for (size_t i = 0; i < jobs.size(); ++i)
+   {
+      const BatchJobResult &result = results[i];
+      summary << "  " << (result.success ? "[OK]     " : "[ОШИБКА] ") << jobs[i].input_filename << " -> " << jobs[i].output_filename
+         << ": строк " << result.processed_count << ", предупреждений " << result.warning_count
+         << ", " << static_cast<long long>(result.seconds * 1000.0 + 0.5) << " мс" << std::endl;
+      total_processed += result.processed_count;
+      failed_count += result.success ? 0 : 1;
+   }
+   summary << "Всего обработано строк данных: " << total_processed << ". Файлов с ошибками: " << failed_count << "." << std::endl;
+
+   if (!options.stats_json.empty())
+   {
+      std::vector<FileStatsEntry> entries;
+      for (size_t i = 0; i < jobs.size(); ++i)
+      {
+         entries.push_back({jobs[i].input_filename, jobs[i].output_filename, results[i].stats.get(), results[i].seconds});
+      }
+      if (!write_stats_json(options.stats_json, options, block_classifier_name(), entries))
+      {
+         return false;
+      }
+   }
+   return failed_count == 0;
+}
+
+
+// --- Синтетические выгрузки и замеры производительности ---
+
+/**
+ * @brief Детерминированный генератор псевдослучайных чисел (splitmix64).
+ *
+ * Распределения стандартной библиотеки зависят от реализации, а выгрузки
+ * с одним и тем же --seed должны совпадать на всех платформах.
+ */
+class SyntheticRandom
+{
+public:
+   explicit SyntheticRandom(uint64_t seed) : state_(seed) {}
+
+   uint64_t next()
+   {
+      uint64_t z = (state_ += 0x9E3779B97F4A7C15ull);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      return z ^ (z >> 31);
+   }
+
+   /**
+    * @brief Число из [0, n).
+    */
+   size_t below(size_t n) { return static_cast<size_t>(next() % n); }
+
+   /**
+    * @brief true с вероятностью per_mille / 1000.
+    */
+   bool chance(unsigned per_mille) { return below(1000) < per_mille; }
+
+   template <size_t N>
+   const char *pick(const char *const (&items)[N]) { return items[below(N)]; }
+
+private:
+   uint64_t state_;
+};
+
+/**
+ * @brief Меняет регистр букв из таблицы NAME_CASE на месте (для вариантов ввода "ИВАН", "иван").
+ */
+void change_name_case(std::string &text, bool upper)
+{
+   for (size_t i = 0; i < text.size(); ++i)
+   {
+      const unsigned char lead = static_cast<unsigned char>(text[i]);
+      if (lead < 0x80)
+      {
+         text[i] = static_cast<char>(upper ? NAME_CASE.upper[lead] : NAME_CASE.lower[lead]);
+      }
+      else if ((lead & 0xE0) == 0xC0 && i + 1 < text.size())
+      {
+         const uint16_t cp = static_cast<uint16_t>(((lead & 0x1F) << 6) | (static_cast<unsigned char>(text[i + 1]) & 0x3F));
+         const uint16_t cased = cp < NAME_CASE_RANGE ? (upper ? NAME_CASE.upper[cp] : NAME_CASE.lower[cp]) : cp;
+         text[i] = static_cast<char>(0xC0 | (cased >> 6));
+         text[++i] = static_cast<char>(0x80 | (cased & 0x3F));
+      }
+   }
+}
+
+/**
+ * @brief Записывает синтетическую выгрузку Google Forms с заголовком и rows строками данных.
+ *
+ * Структура столбцов - как у настоящей выгрузки (см. описание входного
+ * файла): кириллица в разном регистре, лишние пробелы между группой и
+ * фамилией, телефоны в разных записях, поля с запятыми, кавычками и
+ * переводами строк (в кавычках), около 2% повторных отправок формы.
+ * Результат определяется только rows и seed.
+ */
+void generate_forms_export(size_t rows, uint64_t seed, CsvWriter &out)
+{
+   static const char *const FIRST_NAMES[] = {"Анна", "Мария", "Елена", "Ольга", "Дарья", "Софья", "Алёна", "Юлия",
+      "Иван", "Пётр", "Алексей", "Дмитрий", "Сергей", "Никита", "Артём", "Михаил", "Анна-Мария", "Ян"};
+   static const char *const LAST_NAMES[] = {"Пономарев", "Иванова", "Смирнов", "Кузнецова", "Попов", "Соколова",
+      "Лебедев", "Козлова", "Новиков", "Морозова", "Петров-Водкин", "Волков", "Ёлкина", "Фёдоров", "Щербаков"};
+   static const char *const GROUPS[] = {"ПМ", "ИВТ", "ПИ", "БИ", "ФИ", "МО"};
+   static const char *const ROLES[] = {"Студент", "Студент", "Студент", "Староста", "Преподаватель"};
+   static const char *const DOMAINS[] = {"mail.ru", "yandex.ru", "gmail.com", "inbox.ru"};
+
+   out.write_raw("Отметка времени,Должность,Имя с большой буквы,\"Группа, Фамилия и подчеркивание\","
+      "Почта 1 (логин от личного кабинета),Почта 2 (созданная почта),Номер телефона");
+   out.end_row();
+
+   SyntheticRandom random(seed);
+   uint64_t clock = 0; // Секунды с 01.09.2024 08:00:00
+   std::string field;
+   char text[64];
+   for (size_t row = 0; row < rows; ++row)
+   {
+      clock += random.below(300);
+      // Повторная отправка формы: те же почта и телефон, что у одной из прошлых строк
+      const size_t person = row > 0 && random.chance(20) ? random.below(row) : row;
+      SyntheticRandom identity(seed ^ (person * 0x2545F4914F6CDD1Dull));
+
+      // 0: Отметка времени (упрощенный календарь: месяцы по 28 дней)
+      const uint64_t day = clock / 86400;
+      std::snprintf(text, sizeof(text), "%02u.%02u.%04u %02u:%02u:%02u", static_cast<unsigned>(day % 28 + 1),
+         static_cast<unsigned>((day / 28 + 8) % 12 + 1), static_cast<unsigned>(2024 + (day / 28 + 8) / 12),
+         static_cast<unsigned>((8 + clock / 3600) % 24), static_cast<unsigned>(clock / 60 % 60), static_cast<unsigned>(clock % 60));
+      out.write_field(text);
+      out.put(',');
+
+      // 1: Должность; изредка с запятой или переводом строки
+      field = random.pick(ROLES);
+      if (random.chance(10))
+      {
+         field += ", заочная форма";
+      }
+      else if (random.chance(5))
+      {
+         field += "\nпереведен(а) из другой группы";
+      }
+      out.write_field(field);
+      out.put(',');
+
+      // 2: Имя - обычно с большой буквы, иногда целиком заглавными или строчными
+      field = identity.pick(FIRST_NAMES);
+      if (random.chance(100))
+      {
+         change_name_case(field, random.chance(500));
+      }
+      out.write_field(field);
+      out.put(',');
+
+      // 3: "Группа Фамилия" с лишними пробелами; изредка фамилия в кавычках
+      std::snprintf(text, sizeof(text), "%s-%zu", identity.pick(GROUPS), 10 + identity.below(50));
+      field = text;
+      field.append(random.chance(200) ? 2 + random.below(3) : 1, ' ');
+      std::string last_name = identity.pick(LAST_NAMES);
+      change_name_case(last_name, !random.chance(150));
+      if (random.chance(5))
+      {
+         last_name = "\"" + last_name + "\"";
+      }
+      field += last_name;
+      out.write_field(field);
+      out.put(',');
+
+      // 4, 5: Почта ЛК и созданная почта
+      std::snprintf(text, sizeof(text), "user%zu@%s", person, identity.pick(DOMAINS));
+      out.write_field(text);
+      out.put(',');
+      std::snprintf(text, sizeof(text), "s%zu.%s@edu.example.ru", person, random.chance(30) ? "PM" : "pm");
+      out.write_field(text);
+      out.put(',');
+
+      // 6: Телефон в одной из распространенных записей (иногда не указан)
+      const unsigned code = 900 + static_cast<unsigned>(identity.below(100));
+      const unsigned number = static_cast<unsigned>(identity.below(10000000));
+      switch (random.below(6))
+      {
+      case 0: std::snprintf(text, sizeof(text), "+7 %u %03u-%02u-%02u", code, number / 10000, number / 100 % 100, number % 100); break;
+      case 1: std::snprintf(text, sizeof(text), "8%u%07u", code, number); break;
+      case 2: std::snprintf(text, sizeof(text), "8 (%u) %03u-%02u-%02u", code, number / 10000, number / 100 % 100, number % 100); break;
+      case 3: std::snprintf(text, sizeof(text), "+7%u%07u", code, number); break;
+      case 4: std::snprintf(text, sizeof(text), "%u%07u", code, number); break;
+      default: std::snprintf(text, sizeof(text), random.chance(100) ? "" : "+7 (%u) %07u", code, number); break;
+      }
+      out.write_field(text);
+      out.end_row();
+   }
+}
+
+/**
+ * @brief Лучшее время из нескольких повторов функции, в секундах.
+ */
+template <typename Function>
+double best_time(int repeats, Function &&function)
+{
+   double best = 0.0;
+   for (int i = 0; i < repeats; ++i)
+   {
+      const auto started = std::chrono::steady_clock::now();
+      function();
+      const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+      best = i == 0 ? seconds : std::min(best, seconds);
+   }
+   return best;
+}
+
+/**
+ * @brief Печатает строку отчета: время, МБ/с и миллионов элементов в секунду.
+ */
+void print_benchmark_line(std::ostream &out, const char *name, double seconds, size_t bytes, size_t items, const char *unit)
+{
+   char line[160];
+   const double safe = std::max(seconds, 1e-9);
+   std::snprintf(line, sizeof(line), "  %-28s %9.2f мс %9.1f МБ/с %9.2f млн %s/с",
+      name, seconds * 1000.0, bytes / safe / (1024.0 * 1024.0), items / safe / 1e6, unit);
+   out << line << std::endl;
+}
+
+/**
+ * @brief Замеры производительности на синтетической выгрузке (--benchmark).
+ *
+ * Микрозамеры отдельных функций на данных в памяти, затем полное
+ * преобразование файла (чтение, разбор, запись) с текущими параметрами
+ * (--threads, --simd, --stream, ...). Каждый замер повторяется, в отчет
+ * идет лучшее время.
+ *
+ * @return false, если не удалось записать или преобразовать временные файлы.
+ */
+bool run_benchmark(const Options &options)
+{
+   const int REPEATS = 5;
+   CsvWriter generated;
+   generate_forms_export(options.bench_rows, options.seed, generated);
+   const std::string_view data(generated.data(), generated.size());
+
+   // Записи и поля выгрузки - исходные данные микрозамеров
+   std::vector<std::string_view> records;
+   std::vector<std::string> fields;
+   std::vector<std::string> group_fields;
+   {
+      const char *cursor = data.data();
+      CsvRecord record;
+      std::vector<std::string_view> parsed;
+      std::string scratch;
+      bool header = true;
+      while (read_next_record(cursor, data.data() + data.size(), record))
+      {
+         if (header)
+         {
+            header = false; // Заголовок в замеры не входит
+            continue;
+         }
+         records.push_back(record.text);
+         split_csv_record(record, parsed, scratch);
+         fields.insert(fields.end(), parsed.begin(), parsed.end());
+         group_fields.emplace_back(parsed[INPUT_IDX_GROUPLASTNAME]);
+      }
+   }
+   size_t field_bytes = 0;
+   for (const std::string &field : fields)
+   {
+      field_bytes += field.size();
+   }
+   size_t group_bytes = 0;
+   for (const std::string &field : group_fields)
+   {
+      group_bytes += field.size();
+   }
+
+   std::cout << "Замеры производительности: строк " << records.size() << ", " << data.size() / 1024 << " КБ, seed " << options.seed
+      << ", ядро " << block_classifier_name() << ", потоков " << std::max(1u, options.threads) << std::endl;
+   std::cout << "Функции:" << std::endl;
+   volatile size_t checksum = 0; // Чтобы компилятор не выбросил результаты замеров
+
+   double seconds = best_time(REPEATS, [&]
+   {
+      const char *cursor = data.data();
+      CsvRecord record;
+      size_t count = 0;
+      while (read_next_record(cursor, data.data() + data.size(), record))
+      {
+         count += record.boundaries.size();
+      }
+      checksum = checksum + count;
+   });
+   print_benchmark_line(std::cout, "read_next_record", seconds, data.size(), records.size(), "записей");
+
+   seconds = best_time(REPEATS, [&]
+   {
+      bool multibyte = false, truncated = false;
+      checksum = checksum + utf8_valid_prefix(data.data(), data.size(), multibyte, truncated);
+   });
+   print_benchmark_line(std::cout, "utf8_valid_prefix", seconds, data.size(), records.size(), "записей");
+
+   seconds = best_time(REPEATS, [&]
+   {
+      std::vector<std::string_view> parsed;
+      std::string scratch;
+      size_t count = 0;
+      for (std::string_view line : records)
+      {
+         parse_csv_line(line, parsed, scratch);
+         count += parsed.size();
+      }
+      checksum = checksum + count;
+   });
+   print_benchmark_line(std::cout, "parse_csv_line", seconds, data.size(), records.size(), "записей");
+
+   seconds = best_time(REPEATS, [&]
+   {
+      std::string formatted;
+      size_t total = 0;
+      for (const std::string &field : fields)
+      {
+         formatted.clear();
+         format_csv_field(field, formatted);
+         total += formatted.size();
+      }
+      checksum = checksum + total;
+   });
+   print_benchmark_line(std::cout, "format_csv_field", seconds, field_bytes, fields.size(), "полей");
+
+   seconds = best_time(REPEATS, [&]
+   {
+      size_t total = 0;
+      for (const std::string &field : group_fields)
+      {
+         std::string_view group, last_name;
+         splitGroupLastName(field, group, last_name);
+         total += group.size() + last_name.size();
+      }
+      checksum = checksum + total;
+   });
+   print_benchmark_line(std::cout, "splitGroupLastName", seconds, group_bytes, group_fields.size(), "полей");
+
+   // --- Полное преобразование файла ---
+   namespace fs = std::filesystem;
+   std::error_code error;
+   const fs::path directory = fs::temp_directory_path(error);
+   const std::string input_path = (directory / "bz4_benchmark_input.csv").string();
+   const std::string output_path = (directory / "bz4_benchmark_output.csv").string();
+   CsvWriter input_file;
+   if (!input_file.open(input_path))
+   {
+      std::cerr << "Ошибка: Не удалось создать временный файл: " << input_path << std::endl;
+      return false;
+   }
+   input_file.write_raw(data);
+   if (!input_file.close())
+   {
+      std::cerr << "Ошибка: Не удалось записать временный файл: " << input_path << std::endl;
+      return false;
+   }
+
+   Options run_options = options;
+   run_options.input_filename = input_path;
+   run_options.output_filename = output_path;
+   std::unique_ptr<ThreadPool> pool;
+   if (options.threads > 1)
+   {
+      pool = std::make_unique<ThreadPool>(options.threads);
+   }
+   bool success = true;
+   int processed_count = 0;
+   std::ostringstream diag;
+   seconds = best_time(REPEATS, [&]
+   {
+      diag.str(std::string());
+      ConversionStats stats(&diag, options.max_warnings, false);
+      success = convert_file(run_options, "Бенчмарк", pool.get(), diag, stats) && success;
+      processed_count = stats.rows_converted;
+   });
+   std::cout << "Преобразование файла:" << std::endl;
+   print_benchmark_line(std::cout, "convert_file", seconds, data.size(), static_cast<size_t>(processed_count), "строк");
+   if (!success)
+   {
+      std::cerr << diag.str();
+   }
+   fs::remove(input_path, error);
+   fs::remove(output_path, error);
+   return success;
+}
+
+
+// --- Консоль ---
+
+/**
+ * @brief Настраивает локаль и кодировку консоли для кириллицы.
+ *
+ * На Windows консоль переводится в кодовую страницу 1251 (ввод и вывод);
+ * в остальных системах терминал работает в кодировке локали (как правило,
+ * UTF-8), и кодовые страницы не нужны.
+ */
+void setup_console()
+{
+   try
+   {
+      setlocale(LC_ALL, ""); // Устанавливаем системную локаль по умолчанию
+   }
+   catch (const std::exception &e)
+   {
+      // Не критичная ошибка, выводим предупреждение
+      std::cerr << "Предупреждение: Не удалось установить локаль. " << e.what() << std::endl;
+   }
+#ifdef _WIN32
+   // Установка кодовых страниц для консоли Windows (1251 для кириллицы)
+   if (!SetConsoleOutputCP(1251))
+   {
+      std::cerr << "Предупреждение: Не удалось установить код. стр. вывода 1251. Ошибка: " << GetLastError() << std::endl;
+   }
+   if (!SetConsoleCP(1251))
+   {
+      std::cerr << "Предупреждение: Не удалось установить код. стр. ввода 1251. Ошибка: " << GetLastError() << std::endl;
+   }
+#endif
+}
+
+/**
+ * @brief Читает строку, введенную с консоли, в кодировке UTF-8.
+ *
+ * На Windows консоль работает в кодовой странице 1251 (см. setup_console),
+ * поэтому введенная кириллица перекодируется в UTF-8, если строка еще не в
+ * UTF-8; в остальных системах ввод возвращается как есть.
+ */
+std::string read_console_line()
+{
+   std::string line;
+   std::getline(std::cin, line);
+#ifdef _WIN32
+   bool has_multibyte = false;
+   bool truncated = false;
+   if (utf8_valid_prefix(line.data(), line.size(), has_multibyte, truncated) != line.size() || truncated)
+   {
+      std::string utf8(line.size() * 3, '\0');
+      utf8.resize(cp1251_to_utf8(line.data(), line.size(), &utf8[0]));
+      line.swap(utf8);
+   }
+#endif
+   return line;
+}
+
+
+// --- Основная логика ---
+
+int main(int argc, char *argv[])
+{
+   setup_console();
+
+   // --- Определение имен входного и выходного файлов и параметров ---
+   Options options;
+   if (!parse_arguments(argc, argv, options))
+   {
+      return 1; // Выход с кодом ошибки
+   }
+
+   if (!options.generate_file.empty())
+   {
+      // Синтетическая выгрузка для замеров и воспроизведения ошибок без настоящих данных
+      CsvWriter generated;
+      if (options.generate_file == "-" ? !generated.open_stdout() : !generated.open(options.generate_file))
+      {
+         std::cerr << "Ошибка: Не удалось открыть выходной файл: " << options.generate_file << std::endl;
+         return 1;
+      }
+      generate_forms_export(options.bench_rows, options.seed, generated);
+      if (!generated.close())
+      {
+         std::cerr << "Ошибка: Не удалось записать выходной файл: " << options.generate_file << std::endl;
+         return 1;
+      }
+      if (!options.benchmark)
+      {
+         return 0;
+      }
+   }
+   if (options.benchmark)
+   {
+      return run_benchmark(options) ? 0 : 1;
+   }
+
+   if (options.batch_mode())
+   {
+      // Пакетный режим: метки заданы в списке заданий, консоль не опрашивается
+      std::vector<BatchJob> jobs;
+      const bool loaded = !options.batch_manifest.empty() ? load_batch_manifest(options.batch_manifest, jobs)
+                                                          : expand_batch_glob(options.batch_glob, options.output_dir, options.label_given ? &options.label : nullptr, jobs);
+      if (!loaded || !check_batch_jobs(jobs))
+      {
+         return 1;
+      }
+      if (jobs.empty())
+      {
+         std::cerr << "Предупреждение: Нет файлов для обработки." << std::endl;
+         return 0;
+      }
+      ThreadPool pool(options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency()));
+      return run_batch(options, jobs, pool) ? 0 : 1;
+   }
+
+   // Когда данные, статистика или отклоненные записи идут в стандартный вывод, сообщения программы выводятся в поток ошибок
+   std::ostream &info = options.output_filename == "-" || options.stats_json == "-" || options.rejects_file == "-" ? std::cerr : std::cout;
+   info << "Чтение из файла: " << (options.input_filename == "-" ? "[стандартный ввод]" : options.input_filename) << std::endl;
+   if (options.check)
+   {
+      info << "Только проверка: результат не записывается." << std::endl;
+   }
+   else if (!options.split_by_group_dir.empty())
+   {
+      info << "Запись в каталог: " << options.split_by_group_dir << " (файл на группу, кодировка UTF-8 с BOM)" << std::endl;
+   }
+   else
+   {
+      const Compression output_compression = options.output_filename == "-" ? Compression::None : compression_for_path(options.output_filename);
+      info << "Запись в файл:   " << (options.output_filename == "-" ? "[стандартный вывод]" : options.output_filename) << " (кодировка UTF-8 с BOM";
+      if (output_compression != Compression::None)
+      {
+         info << ", сжатие " << compression_name(output_compression);
+      }
+      info << ")" << std::endl;
+   }
+
+   // --- Запрос названия группы контактов (для поля Labels) ---
+   std::string contact_group_label = options.label;
+   if (!options.label_given && options.input_filename != "-" && !options.check)
+   {
+      info << "Введите название для группы контактов (оставьте пустым, если не нужно): ";
+      // Читаем всю строку, включая пробелы
+      contact_group_label = read_console_line();
+   }
+   // Если данные идут со стандартного ввода, метку можно задать только через --label
+   if (!options.check)
+   {
+      info << "Используется метка группы: '" << (contact_group_label.empty() ? "[ПУСТО]" : contact_group_label) << "'" << std::endl;
+   }
+   // --- Конец запроса ---
+
+   // Пул потоков нужен только для параллельного режима (--threads больше 1)
+   std::unique_ptr<ThreadPool> pool;
+   if (options.threads > 1)
+   {
+      pool = std::make_unique<ThreadPool>(options.threads);
+   }
+
+   ConversionStats stats(&std::cerr, options.max_warnings, !options.stats_json.empty());
+   const bool converted = convert_file(options, contact_group_label, pool.get(), std::cerr, stats);
+   std::cerr.flush(); // Предупреждения пишутся без сброса после каждой строки
+   if (!options.stats_json.empty()
+      && !write_stats_json(options.stats_json, options, block_classifier_name(), {{options.input_filename, options.split_by_group_dir.empty() ? options.output_filename : options.split_by_group_dir, &stats, stats.elapsed_seconds()}}))
+   {
+      return 1;
+   }
+   if (!converted)
+   {
+      return 1;
+   }
+
+   if (options.check)
+   {
+      // Пустые строки при импорте просто пропускаются и замечанием не считаются
+      size_t problems = 0;
+      for (size_t i = 0; i < WARNING_KIND_COUNT; ++i)
+      {
+         problems += static_cast<WarningKind>(i) == WarningKind::EmptyLine ? 0 : stats.warnings(static_cast<WarningKind>(i));
+      }
+      info << "Проверка завершена. Проверено строк данных: " << stats.rows_converted
+         << (options.sample_stride > 1 ? " (каждая " + std::to_string(options.sample_stride) + "-я запись)" : std::string())
+         << ", замечаний: " << problems << "." << std::endl;
+      return problems == 0 ? 0 : 2;
+   }
 
-   // Закрываем файлы (хотя деструкторы ifstream/ofstream сделают это автоматически при выходе из main)
-   input_file.close();
-   output_file.close();
+   info << "Обработка завершена. Успешно обработано строк данных: " << stats.rows_converted << "." << std::endl;
 
    return 0;
 }
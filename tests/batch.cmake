@@ -0,0 +1,18 @@
+# --batch-glob: повторный запуск не подбирает свои же результаты *_contacts.csv;
+# --batch: вход задания не может быть результатом другого задания.
+
+include("${CMAKE_CURRENT_LIST_DIR}/bz4_test.cmake")
+
+file(MAKE_DIRECTORY "${WORK_DIR}/exports")
+bz4_copy(forms.csv AS exports/a.csv)
+bz4_copy(forms.csv AS exports/b.csv)
+
+bz4_run(--label Тест --batch-glob exports/*.csv)
+bz4_run(--label Тест --batch-glob exports/*.csv)
+bz4_expect_files(exports a.csv a_contacts.csv b.csv b_contacts.csv)
+bz4_compare(exports/a_contacts.csv forms.expected.csv)
+bz4_compare(exports/b_contacts.csv forms.expected.csv)
+
+file(WRITE "${WORK_DIR}/jobs.csv" "exports/a.csv,x.csv\nx.csv,y.csv\n")
+bz4_run(--label Тест --batch jobs.csv EXIT_CODE 1 ERROR_MATCH "результат задания exports/a.csv -> x.csv")
+bz4_expect_files(. exports jobs.csv)
@@ -0,0 +1,82 @@
+# Общие функции проверок (подключаются из сценариев, запускаемых через cmake -P).
+#
+# Параметры сценария:
+#   BZ4         Проверяемая программа.
+#   SOURCE_DIR  Каталог tests с входами и эталонами.
+#   WORK_DIR    Рабочий каталог проверки (очищается перед началом).
+#   WITH_ZLIB   Программа собрана с поддержкой .gz.
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+# bz4_copy(ФАЙЛ... [AS ИМЯ]) - копирует файлы из SOURCE_DIR в рабочий каталог
+# (с AS - один файл под другим именем).
+function(bz4_copy)
+   cmake_parse_arguments(COPY "" "AS" "" ${ARGN})
+   if(COPY_AS)
+      configure_file("${SOURCE_DIR}/${COPY_UNPARSED_ARGUMENTS}" "${WORK_DIR}/${COPY_AS}" COPYONLY)
+      return()
+   endif()
+   foreach(name ${COPY_UNPARSED_ARGUMENTS})
+      configure_file("${SOURCE_DIR}/${name}" "${WORK_DIR}/${name}" COPYONLY)
+   endforeach()
+endfunction()
+
+# bz4_run(ПАРАМЕТРЫ... [EXIT_CODE N] [STDIN ФАЙЛ] [STDOUT ФАЙЛ] [ERROR_MATCH ВЫРАЖЕНИЕ])
+# Запускает программу в рабочем каталоге и проверяет код возврата (по умолчанию 0)
+# и, с ERROR_MATCH, сообщения в stderr.
+function(bz4_run)
+   cmake_parse_arguments(RUN "" "EXIT_CODE;STDIN;STDOUT;ERROR_MATCH" "" ${ARGN})
+   if(NOT DEFINED RUN_EXIT_CODE)
+      set(RUN_EXIT_CODE 0)
+   endif()
+   set(redirect)
+   if(RUN_STDIN)
+      list(APPEND redirect INPUT_FILE "${WORK_DIR}/${RUN_STDIN}")
+   endif()
+   if(RUN_STDOUT)
+      list(APPEND redirect OUTPUT_FILE "${WORK_DIR}/${RUN_STDOUT}")
+   else()
+      list(APPEND redirect OUTPUT_QUIET)
+   endif()
+   execute_process(COMMAND "${BZ4}" ${RUN_UNPARSED_ARGUMENTS}
+      WORKING_DIRECTORY "${WORK_DIR}"
+      RESULT_VARIABLE result
+      ERROR_VARIABLE errors
+      ${redirect})
+   string(REPLACE ";" " " command "${RUN_UNPARSED_ARGUMENTS}")
+   if(NOT result STREQUAL "${RUN_EXIT_CODE}")
+      message(FATAL_ERROR "bz4 ${command}: код возврата ${result}, ожидался ${RUN_EXIT_CODE}:\n${errors}")
+   endif()
+   if(RUN_ERROR_MATCH AND NOT errors MATCHES "${RUN_ERROR_MATCH}")
+      message(FATAL_ERROR "bz4 ${command}: в сообщениях нет \"${RUN_ERROR_MATCH}\":\n${errors}")
+   endif()
+endfunction()
+
+# bz4_compare(РЕЗУЛЬТАТ ЭТАЛОН) - побайтное сравнение файла рабочего каталога
+# с эталоном из SOURCE_DIR (или с файлом по абсолютному пути).
+function(bz4_compare actual expected)
+   if(NOT IS_ABSOLUTE "${expected}")
+      set(expected "${SOURCE_DIR}/${expected}")
+   endif()
+   if(NOT EXISTS "${WORK_DIR}/${actual}")
+      message(FATAL_ERROR "Нет файла результата ${actual}")
+   endif()
+   execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files "${WORK_DIR}/${actual}" "${expected}"
+      RESULT_VARIABLE different)
+   if(different)
+      file(READ "${WORK_DIR}/${actual}" content)
+      message(FATAL_ERROR "Результат ${actual} отличается от ${expected}:\n${content}")
+   endif()
+endfunction()
+
+# bz4_expect_files(КАТАЛОГ ИМЯ...) - в каталоге рабочего каталога ровно эти файлы.
+function(bz4_expect_files directory)
+   file(GLOB found RELATIVE "${WORK_DIR}/${directory}" "${WORK_DIR}/${directory}/*")
+   list(SORT found)
+   set(expected ${ARGN})
+   list(SORT expected)
+   if(NOT found STREQUAL expected)
+      message(FATAL_ERROR "В ${directory}: ${found}, ожидалось: ${expected}")
+   endif()
+endfunction()
@@ -0,0 +1,21 @@
+# Отказы: вход не перезаписывается результатом, оборванный .gz и некорректный
+# размер блока дают понятную ошибку.
+
+include("${CMAKE_CURRENT_LIST_DIR}/bz4_test.cmake")
+
+bz4_copy(forms.csv AS same.csv)
+bz4_run(--label Тест same.csv same.csv EXIT_CODE 1 ERROR_MATCH "нельзя перезаписать")
+bz4_run(--label Тест --stream same.csv same.csv EXIT_CODE 1 ERROR_MATCH "нельзя перезаписать")
+bz4_run(--label Тест --rejects same.csv same.csv out.csv EXIT_CODE 1 ERROR_MATCH "нельзя перезаписать")
+bz4_run(--label Тест --stats-json same.csv same.csv out.csv EXIT_CODE 1 ERROR_MATCH "нельзя перезаписать")
+bz4_compare(same.csv forms.csv)
+
+if(WITH_ZLIB)
+   bz4_copy(forms_truncated.csv.gz)
+   bz4_run(--label Тест forms_truncated.csv.gz out.csv EXIT_CODE 1 ERROR_MATCH "Сжатый входной файл оборван")
+   bz4_run(--label Тест - out.csv STDIN forms_truncated.csv.gz EXIT_CODE 1 ERROR_MATCH "Сжатый входной файл оборван")
+endif()
+
+bz4_run(--label Тест --chunk-size -1 same.csv out.csv EXIT_CODE 1 ERROR_MATCH "Некорректный размер блока: -1")
+bz4_run(--label Тест --chunk-size 99999999999999999999K same.csv out.csv EXIT_CODE 1 ERROR_MATCH "Некорректный размер блока")
+bz4_run(--label Тест --chunk-size 1G same.csv out.csv EXIT_CODE 1 ERROR_MATCH "больше 256M")
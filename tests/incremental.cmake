@@ -0,0 +1,20 @@
+# --incremental: второй запуск дописывает только новые строки пополненной выгрузки.
+
+include("${CMAKE_CURRENT_LIST_DIR}/bz4_test.cmake")
+
+# Начало выгрузки - до короткой строки #5
+file(READ "${SOURCE_DIR}/forms.csv" forms)
+string(FIND "${forms}" "01.09.2024 08:12:00" cut)
+string(SUBSTRING "${forms}" 0 ${cut} head)
+file(WRITE "${WORK_DIR}/in.csv" "${head}")
+bz4_run(--label Тест --incremental in.csv out.csv)
+
+# Пополненная выгрузка; файл отклоненных создается при продолжении и получает заголовок
+bz4_copy(forms.csv AS in.csv)
+bz4_run(--label Тест --incremental --rejects rejects.csv in.csv out.csv)
+bz4_compare(out.csv forms.expected.csv)
+bz4_compare(rejects.csv forms_rejects.expected.csv)
+
+# Без новых строк вывод не меняется
+bz4_run(--label Тест --incremental in.csv out.csv)
+bz4_compare(out.csv forms.expected.csv)
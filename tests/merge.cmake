@@ -0,0 +1,15 @@
+# --merge: слияние с существующим CSV контактов в тот же файл.
+
+include("${CMAKE_CURRENT_LIST_DIR}/bz4_test.cmake")
+
+bz4_copy(forms.csv)
+
+# Другой набор столбцов, имена в заголовке с экранированными кавычками
+bz4_copy(merge_quoted_header.csv AS contacts.csv)
+bz4_run(--label Новые --merge contacts.csv forms.csv contacts.csv)
+bz4_compare(contacts.csv merge_quoted_header.expected.csv)
+
+# Файл Google Contacts от прошлого преобразования: совпавшие по почте получают вторую метку
+bz4_copy(forms.expected.csv AS google.csv)
+bz4_run(--label Новые --merge google.csv forms.csv google.csv)
+bz4_compare(google.csv merge_contacts.expected.csv)
@@ -0,0 +1,49 @@
+# Потоки, потоковое чтение, конвейер, стандартные ввод и вывод дают побайтно
+# тот же результат, что и последовательное преобразование отображенного файла.
+
+include("${CMAKE_CURRENT_LIST_DIR}/bz4_test.cmake")
+
+# Синтетическая выгрузка: кириллица, поля с кавычками и переводами строк, повторы
+bz4_run(--generate gen.csv --rows 20000 --seed 7)
+bz4_run(--label Тест gen.csv serial.csv)
+set(serial "${WORK_DIR}/serial.csv")
+
+# Мелкие участки и блоки: записи с переводами строк попадают на их границы
+bz4_run(--label Тест --threads 4 --chunk-size 64K gen.csv threads.csv)
+bz4_compare(threads.csv "${serial}")
+bz4_run(--label Тест --stream --chunk-size 4K gen.csv stream.csv)
+bz4_compare(stream.csv "${serial}")
+bz4_run(--label Тест --pipeline --chunk-size 4K gen.csv pipeline.csv)
+bz4_compare(pipeline.csv "${serial}")
+bz4_run(--label Тест --threads 4 --pipeline --chunk-size 16K gen.csv threads_pipeline.csv)
+bz4_compare(threads_pipeline.csv "${serial}")
+bz4_run(--label Тест --simd scalar gen.csv scalar.csv)
+bz4_compare(scalar.csv "${serial}")
+
+# Стандартный ввод и вывод
+bz4_run(--label Тест --pipeline - stdin.csv STDIN gen.csv)
+bz4_compare(stdin.csv "${serial}")
+bz4_run(--label Тест gen.csv - STDOUT stdout.csv)
+bz4_compare(stdout.csv "${serial}")
+bz4_run(--label Тест - - STDIN gen.csv STDOUT stdin_stdout.csv)
+bz4_compare(stdin_stdout.csv "${serial}")
+
+# Обработка с преобразованиями, повторами и сортировкой в несколько потоков
+foreach(options "--normalize-phone;--name-case" "--dedup;email" "--dedup;phone;--dedup-keep;latest" "--sort-by;group,lastname")
+   string(REGEX REPLACE "[-;,]+" "_" name "${options}")
+   string(REGEX REPLACE "^_" "" name "${name}")
+   bz4_run(--label Тест ${options} gen.csv ${name}_serial.csv)
+   bz4_run(--label Тест ${options} --threads 4 --chunk-size 64K gen.csv ${name}_threads.csv)
+   bz4_compare(${name}_threads.csv "${WORK_DIR}/${name}_serial.csv")
+   bz4_run(--label Тест ${options} --stream --chunk-size 4K gen.csv ${name}_stream.csv)
+   bz4_compare(${name}_stream.csv "${WORK_DIR}/${name}_serial.csv")
+endforeach()
+
+# Сжатый вход - в файле и на стандартном вводе
+if(WITH_ZLIB)
+   bz4_copy(forms.csv.gz)
+   bz4_run(--label Тест forms.csv.gz forms.csv)
+   bz4_compare(forms.csv forms.expected.csv)
+   bz4_run(--label Тест - forms_stdin.csv STDIN forms.csv.gz)
+   bz4_compare(forms_stdin.csv forms.expected.csv)
+endif()
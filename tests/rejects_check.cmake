@@ -0,0 +1,22 @@
+# --rejects: отклоненные записи в отдельном CSV, результат тот же;
+# --check: ничего не записывает, код возврата 2 при замечаниях.
+
+include("${CMAKE_CURRENT_LIST_DIR}/bz4_test.cmake")
+
+bz4_copy(forms.csv sort_long_keys.csv)
+
+bz4_run(--label Тест --rejects rejects.csv forms.csv out.csv)
+bz4_compare(out.csv forms.expected.csv)
+bz4_compare(rejects.csv forms_rejects.expected.csv)
+
+# В стандартный вывод, и не вместе с результатом
+bz4_run(--label Тест --rejects - forms.csv out_stdout.csv STDOUT rejects_stdout.csv)
+bz4_compare(rejects_stdout.csv forms_rejects.expected.csv)
+bz4_run(--label Тест --rejects - forms.csv - EXIT_CODE 1 ERROR_MATCH "не могут выводиться в стандартный вывод")
+
+bz4_run(--check forms.csv EXIT_CODE 2
+   ERROR_MATCH "Строка #7: не удалось привести номер телефона.*Строка #9: почта неверного вида")
+# Через строку: строки #7 и #9 с замечаниями не проверяются
+bz4_run(--check --sample 2 forms.csv)
+bz4_run(--check sort_long_keys.csv)
+bz4_expect_files(. forms.csv out.csv out_stdout.csv rejects.csv rejects_stdout.csv sort_long_keys.csv)
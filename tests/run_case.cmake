@@ -0,0 +1,10 @@
+# Прогон одного случая: bz4 ARGS INPUT out.csv, сравнение с EXPECTED.
+#
+#   cmake -DBZ4=<программа> -DSOURCE_DIR=<tests> -DWORK_DIR=<каталог>
+#         -DINPUT=<вход> -DEXPECTED=<эталон> -DARGS=<параметры через ;> -P run_case.cmake
+
+include("${CMAKE_CURRENT_LIST_DIR}/bz4_test.cmake")
+
+bz4_copy(${INPUT})
+bz4_run(${ARGS} ${INPUT} out.csv)
+bz4_compare(out.csv ${EXPECTED})
@@ -0,0 +1,28 @@
+# Разбиение вывода на части (--max-rows-per-file) и файлы групп (--split-by-group).
+
+include("${CMAKE_CURRENT_LIST_DIR}/bz4_test.cmake")
+
+bz4_copy(forms.csv)
+
+# Части с заголовком, не больше трех строк данных каждая
+file(MAKE_DIRECTORY "${WORK_DIR}/parts")
+bz4_run(--label Тест --max-rows-per-file 3 forms.csv parts/out.csv)
+bz4_expect_files(parts out_001.csv out_002.csv out_003.csv)
+foreach(part 001 002 003)
+   bz4_compare(parts/out_${part}.csv forms_part_${part}.expected.csv)
+endforeach()
+bz4_run(--label Тест --threads 4 --max-rows-per-file 3 forms.csv parts/out.csv)
+foreach(part 001 002 003)
+   bz4_compare(parts/out_${part}.csv forms_part_${part}.expected.csv)
+endforeach()
+
+# Файл на группу; строки без группы - в без_группы.csv
+set(groups ИВТб-21-01.csv ИС-6.csv МО-23.csv ПМ-35.csv без_группы.csv)
+bz4_run(--label Тест --split-by-group groups forms.csv)
+bz4_expect_files(groups ${groups})
+foreach(group ${groups})
+   bz4_compare(groups/${group} forms_groups/${group})
+endforeach()
+
+# Выходной файл вместе с каталогом групп не задается
+bz4_run(--label Тест --split-by-group groups2 forms.csv out.csv EXIT_CODE 1 ERROR_MATCH "выходной файл не задается")